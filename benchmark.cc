@@ -9,36 +9,46 @@
 #include <chrono>
 #include <map>
 #include <cstdlib>
+#include <sstream>
+#include <limits>
+#include <stdexcept>
+#include <atomic>
+#include <future>
+#include <tuple>
+#include <thread>
+#include <fstream>
+#include <cstdio>
+#include <new>
+
+#include "median_filter.h"
+#include "median_filter_internal.h"
+
+// Every allocation through operator new in the process, so that tests can
+// check that a call allocates nothing
+static std::atomic<long> allocationCount{0};
+
+void *operator new(size_t size) {
+    allocationCount++;
+    if (void *p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+// Out of line, or GCC flags the free() of a pointer from a new expression
+__attribute__((noinline)) void operator delete(void *p) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept { std::free(p); }
 
 // Function pointer types for different data types
 typedef void (*MedianFilterFuncFloat)(const float *input, float *output, int ny, int nx, int hy, int hx);
 typedef void (*MedianFilterFuncUint8)(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx);
+typedef void (*MedianFilterFuncUint16)(const uint16_t *input, uint16_t *output, int ny, int nx, int hy, int hx);
 
 // Enum for data types
 enum class DataType {
     FLOAT,
-    UINT8
+    UINT8,
+    UINT16
 };
 
-// Include all the median filter versions
-extern void median_filterv1(const float *input, float *output, int ny, int nx, int hy, int hx);
-extern void median_filterv2(const float *input, float *output, int ny, int nx, int hy, int hx);
-extern void median_filterv3(const float *input, float *output, int ny, int nx, int hy, int hx);
-
-// v4 is only available on x86_64 architectures
-#ifdef HAVE_MFV4
-extern void median_filterv4(const float *input, float *output, int ny, int nx, int hy, int hx);
-#endif
-
-// v5+ use uint8_t
-extern void median_filterv5(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx);
-
-// OpenCV implementations (if available)
-#ifdef HAVE_OPENCV
-extern void median_filter_opencv_float(const float *input, float *output, int ny, int nx, int hy, int hx);
-extern void median_filter_opencv_uint8(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx);
-#endif
-
 // Registry for median filter versions
 struct FilterVersion {
     std::string name;
@@ -46,6 +56,7 @@ struct FilterVersion {
     union {
         MedianFilterFuncFloat floatFunc;
         MedianFilterFuncUint8 uint8Func;
+        MedianFilterFuncUint16 uint16Func;
     } func;
     std::string description;
 };
@@ -69,6 +80,7 @@ public:
 
         // v5+ use uint8_t
         registerUint8Version("v5", median_filterv5, "Histogram-based median for 8-bit images");
+        registerUint16Version("v6", median_filterv6, "Two-level histogram median for 16-bit images");
         
         // OpenCV implementations (if available)
 #ifdef HAVE_OPENCV
@@ -97,6 +109,25 @@ public:
         versions_.push_back(version);
     }
     
+    // Easy way to add new uint16 versions
+    void registerUint16Version(const std::string& name, MedianFilterFuncUint16 func, const std::string& description) {
+        FilterVersion version;
+        version.name = name;
+        version.dataType = DataType::UINT16;
+        version.func.uint16Func = func;
+        version.description = description;
+        versions_.push_back(version);
+    }
+    
+    static const char* typeName(DataType type) {
+        switch (type) {
+            case DataType::FLOAT: return "float";
+            case DataType::UINT8: return "uint8";
+            case DataType::UINT16: return "uint16";
+        }
+        return "?";
+    }
+    
     // Reference implementation for ground truth (uses standard library sort)
     void referenceMedianFilter(const float *input, float *output, int ny, int nx, int hy, int hx) {
         std::vector<float> pixels((2 * hy + 1) * (2 * hx + 1));
@@ -125,9 +156,10 @@ public:
         }
     }
     
-    // Reference implementation for uint8_t
-    void referenceMedianFilterUint8(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx) {
-        std::vector<uint8_t> pixels((2 * hy + 1) * (2 * hx + 1));
+    // Reference implementation for integer images (uint8_t, uint16_t)
+    template <typename T>
+    void referenceMedianFilterInt(const T *input, T *output, int ny, int nx, int hy, int hx) {
+        std::vector<T> pixels((2 * hy + 1) * (2 * hx + 1));
         
         for(int y = 0; y < ny; y++) {
             for(int x = 0; x < nx; x++) {
@@ -147,13 +179,222 @@ public:
                 if (len % 2 == 1) {
                     output[nx * y + x] = pixels[mid];
                 } else {
-                    // For uint8, use proper rounding
+                    // For integers, use proper rounding
                     output[nx * y + x] = (pixels[mid] + pixels[mid - 1] + 1) / 2;
                 }
             }
         }
     }
     
+    // Reference median under a padding border mode: out-of-image pixels are
+    // looked up by mirroring, wrapping or clamping, or take `constant`
+    template <typename T>
+    void referenceBorderMedianFilter(const T *input, T *output, int ny, int nx, int hy, int hx,
+                                     MedianBorder border, T constant) {
+        auto source = [&](int i, int n) {
+            if (border == MedianBorder::Constant) return (i >= 0 && i < n) ? i : -1;
+            if (border == MedianBorder::Replicate) return std::min(std::max(i, 0), n - 1);
+            if (border == MedianBorder::Wrap) return ((i % n) + n) % n;
+            while (i < 0 || i >= n) i = i < 0 ? -i - 1 : 2 * n - 1 - i;
+            return i;
+        };
+        
+        std::vector<T> pixels;
+        for(int y = 0; y < ny; y++) {
+            for(int x = 0; x < nx; x++) {
+                pixels.clear();
+                for(int i = y - hy; i <= y + hy; i++) {
+                    for(int j = x - hx; j <= x + hx; j++) {
+                        int r = source(i, ny), c = source(j, nx);
+                        pixels.push_back((r < 0 || c < 0) ? constant : input[nx * r + c]);
+                    }
+                }
+                std::sort(pixels.begin(), pixels.end());
+                output[nx * y + x] = pixels[pixels.size() / 2];
+            }
+        }
+    }
+    
+    // Reference rank filter: sort each window and take the rank the spec selects
+    template <typename T>
+    void referenceRankFilter(const T *input, T *output, int ny, int nx, int hy, int hx, MedianRank rank,
+                             MedianBorder border) {
+        const int full = (2 * hy + 1) * (2 * hx + 1);
+        auto source = [&](int i, int n) {
+            if (i >= 0 && i < n) return i;
+            if (border == MedianBorder::Shrink || border == MedianBorder::Constant) return -1;
+            if (border == MedianBorder::Replicate) return std::min(std::max(i, 0), n - 1);
+            if (border == MedianBorder::Wrap) return ((i % n) + n) % n;
+            while (i < 0 || i >= n) i = i < 0 ? -i - 1 : 2 * n - 1 - i;
+            return i;
+        };
+        
+        std::vector<T> pixels;
+        for(int y = 0; y < ny; y++) {
+            for(int x = 0; x < nx; x++) {
+                pixels.clear();
+                for(int i = y - hy; i <= y + hy; i++) {
+                    for(int j = x - hx; j <= x + hx; j++) {
+                        int r = source(i, ny), c = source(j, nx);
+                        if (r >= 0 && c >= 0) pixels.push_back(input[nx * r + c]);
+                        else if (border == MedianBorder::Constant) pixels.push_back(T(0));
+                    }
+                }
+                std::sort(pixels.begin(), pixels.end());
+                output[nx * y + x] = pixels[median_rank_index(rank, (int)pixels.size(), full)];
+            }
+        }
+    }
+    
+    // Reference weighted median: every pixel counts as often as its weight, as
+    // if repeated, found by walking the sorted (value, weight) pairs
+    template <typename T>
+    void referenceWeightedMedianFilter(const T *input, T *output, int ny, int nx, int hy, int hx,
+                                       const std::vector<int>& weights, MedianBorder border) {
+        auto source = [&](int i, int n) {
+            if (i >= 0 && i < n) return i;
+            if (border == MedianBorder::Shrink || border == MedianBorder::Constant) return -1;
+            if (border == MedianBorder::Replicate) return std::min(std::max(i, 0), n - 1);
+            if (border == MedianBorder::Wrap) return ((i % n) + n) % n;
+            while (i < 0 || i >= n) i = i < 0 ? -i - 1 : 2 * n - 1 - i;
+            return i;
+        };
+        
+        std::vector<std::pair<T, int>> pixels;
+        for(int y = 0; y < ny; y++) {
+            for(int x = 0; x < nx; x++) {
+                pixels.clear();
+                long long total = 0;
+                for(int dy = -hy; dy <= hy; dy++) {
+                    for(int dx = -hx; dx <= hx; dx++) {
+                        int r = source(y + dy, ny), c = source(x + dx, nx);
+                        int w = weights[(dy + hy) * (2 * hx + 1) + (dx + hx)];
+                        if (w == 0) continue;
+                        if (r >= 0 && c >= 0) pixels.push_back({input[nx * r + c], w});
+                        else if (border == MedianBorder::Constant) pixels.push_back({T(0), w});
+                        else continue;
+                        total += w;
+                    }
+                }
+                if (pixels.empty()) {
+                    output[nx * y + x] = T(0);
+                    continue;
+                }
+                std::sort(pixels.begin(), pixels.end());
+                // The value at a weighted rank
+                auto at = [&](long long rank) {
+                    for(const auto& p : pixels) {
+                        if (rank < p.second) return p.first;
+                        rank -= p.second;
+                    }
+                    return pixels.back().first;
+                };
+                const long long mid = total / 2;
+                if (total % 2 == 1) {
+                    output[nx * y + x] = at(mid);
+                } else if (std::is_floating_point<T>::value) {
+                    output[nx * y + x] = T(0.5f * (at(mid) + at(mid - 1)));
+                } else {
+                    output[nx * y + x] = T((int(at(mid - 1)) + int(at(mid)) + 1) / 2);
+                }
+            }
+        }
+    }
+    
+    // Reference 3D median with shrinking windows, by sorting every window
+    template <typename T>
+    void referenceMedianFilter3d(const T *input, T *output, int nz, int ny, int nx, int hz, int hy, int hx) {
+        std::vector<T> voxels;
+        for(int z = 0; z < nz; z++) {
+            for(int y = 0; y < ny; y++) {
+                for(int x = 0; x < nx; x++) {
+                    voxels.clear();
+                    for(int k = std::max(z - hz, 0); k <= std::min(z + hz, nz - 1); k++)
+                        for(int i = std::max(y - hy, 0); i <= std::min(y + hy, ny - 1); i++)
+                            for(int j = std::max(x - hx, 0); j <= std::min(x + hx, nx - 1); j++)
+                                voxels.push_back(input[(size_t(k) * ny + i) * nx + j]);
+                    std::sort(voxels.begin(), voxels.end());
+                    const size_t mid = voxels.size() / 2;
+                    T &out = output[(size_t(z) * ny + y) * nx + x];
+                    if (voxels.size() % 2 == 1) {
+                        out = voxels[mid];
+                    } else if (std::is_floating_point<T>::value) {
+                        out = T(0.5f * (voxels[mid] + voxels[mid - 1]));
+                    } else {
+                        out = T((int(voxels[mid - 1]) + int(voxels[mid]) + 1) / 2);
+                    }
+                }
+            }
+        }
+    }
+    
+    // Reference masked median: only pixels with mask != 0 take part, empty windows get fill
+    void referenceMaskedMedianFilter(const float *input, const uint8_t *mask, float *output,
+                                     int ny, int nx, int hy, int hx, float fill) {
+        std::vector<float> pixels((2 * hy + 1) * (2 * hx + 1));
+        
+        for(int y = 0; y < ny; y++) {
+            for(int x = 0; x < nx; x++) {
+                int len = 0;
+                for(int i = std::max(y - hy, 0); i < std::min(y + hy + 1, ny); i++) {
+                    for(int j = std::max(x - hx, 0); j < std::min(x + hx + 1, nx); j++) {
+                        if (mask[nx * i + j]) pixels[len++] = input[nx * i + j];
+                    }
+                }
+                
+                if (len == 0) {
+                    output[nx * y + x] = fill;
+                    continue;
+                }
+                
+                std::sort(pixels.begin(), pixels.begin() + len);
+                const int mid = len / 2;
+                output[nx * y + x] = (len % 2 == 1) ? pixels[mid] : 0.5f * (pixels[mid] + pixels[mid - 1]);
+            }
+        }
+    }
+    
+    void referenceMaskedMedianFilterUint8(const uint8_t *input, const uint8_t *mask, uint8_t *output,
+                                          int ny, int nx, int hy, int hx, uint8_t fill) {
+        std::vector<uint8_t> pixels((2 * hy + 1) * (2 * hx + 1));
+        
+        for(int y = 0; y < ny; y++) {
+            for(int x = 0; x < nx; x++) {
+                int len = 0;
+                for(int i = std::max(y - hy, 0); i < std::min(y + hy + 1, ny); i++) {
+                    for(int j = std::max(x - hx, 0); j < std::min(x + hx + 1, nx); j++) {
+                        if (mask[nx * i + j]) pixels[len++] = input[nx * i + j];
+                    }
+                }
+                
+                if (len == 0) {
+                    output[nx * y + x] = fill;
+                    continue;
+                }
+                
+                std::sort(pixels.begin(), pixels.begin() + len);
+                const int mid = len / 2;
+                output[nx * y + x] = (len % 2 == 1) ? pixels[mid] : (pixels[mid] + pixels[mid - 1] + 1) / 2;
+            }
+        }
+    }
+    
+    // Validity mask with ~25% randomly invalid pixels and a fully masked square,
+    // so that both partial and empty windows are exercised
+    std::vector<uint8_t> generateMask(int ny, int nx) {
+        std::vector<uint8_t> mask(ny * nx);
+        std::uniform_real_distribution<float> prob_dist(0.0f, 1.0f);
+        for(int i = 0; i < ny * nx; i++) {
+            mask[i] = prob_dist(rng_) < 0.25f ? 0 : 1;
+        }
+        for(int y = ny / 4; y < ny / 4 + 16 && y < ny; y++) {
+            for(int x = nx / 4; x < nx / 4 + 16 && x < nx; x++) {
+                mask[y * nx + x] = 0;
+            }
+        }
+        return mask;
+    }
+    
     // Generate test image with different patterns (float version)
     std::vector<float> generateTestImageFloat(int ny, int nx, const std::string& pattern) {
         std::vector<float> image(ny * nx);
@@ -238,6 +479,26 @@ public:
         return image;
     }
     
+    // Generate test image with different patterns (uint16 version). The 8-bit
+    // patterns are stretched to the full range; random uses every 16-bit value.
+    std::vector<uint16_t> generateTestImageUint16(int ny, int nx, const std::string& pattern) {
+        std::vector<uint16_t> image(ny * nx);
+        
+        if (pattern == "random") {
+            std::uniform_int_distribution<int> dist(0, 65535);
+            for(int i = 0; i < ny * nx; i++) {
+                image[i] = static_cast<uint16_t>(dist(rng_));
+            }
+        } else {
+            auto base = generateTestImageUint8(ny, nx, pattern);
+            for(int i = 0; i < ny * nx; i++) {
+                image[i] = static_cast<uint16_t>(base[i] * 257);
+            }
+        }
+        
+        return image;
+    }
+    
     // Compare two images and return statistics
     struct ComparisonStats {
         double maxError;
@@ -273,9 +534,10 @@ public:
         return stats;
     }
     
-    ComparisonStats compareImagesUint8(const std::vector<uint8_t>& reference, 
-                                      const std::vector<uint8_t>& test,
-                                      int tolerance = 0) {
+    template <typename T>
+    ComparisonStats compareImagesInt(const std::vector<T>& reference, 
+                                     const std::vector<T>& test,
+                                     int tolerance = 0) {
         ComparisonStats stats = {0.0, 0.0, 0.0, 0, true};
         
         double sumError = 0.0;
@@ -299,6 +561,44 @@ public:
         return stats;
     }
     
+    // Per-type test helpers, so that a check written once runs on every data
+    // type: the generator, reference and comparison for T
+    template <typename T>
+    std::vector<T> generateTestImage(int ny, int nx, const std::string& pattern) {
+        if constexpr (std::is_same<T, float>::value) return generateTestImageFloat(ny, nx, pattern);
+        else if constexpr (std::is_same<T, uint8_t>::value) return generateTestImageUint8(ny, nx, pattern);
+        else return generateTestImageUint16(ny, nx, pattern);
+    }
+    
+    // Noise spikes for float, every value of the type for integers
+    template <typename T>
+    std::vector<T> testImage(int ny, int nx) {
+        return generateTestImage<T>(ny, nx, std::is_same<T, float>::value ? "noise_spikes" : "random");
+    }
+    
+    template <typename T>
+    void referenceMedian(const T *input, T *output, int ny, int nx, int hy, int hx) {
+        if constexpr (std::is_same<T, float>::value) referenceMedianFilter(input, output, ny, nx, hy, hx);
+        else referenceMedianFilterInt(input, output, ny, nx, hy, hx);
+    }
+    
+    template <typename T>
+    ComparisonStats compareImages(const std::vector<T>& reference, const std::vector<T>& test) {
+        if constexpr (std::is_same<T, float>::value) return compareImagesFloat(reference, test);
+        else return compareImagesInt(reference, test);
+    }
+    
+    template <typename T>
+    static const char *dtypeName() { return median_dtype_name(MedianTraits<T>::dtype); }
+    
+    // Call f with a value of each data type; f reads the type with decltype
+    template <typename F>
+    static void forEachDType(F f) {
+        f(float());
+        f(uint8_t());
+        f(uint16_t());
+    }
+    
     // Run accuracy test for a specific configuration
     void testConfiguration(int ny, int nx, int hy, int hx, const std::string& pattern) {
         std::cout << "\n" << std::string(80, '=') << std::endl;
@@ -353,13 +653,13 @@ public:
                     std::vector<uint8_t> testOutput(ny * nx);
                     
                     // Compute reference
-                    referenceMedianFilterUint8(input.data(), reference.data(), ny, nx, hy, hx);
+                    referenceMedianFilterInt(input.data(), reference.data(), ny, nx, hy, hx);
                     
                     // Execute the filter
                     version.func.uint8Func(input.data(), testOutput.data(), ny, nx, hy, hx);
                     
                     // Compare with reference
-                    auto stats = compareImagesUint8(reference, testOutput);
+                    auto stats = compareImagesInt(reference, testOutput);
                     
                     std::cout << std::setw(10) << version.name
                              << std::setw(10) << "uint8"
@@ -370,22 +670,1196 @@ public:
                              << std::setw(15) << stats.differentPixels
                              << std::setw(20) << version.description.substr(0, 19)
                              << std::endl;
+                } else if (version.dataType == DataType::UINT16) {
+                    auto input = generateTestImageUint16(ny, nx, pattern);
+                    std::vector<uint16_t> reference(ny * nx);
+                    std::vector<uint16_t> testOutput(ny * nx);
+                    
+                    referenceMedianFilterInt(input.data(), reference.data(), ny, nx, hy, hx);
+                    version.func.uint16Func(input.data(), testOutput.data(), ny, nx, hy, hx);
+                    
+                    printStatsRow(version.name, "uint16", compareImagesInt(reference, testOutput), version.description);
                 }
                          
             } catch(const std::exception& e) {
                 std::cout << std::setw(10) << version.name
-                         << std::setw(10) << (version.dataType == DataType::FLOAT ? "float" : "uint8")
+                         << std::setw(10) << typeName(version.dataType)
                          << std::setw(15) << "ERROR"
                          << "  Exception: " << e.what() << std::endl;
             } catch(...) {
                 std::cout << std::setw(10) << version.name
-                         << std::setw(10) << (version.dataType == DataType::FLOAT ? "float" : "uint8")
+                         << std::setw(10) << typeName(version.dataType)
                          << std::setw(15) << "ERROR"
                          << "  Unknown exception" << std::endl;
             }
         }
     }
     
+    void printStatsRow(const std::string& name, const std::string& type,
+                       const ComparisonStats& stats, const std::string& description) {
+        std::cout << std::setw(10) << name
+                 << std::setw(10) << type
+                 << std::setw(15) << (stats.isAccurate ? "PASS" : "FAIL")
+                 << std::setw(15) << std::scientific << std::setprecision(2) << stats.maxError
+                 << std::setw(15) << stats.meanError
+                 << std::setw(15) << stats.rmse
+                 << std::setw(15) << stats.differentPixels
+                 << std::setw(20) << description.substr(0, 19)
+                 << std::endl;
+    }
+    
+    // Run accuracy test of the mask-aware entry points
+    void testMaskedConfiguration(int ny, int nx, int hy, int hx, const std::string& pattern) {
+        std::cout << "\nMasked: " << ny << " x " << nx << ", kernel "
+                 << (2*hy+1) << " x " << (2*hx+1) << ", pattern " << pattern << std::endl;
+        
+        auto mask = generateMask(ny, nx);
+        
+#ifdef HAVE_MFV4
+        {
+            auto input = generateTestImageFloat(ny, nx, pattern);
+            std::vector<float> reference(ny * nx);
+            std::vector<float> testOutput(ny * nx);
+            
+            referenceMaskedMedianFilter(input.data(), mask.data(), reference.data(), ny, nx, hy, hx, -1.0f);
+            median_filterv4_masked(input.data(), mask.data(), testOutput.data(), ny, nx, hy, hx, -1.0f);
+            
+            printStatsRow("v4_masked", "float", compareImagesFloat(reference, testOutput), "Masked rank filter");
+        }
+#endif
+        {
+            auto input = generateTestImageUint8(ny, nx, pattern);
+            std::vector<uint8_t> reference(ny * nx);
+            std::vector<uint8_t> testOutput(ny * nx);
+            
+            referenceMaskedMedianFilterUint8(input.data(), mask.data(), reference.data(), ny, nx, hy, hx, 7);
+            median_filterv5_masked(input.data(), mask.data(), testOutput.data(), ny, nx, hy, hx, 7);
+            
+            printStatsRow("v5_masked", "uint8", compareImagesInt(reference, testOutput), "Masked histogram");
+        }
+    }
+    
+    // Decode a 16-bit float with `mbits` mantissa bits and `ebits` exponent bits
+    static double decodeFloat16(uint16_t bits, int ebits, int mbits) {
+        int bias = (1 << (ebits - 1)) - 1;
+        int exp = (bits >> mbits) & ((1 << ebits) - 1);
+        int mant = bits & ((1 << mbits) - 1);
+        double sign = (bits & 0x8000) ? -1.0 : 1.0;
+        if (exp == 0) return sign * std::ldexp(mant, 1 - bias - mbits);
+        return sign * std::ldexp(mant + (1 << mbits), exp - bias - mbits);
+    }
+    
+    // Round a (finite, in range) value to the nearest 16-bit float, ties to even
+    static uint16_t encodeFloat16(double v, int ebits, int mbits) {
+        int bias = (1 << (ebits - 1)) - 1;
+        uint16_t sign = std::signbit(v) ? 0x8000 : 0;
+        double a = std::fabs(v);
+        if (a == 0.0) return sign;
+        int e = std::max(std::ilogb(a), 1 - bias);
+        double q = std::nearbyint(std::ldexp(a, mbits - e));
+        if (q >= std::ldexp(1.0, mbits + 1)) { q /= 2; e++; }
+        int mant = static_cast<int>(q);
+        int exp = (mant >> mbits) ? e + bias : 0;
+        return sign | static_cast<uint16_t>((exp << mbits) | (mant & ((1 << mbits) - 1)));
+    }
+    
+    // Run bit-exactness test of the fp16 and bf16 entry points against the
+    // float reference; pattern values are shifted so that negatives occur
+    void testFloat16Configuration(int ny, int nx, int hy, int hx, const std::string& pattern) {
+        std::cout << "\nFloat16: " << ny << " x " << nx << ", kernel "
+                 << (2*hy+1) << " x " << (2*hx+1) << ", pattern " << pattern << std::endl;
+        
+        auto values = generateTestImageFloat(ny, nx, pattern);
+        
+        struct Format { const char *name; int ebits, mbits; MedianFilterFuncUint16 func; };
+        for(const Format& fmt : {Format{"v6_fp16", 5, 10, median_filterv6_fp16},
+                                 Format{"v6_bf16", 8, 7, median_filterv6_bf16}}) {
+            std::vector<uint16_t> input(ny * nx), output(ny * nx);
+            std::vector<float> widened(ny * nx), reference(ny * nx), testOutput(ny * nx);
+            
+            for(int i = 0; i < ny * nx; i++) {
+                input[i] = encodeFloat16((values[i] - 128.0f) * 0.37f, fmt.ebits, fmt.mbits);
+                widened[i] = static_cast<float>(decodeFloat16(input[i], fmt.ebits, fmt.mbits));
+            }
+            
+            referenceMedianFilter(widened.data(), reference.data(), ny, nx, hy, hx);
+            fmt.func(input.data(), output.data(), ny, nx, hy, hx);
+            
+            for(int i = 0; i < ny * nx; i++) {
+                reference[i] = static_cast<float>(decodeFloat16(encodeFloat16(reference[i], fmt.ebits, fmt.mbits),
+                                                                fmt.ebits, fmt.mbits));
+                testOutput[i] = static_cast<float>(decodeFloat16(output[i], fmt.ebits, fmt.mbits));
+            }
+            
+            printStatsRow(fmt.name, "uint16", compareImagesFloat(reference, testOutput, 0.0), "16-bit float keys");
+        }
+    }
+    
+    // Run the approximate float mode and check that every pixel is within the
+    // reported error bound, and that the bound honours the requested tolerance
+    void testApproxConfiguration(int ny, int nx, int hy, int hx, const std::string& pattern) {
+        std::cout << "\nApprox: " << ny << " x " << nx << ", kernel "
+                 << (2*hy+1) << " x " << (2*hx+1) << ", pattern " << pattern << std::endl;
+        
+        auto input = generateTestImageFloat(ny, nx, pattern);
+        std::vector<float> reference(ny * nx);
+        referenceMedianFilter(input.data(), reference.data(), ny, nx, hy, hx);
+        
+        for(float tolerance : {0.001f, 0.01f, 0.5f, 4.0f}) {
+            std::vector<float> testOutput(ny * nx);
+            float bound = median_filterv6_approx(input.data(), testOutput.data(), ny, nx, hy, hx, tolerance);
+            
+            auto stats = compareImagesFloat(reference, testOutput, bound);
+            stats.isAccurate = stats.isAccurate && bound <= tolerance;
+            
+            std::ostringstream description;
+            description << "tol " << tolerance << " bound " << std::setprecision(3) << bound;
+            printStatsRow("v6_approx", "float", stats, description.str());
+        }
+    }
+    
+    // Salt-and-pepper noise over a flat image: each bin holds a single value,
+    // so the reported error must be the error the outputs have, up to float
+    // rounding, rather than half a bin
+    void testApproxErrorConfiguration(int ny, int nx, float tolerance) {
+        std::cout << "\nApprox error: " << ny << " x " << nx << ", kernel 3 x 3, salt and pepper over 100" << std::endl;
+        
+        std::vector<float> input(ny * nx, 100.0f);
+        std::uniform_real_distribution<float> prob(0.0f, 1.0f);
+        for(float &value : input) {
+            float p = prob(rng_);
+            if (p < 0.05f) value = 0.0f;
+            else if (p < 0.1f) value = 255.0f;
+        }
+        std::vector<float> reference(ny * nx), testOutput(ny * nx);
+        referenceBorderMedianFilter(input.data(), reference.data(), ny, nx, 1, 1, MedianBorder::Replicate, 0.0f);
+        
+        MedianLayout layout = median_dense_layout(ny, nx);
+        layout.border = MedianBorder::Replicate;
+        float reported = median_filterv6_approx(input.data(), testOutput.data(), ny, nx, 1, 1, tolerance, layout);
+        
+        auto stats = compareImagesFloat(reference, testOutput, reported);
+        stats.isAccurate = stats.isAccurate && reported <= tolerance && reported - stats.maxError <= 1e-4;
+        
+        std::ostringstream description;
+        description << "tol " << tolerance << " error " << std::setprecision(3) << reported;
+        printStatsRow("v6_approx", "float", stats, description.str());
+    }
+    
+    // Run the dispatcher on every data type and check that it matches the
+    // reference and reports the engine that median_filter_select() predicts
+    void testDispatcherConfiguration(int ny, int nx, int hy, int hx, const std::string& pattern) {
+        std::cout << "\nDispatcher: " << ny << " x " << nx << ", kernel "
+                 << (2*hy+1) << " x " << (2*hx+1) << ", pattern " << pattern << std::endl;
+        
+        forEachDType([&](auto zero) {
+            using T = decltype(zero);
+            auto input = generateTestImage<T>(ny, nx, pattern);
+            std::vector<T> reference(ny * nx), testOutput(ny * nx);
+            referenceMedian(input.data(), reference.data(), ny, nx, hy, hx);
+            
+            MedianEngine chosen = MedianEngine::None;
+            median_filter<T>(input.data(), testOutput.data(), ny, nx, hy, hx, &chosen);
+            
+            auto stats = compareImages(reference, testOutput);
+            stats.isAccurate = stats.isAccurate && chosen == median_filter_select<T>(ny, nx, hy, hx);
+            printStatsRow("dispatch", dtypeName<T>(), stats, std::string("chose ") + median_engine_name(chosen));
+        });
+    }
+    
+    // 1D kernels: the dispatcher must route them to v7, which must match the
+    // references under shrinking and padding borders; the whole image is also
+    // filtered as one signal
+    void testLineConfiguration(int ny, int nx, int hy, int hx, const std::string& pattern) {
+        std::cout << "\n1D kernels: " << ny << " x " << nx << ", kernel "
+                 << (2*hy+1) << " x " << (2*hx+1) << ", pattern " << pattern << std::endl;
+        
+        forEachDType([&](auto zero) {
+            using T = decltype(zero);
+            const char *type = dtypeName<T>();
+            auto input = generateTestImage<T>(ny, nx, pattern);
+            std::vector<T> reference(ny * nx), output(ny * nx);
+            referenceMedian(input.data(), reference.data(), ny, nx, hy, hx);
+            
+            MedianEngine chosen = MedianEngine::None;
+            median_filter<T>(input.data(), output.data(), ny, nx, hy, hx, &chosen);
+            auto stats = compareImages(reference, output);
+            stats.isAccurate = stats.isAccurate && chosen == MedianEngine::V7;
+            printStatsRow("v7", type, stats, std::string("chose ") + median_engine_name(chosen));
+            
+            MedianLayout layout = median_dense_layout(ny, nx);
+            layout.border = MedianBorder::Reflect;
+            referenceBorderMedianFilter(input.data(), reference.data(), ny, nx, hy, hx, MedianBorder::Reflect, T(0));
+            median_filterv7(input.data(), output.data(), ny, nx, hy, hx, layout);
+            printStatsRow("v7", type, compareImages(reference, output), "reflect");
+            
+            const int h = std::max(hy, hx);
+            referenceMedian(input.data(), reference.data(), 1, ny * nx, 0, h);
+            median_filter1d(input.data(), output.data(), size_t(ny) * nx, h);
+            printStatsRow("1d", type, compareImages(reference, output), "signal");
+            
+            MedianCpuSet firstCpu;
+            firstCpu.set(0);
+            std::fill(output.begin(), output.end(), T(0));
+            median_filter1d(input.data(), output.data(), size_t(ny) * nx, h, 3, firstCpu);
+            printStatsRow("1d", type, compareImages(reference, output), "signal, 3 threads, cpu 0");
+        });
+    }
+    
+    // Build one plan per data type and run it on several frames; every frame
+    // must match the reference and a wrong element type must be rejected
+    void testPlanConfiguration(int ny, int nx, int hy, int hx) {
+        std::cout << "\nPlan: " << ny << " x " << nx << ", kernel "
+                 << (2*hy+1) << " x " << (2*hx+1) << std::endl;
+        
+        forEachDType([&](auto zero) {
+            using T = decltype(zero);
+            MedianPlan plan(MedianTraits<T>::dtype, ny, nx, hy, hx);
+            
+            bool rejected = false;
+            try {
+                std::vector<float> wrongFloat(ny * nx);
+                std::vector<uint8_t> wrongUint8(ny * nx);
+                if (std::is_same<T, float>::value) plan.execute(wrongUint8.data(), wrongUint8.data());
+                else plan.execute(wrongFloat.data(), wrongFloat.data());
+            } catch (const std::invalid_argument&) {
+                rejected = true;
+            }
+            
+            for(const char *pattern : {"random", "noise_spikes", "gradient"}) {
+                auto input = generateTestImage<T>(ny, nx, pattern);
+                std::vector<T> reference(ny * nx), testOutput(ny * nx);
+                referenceMedian(input.data(), reference.data(), ny, nx, hy, hx);
+                plan.execute(input.data(), testOutput.data());
+                
+                auto stats = compareImages(reference, testOutput);
+                stats.isAccurate = stats.isAccurate && rejected;
+                printStatsRow("plan", dtypeName<T>(), stats, std::string(median_engine_name(plan.engine())) + " " + pattern);
+            }
+        });
+    }
+    
+    // Plan every tiled engine, unpinned and on CPU 0, and count the
+    // allocations of frames and batches once the first of each has run (and
+    // started the workers): there must be none
+    void testPlanAllocationConfiguration(int ny, int nx, int hy, int hx) {
+        std::cout << "\nPlan allocations: " << ny << " x " << nx << ", kernel "
+                 << (2*hy+1) << " x " << (2*hx+1) << std::endl;
+        
+        forEachDType([&](auto zero) {
+            using T = decltype(zero);
+            const MedianDType dtype = MedianTraits<T>::dtype;
+            const int frames = 6;
+            auto input = generateTestImage<T>(frames * ny, nx, "random");
+            std::vector<T> output(frames * ny * nx);
+            
+            for(MedianEngine engine : median_filter_engines(dtype)) {
+                if (!median_tile_engine<T>(engine) || !median_filter_supports(dtype, engine, hy, hx)) continue;
+                for(bool pinned : {false, true}) {
+                    MedianLayout layout = median_dense_layout(ny, nx);
+                    if (pinned) layout.cpus.set(0);
+                    MedianPlan plan(dtype, ny, nx, hy, hx, layout, engine);
+                    
+                    plan.execute(input.data(), output.data());
+                    plan.execute_batch(input.data(), output.data(), frames);
+                    const long before = allocationCount;
+                    for(int i = 0; i < 3; i++) {
+                        plan.execute(input.data() + i * ny * nx, output.data());
+                        plan.execute_batch(input.data(), output.data(), frames);
+                    }
+                    const int allocations = int(allocationCount - before);
+                    
+                    printStatsRow("plan", dtypeName<T>(), ComparisonStats{0.0, 0.0, 0.0, allocations, allocations == 0},
+                                  std::string(median_engine_name(engine)) + (pinned ? ", cpu 0" : ", unpinned"));
+                }
+            }
+        });
+    }
+    
+    // Filter a padded copy of `input` through `filter` with a ROI and a padded
+    // output; the ROI must match the same region of the full-image reference
+    // and the output padding must stay untouched
+    template <typename T, typename Filter>
+    void checkLayout(const std::string& name, const std::vector<T>& input, const std::vector<T>& reference,
+                     int ny, int nx, Filter filter) {
+        const T pad = std::numeric_limits<T>::max();
+        MedianRect roi = {ny / 5, ny - ny / 7, nx / 6, nx - 3};
+        int rh = roi.y1 - roi.y0, rw = roi.x1 - roi.x0;
+        MedianLayout layout = {nx + 7, rw + 5, roi};
+        
+        std::vector<T> padded(ny * layout.inStride, pad);
+        for(int y = 0; y < ny; y++) std::copy(&input[y * nx], &input[y * nx] + nx, &padded[y * layout.inStride]);
+        
+        std::vector<T> output(rh * layout.outStride, pad);
+        filter(padded.data(), output.data(), layout);
+        
+        std::vector<T> expected, actual;
+        bool padIntact = true;
+        for(int y = 0; y < rh; y++) {
+            for(int x = 0; x < layout.outStride; x++) {
+                T v = output[y * layout.outStride + x];
+                if (x < rw) {
+                    expected.push_back(reference[(roi.y0 + y) * nx + roi.x0 + x]);
+                    actual.push_back(v);
+                } else if (v != pad) {
+                    padIntact = false;
+                }
+            }
+        }
+        
+        auto stats = compareImages(expected, actual);
+        stats.isAccurate = stats.isAccurate && padIntact;
+        printStatsRow(name, dtypeName<T>(), stats, "strided ROI");
+    }
+    
+    // Padding border modes on every engine, through the layout overloads
+    void testBorderConfiguration(int ny, int nx, int hy, int hx, const std::string& pattern) {
+        std::cout << "\nBorder modes: " << ny << " x " << nx << ", kernel "
+                 << (2*hy+1) << " x " << (2*hx+1) << ", pattern " << pattern << std::endl;
+        
+        const std::pair<MedianBorder, const char *> borders[] = {
+            {MedianBorder::Replicate, "replicate"}, {MedianBorder::Reflect, "reflect"},
+            {MedianBorder::Wrap, "wrap"}, {MedianBorder::Constant, "constant"},
+        };
+        
+        auto inputFloat = generateTestImageFloat(ny, nx, pattern);
+        auto inputUint8 = generateTestImageUint8(ny, nx, pattern);
+        auto inputUint16 = generateTestImageUint16(ny, nx, pattern);
+        
+        using FloatLayoutFunc = void (*)(const float *, float *, int, int, int, int, const MedianLayout &);
+        std::vector<std::pair<std::string, FloatLayoutFunc>> floatEngines = {
+            {"v1", median_filterv1}, {"v2", median_filterv2}, {"v3", median_filterv3},
+#ifdef HAVE_MFV4
+            {"v4", median_filterv4},
+#endif
+        };
+        
+        for(const auto& border : borders) {
+            MedianLayout layout = median_dense_layout(ny, nx);
+            layout.border = border.first;
+            layout.borderValue = 77.0;
+            
+            std::vector<float> referenceFloat(ny * nx), outputFloat(ny * nx);
+            referenceBorderMedianFilter(inputFloat.data(), referenceFloat.data(), ny, nx, hy, hx, border.first, 77.0f);
+            for(const auto& engine : floatEngines) {
+                engine.second(inputFloat.data(), outputFloat.data(), ny, nx, hy, hx, layout);
+                printStatsRow(engine.first, "float", compareImagesFloat(referenceFloat, outputFloat), border.second);
+            }
+            
+            std::vector<uint8_t> referenceUint8(ny * nx), outputUint8(ny * nx);
+            referenceBorderMedianFilter(inputUint8.data(), referenceUint8.data(), ny, nx, hy, hx, border.first, uint8_t(77));
+            median_filterv5(inputUint8.data(), outputUint8.data(), ny, nx, hy, hx, layout);
+            printStatsRow("v5", "uint8", compareImagesInt(referenceUint8, outputUint8), border.second);
+            
+            std::vector<uint16_t> referenceUint16(ny * nx), outputUint16(ny * nx);
+            referenceBorderMedianFilter(inputUint16.data(), referenceUint16.data(), ny, nx, hy, hx, border.first, uint16_t(77));
+            median_filterv6(inputUint16.data(), outputUint16.data(), ny, nx, hy, hx, layout);
+            printStatsRow("v6", "uint16", compareImagesInt(referenceUint16, outputUint16), border.second);
+        }
+    }
+    
+    // Row-stride and ROI overloads of the engines, the dispatcher and plans
+    void testLayoutConfiguration(int ny, int nx, int hy, int hx, const std::string& pattern) {
+        std::cout << "\nStrided ROI: " << ny << " x " << nx << ", kernel "
+                 << (2*hy+1) << " x " << (2*hx+1) << ", pattern " << pattern << std::endl;
+        
+        auto inputFloat = generateTestImageFloat(ny, nx, pattern);
+        std::vector<float> referenceFloat(ny * nx);
+        referenceMedianFilter(inputFloat.data(), referenceFloat.data(), ny, nx, hy, hx);
+        
+        using FloatLayoutFunc = void (*)(const float *, float *, int, int, int, int, const MedianLayout &);
+        std::vector<std::pair<std::string, FloatLayoutFunc>> floatEngines = {
+            {"v1", median_filterv1}, {"v2", median_filterv2}, {"v3", median_filterv3},
+#ifdef HAVE_MFV4
+            {"v4", median_filterv4},
+#endif
+        };
+        for(const auto& engine : floatEngines) {
+            checkLayout(engine.first, inputFloat, referenceFloat, ny, nx,
+                        [&](const float *in, float *out, const MedianLayout& l) { engine.second(in, out, ny, nx, hy, hx, l); });
+        }
+        
+        // The dispatcher and plans on every type, v5 and v6 on theirs
+        forEachDType([&](auto zero) {
+            using T = decltype(zero);
+            auto input = generateTestImage<T>(ny, nx, pattern);
+            std::vector<T> reference(ny * nx);
+            referenceMedian(input.data(), reference.data(), ny, nx, hy, hx);
+            
+            if constexpr (std::is_same<T, uint8_t>::value) {
+                checkLayout("v5", input, reference, ny, nx,
+                            [&](const T *in, T *out, const MedianLayout& l) { median_filterv5(in, out, ny, nx, hy, hx, l); });
+            }
+            if constexpr (std::is_same<T, uint16_t>::value) {
+                checkLayout("v6", input, reference, ny, nx,
+                            [&](const T *in, T *out, const MedianLayout& l) { median_filterv6(in, out, ny, nx, hy, hx, l); });
+            }
+            checkLayout("dispatch", input, reference, ny, nx,
+                        [&](const T *in, T *out, const MedianLayout& l) { median_filter<T>(in, out, ny, nx, hy, hx, l); });
+            checkLayout("plan", input, reference, ny, nx,
+                        [&](const T *in, T *out, const MedianLayout& l) {
+                            MedianPlan(MedianTraits<T>::dtype, ny, nx, hy, hx, l).execute(in, out);
+                        });
+        });
+    }
+    
+    // Batches of small images, packed and as pointer arrays
+    void testBatchConfiguration(int count, int ny, int nx, int hy, int hx) {
+        std::cout << "\nBatch: " << count << " x " << ny << " x " << nx << ", kernel "
+                 << (2*hy+1) << " x " << (2*hx+1) << std::endl;
+        
+        forEachDType([&](auto zero) {
+            using T = decltype(zero);
+            const char *type = dtypeName<T>();
+            const int size = ny * nx;
+            
+            std::vector<T> input, reference;
+            for(int i = 0; i < count; i++) {
+                auto image = generateTestImage<T>(ny, nx, i % 2 ? "noise_spikes" : "random");
+                std::vector<T> filtered(size);
+                referenceMedian(image.data(), filtered.data(), ny, nx, hy, hx);
+                input.insert(input.end(), image.begin(), image.end());
+                reference.insert(reference.end(), filtered.begin(), filtered.end());
+            }
+            
+            MedianEngine chosen = MedianEngine::None;
+            std::vector<T> packed(count * size);
+            median_filter_batch<T>(input.data(), packed.data(), count, ny, nx, hy, hx, &chosen);
+            printStatsRow("batch", type, compareImages(reference, packed),
+                          std::string("packed, ") + median_engine_name(chosen));
+            
+            std::vector<T> separate(count * size);
+            std::vector<const T *> inputs;
+            std::vector<T *> outputs;
+            for(int i = 0; i < count; i++) {
+                inputs.push_back(&input[i * size]);
+                outputs.push_back(&separate[i * size]);
+            }
+            median_filter_batch<T>(inputs.data(), outputs.data(), count, ny, nx, hy, hx, &chosen);
+            printStatsRow("batch", type, compareImages(reference, separate),
+                          std::string("pointers, ") + median_engine_name(chosen));
+        });
+    }
+    
+    void testStreamConfiguration(int ny, int nx, int hy, int hx) {
+        std::cout << "\nStream: " << ny << " x " << nx << ", kernel "
+                 << (2*hy+1) << " x " << (2*hx+1) << std::endl;
+        
+        forEachDType([&](auto zero) {
+            using T = decltype(zero);
+            auto input = testImage<T>(ny, nx);
+            std::vector<T> reference(ny * nx);
+            referenceMedian(input.data(), reference.data(), ny, nx, hy, hx);
+            
+            // Push every row, then drain; run twice to check reset()
+            MedianStream stream(MedianTraits<T>::dtype, nx, hy, hx);
+            for(int pass = 0; pass < 2; pass++) {
+                std::vector<T> result(ny * nx);
+                int produced = 0;
+                for(int y = 0; y < ny; y++) {
+                    if (stream.push(&input[y * nx], &result[produced * nx])) produced++;
+                }
+                while(produced < ny && stream.finish(&result[produced * nx])) produced++;
+                bool done = produced == ny && !stream.finish(&result[0]) && stream.rows_out() == ny;
+                printStatsRow("stream", dtypeName<T>(), compareImages(reference, result),
+                              std::string(pass ? "after reset" : "rows") + (done ? "" : ", wrong row count"));
+                stream.reset();
+            }
+        });
+    }
+    
+    void testFileConfiguration(int ny, int nx, int hy, int hx, int bandRows) {
+        std::cout << "\nOut-of-core: " << ny << " x " << nx << ", kernel "
+                 << (2*hy+1) << " x " << (2*hx+1) << ", ~" << bandRows << " rows per band" << std::endl;
+        
+        const std::string base = "/tmp/median_filter_file_" + std::to_string(std::random_device{}());
+        const std::string inputPath = base + ".in", outputPath = base + ".out";
+        
+        // Budget for about bandRows output rows per band, under a shrinking
+        // and a padding border
+        forEachDType([&](auto zero) {
+            using T = decltype(zero);
+            auto input = testImage<T>(ny, nx);
+            std::ofstream(inputPath, std::ios::binary).write(reinterpret_cast<const char *>(input.data()),
+                                                             input.size() * sizeof(T));
+            
+            MedianFileOptions options;
+            options.memoryBudget = (2 * size_t(bandRows) + 2 * hy) * nx * sizeof(T);
+            for(MedianBorder border : {MedianBorder::Shrink, MedianBorder::Reflect}) {
+                std::vector<T> reference(ny * nx), result(ny * nx);
+                if (border == MedianBorder::Shrink) referenceMedian(input.data(), reference.data(), ny, nx, hy, hx);
+                else referenceBorderMedianFilter(input.data(), reference.data(), ny, nx, hy, hx, border, T(0));
+                
+                options.border = border;
+                MedianEngine chosen = median_filter_file(MedianTraits<T>::dtype, inputPath.c_str(), outputPath.c_str(),
+                                                         ny, nx, hy, hx, options);
+                std::ifstream(outputPath, std::ios::binary).read(reinterpret_cast<char *>(result.data()),
+                                                                 result.size() * sizeof(T));
+                printStatsRow("file", dtypeName<T>(), compareImages(reference, result),
+                              std::string(border == MedianBorder::Shrink ? "shrink, " : "reflect, ") +
+                              median_engine_name(chosen));
+            }
+            
+            // Filtering a file onto itself, under another name too, is
+            // rejected before the input is truncated
+            ComparisonStats inPlace = compareImages(input, input);
+            const std::string alias = "/tmp/../tmp/" + inputPath.substr(5);
+            for(const std::string& target : {inputPath, alias}) {
+                try {
+                    median_filter_file(MedianTraits<T>::dtype, inputPath.c_str(), target.c_str(), ny, nx, hy, hx, options);
+                    inPlace.isAccurate = false;
+                } catch (const std::invalid_argument&) {
+                }
+            }
+            std::vector<T> kept(ny * nx);
+            std::ifstream(inputPath, std::ios::binary).read(reinterpret_cast<char *>(kept.data()), kept.size() * sizeof(T));
+            inPlace.isAccurate = inPlace.isAccurate && kept == input;
+            printStatsRow("file", dtypeName<T>(), inPlace, "output is input");
+        });
+        
+        std::remove(inputPath.c_str());
+        std::remove(outputPath.c_str());
+    }
+    
+    void testAsyncConfiguration(int count, int ny, int nx, int hy, int hx) {
+        std::cout << "\nAsync: " << count << " calls in flight, " << ny << " x " << nx << ", kernel "
+                 << (2*hy+1) << " x " << (2*hx+1) << std::endl;
+        
+        // An engine that cannot run surfaces through the future
+        bool rejected = false;
+        try {
+            std::vector<uint8_t> image(ny * nx), result(ny * nx);
+            median_filter_submit<uint8_t>(image.data(), result.data(), ny, nx, hy, hx, MedianEngine::V6).get();
+        } catch (const std::invalid_argument&) {
+            rejected = true;
+        }
+        
+        forEachDType([&](auto zero) {
+            using T = decltype(zero);
+            const char *type = dtypeName<T>();
+            
+            std::vector<std::vector<T>> inputs, references, outputs(count, std::vector<T>(ny * nx));
+            for(int i = 0; i < count; i++) {
+                inputs.push_back(generateTestImage<T>(ny, nx, i % 2 ? "noise_spikes" : "random"));
+                references.push_back(std::vector<T>(ny * nx));
+                referenceMedian(inputs[i].data(), references[i].data(), ny, nx, hy, hx);
+            }
+            
+            // Futures: submit everything, then wait
+            std::vector<std::future<MedianEngine>> futures;
+            for(int i = 0; i < count; i++) {
+                futures.push_back(median_filter_submit<T>(inputs[i].data(), outputs[i].data(), ny, nx, hy, hx));
+            }
+            for(int i = 0; i < count; i++) {
+                MedianEngine chosen = futures[i].get();
+                auto stats = compareImages(references[i], outputs[i]);
+                stats.isAccurate = stats.isAccurate && rejected;
+                printStatsRow("async", type, stats,
+                              "future " + std::to_string(i) + ", " + median_engine_name(chosen));
+            }
+            
+            // Callback on the lower half of each image, as a ROI
+            std::promise<void> finished;
+            std::atomic<int> remaining(count), failures(0);
+            MedianLayout layout = median_dense_layout(ny, nx);
+            layout.roi.y0 = ny / 2;
+            for(int i = 0; i < count; i++) {
+                std::fill(outputs[i].begin(), outputs[i].end(), T(0));
+                median_filter_submit<T>(inputs[i].data(), &outputs[i][(ny / 2) * nx], ny, nx, hy, hx, layout,
+                                        [&](MedianEngine, std::exception_ptr error) {
+                                            if (error) failures++;
+                                            if (--remaining == 0) finished.set_value();
+                                        });
+            }
+            finished.get_future().wait();
+            for(int i = 0; i < count; i++) {
+                std::vector<T> expected(references[i].begin() + (ny / 2) * nx, references[i].end());
+                std::vector<T> actual(outputs[i].begin() + (ny / 2) * nx, outputs[i].end());
+                auto stats = compareImages(expected, actual);
+                stats.isAccurate = stats.isAccurate && failures == 0;
+                printStatsRow("async", type, stats, "callback " + std::to_string(i));
+            }
+        });
+    }
+    
+    void testThreadingConfiguration(int ny, int nx, int hy, int hx) {
+        std::cout << "\nThread budgets: " << ny << " x " << nx << ", kernel "
+                 << (2*hy+1) << " x " << (2*hx+1) << std::endl;
+        
+        MedianCpuSet firstCpu, twoCpus;
+        firstCpu.set(0);
+        twoCpus.set(0);
+        twoCpus.set(1);
+        const std::tuple<int, MedianCpuSet, const char *> budgets[] = {
+            {1, MedianCpuSet(), "1 thread"}, {3, MedianCpuSet(), "3 threads"},
+            {0, firstCpu, "cpu 0"}, {4, twoCpus, "cpus 0-1"},
+        };
+        
+        forEachDType([&](auto zero) {
+            using T = decltype(zero);
+            auto input = testImage<T>(ny, nx);
+            std::vector<T> reference(ny * nx);
+            referenceMedian(input.data(), reference.data(), ny, nx, hy, hx);
+            
+            for(const auto& budget : budgets) {
+                MedianLayout layout = median_dense_layout(ny, nx);
+                layout.threads = std::get<0>(budget);
+                layout.cpus = std::get<1>(budget);
+                
+                std::vector<T> output(ny * nx), planned(ny * nx);
+                MedianEngine chosen = MedianEngine::None;
+                median_filter<T>(input.data(), output.data(), ny, nx, hy, hx, layout, &chosen);
+                MedianPlan plan(MedianTraits<T>::dtype, ny, nx, hy, hx, layout);
+                plan.execute(input.data(), planned.data());
+                
+                auto stats = compareImages(reference, output);
+                stats.isAccurate = stats.isAccurate && compareImages(reference, planned).isAccurate;
+                printStatsRow("threads", dtypeName<T>(), stats,
+                              std::string(std::get<2>(budget)) + ", " + median_engine_name(chosen));
+            }
+        });
+    }
+    
+    void testContentionConfiguration(int callers, int ny, int nx, int hy, int hx) {
+        std::cout << "\nContention: " << callers << " application threads, " << ny << " x " << nx << ", kernel "
+                 << (2*hy+1) << " x " << (2*hx+1) << std::endl;
+        
+        auto inputFloat = generateTestImageFloat(ny, nx, "noise_spikes");
+        auto inputUint8 = generateTestImageUint8(ny, nx, "random");
+        std::vector<float> referenceFloat(ny * nx);
+        std::vector<uint8_t> referenceUint8(ny * nx);
+        referenceMedianFilter(inputFloat.data(), referenceFloat.data(), ny, nx, hy, hx);
+        referenceMedianFilterInt(inputUint8.data(), referenceUint8.data(), ny, nx, hy, hx);
+        
+        // Every caller filters both images a few times, all at once
+        std::vector<std::vector<float>> outputFloat(callers, std::vector<float>(ny * nx));
+        std::vector<std::vector<uint8_t>> outputUint8(callers, std::vector<uint8_t>(ny * nx));
+        std::vector<std::thread> threads;
+        for(int c = 0; c < callers; c++) {
+            threads.emplace_back([&, c] {
+                for(int rep = 0; rep < 3; rep++) {
+                    median_filter<float>(inputFloat.data(), outputFloat[c].data(), ny, nx, hy, hx);
+                    median_filter<uint8_t>(inputUint8.data(), outputUint8[c].data(), ny, nx, hy, hx);
+                }
+            });
+        }
+        for(auto& thread : threads) thread.join();
+        
+        auto statsFloat = compareImagesFloat(referenceFloat, outputFloat[0]);
+        auto statsUint8 = compareImagesInt(referenceUint8, outputUint8[0]);
+        for(int c = 1; c < callers; c++) {
+            statsFloat.isAccurate = statsFloat.isAccurate && outputFloat[c] == outputFloat[0];
+            statsUint8.isAccurate = statsUint8.isAccurate && outputUint8[c] == outputUint8[0];
+        }
+        printStatsRow("contention", "float", statsFloat, "all callers");
+        printStatsRow("contention", "uint8", statsUint8, "all callers");
+    }
+    
+    // The shared and pinned pools through median_parallel_for: no more tiles
+    // run at once than median_max_threads() allows, concurrent loops all get
+    // a tile before any of them finishes, nested loops run inline, and a
+    // throwing tile cancels its loop and reaches the caller
+    void testPoolConfiguration(int callers, int count) {
+        const int limit = median_max_threads();
+        std::cout << "\nPool: " << callers << " concurrent loops of " << count << " tiles, limit "
+                 << limit << std::endl;
+        
+#ifdef MEDIAN_USE_OPENMP
+        const bool pooled = false;  // OpenMP teams of concurrent callers are not bounded together
+#else
+        const bool pooled = true;
+#endif
+        auto result = [](bool ok, int violations) { return ComparisonStats{0.0, 0.0, 0.0, violations, ok}; };
+        auto pause = [] { std::this_thread::sleep_for(std::chrono::microseconds(100)); };
+        std::atomic<int> inFlight(0), peak(0);
+        auto enter = [&] {
+            int now = ++inFlight, seen = peak;
+            while(now > seen && !peak.compare_exchange_weak(seen, now)) {}
+        };
+        
+        // Each caller starts its loop once all of them are ready
+        auto runCallers = [&](auto loop) {
+            std::atomic<int> ready(0);
+            std::vector<std::thread> threads;
+            for(int c = 0; c < callers; c++) {
+                threads.emplace_back([&, c] {
+                    ready++;
+                    while(ready < callers) std::this_thread::yield();
+                    loop(c);
+                });
+            }
+            for(auto& thread : threads) thread.join();
+        };
+        
+        MedianCpuSet firstCpu;
+        firstCpu.set(0);
+        const std::tuple<int, MedianCpuSet, const char *> budgets[] = {
+            {0, MedianCpuSet(), "default"}, {3, MedianCpuSet(), "3 threads"}, {0, firstCpu, "cpu 0"},
+        };
+        for(const auto& budget : budgets) {
+            std::vector<std::atomic<int>> hits(callers * count);
+            std::atomic<int> badSlots(0);
+            const int threads = std::get<0>(budget) > 0 ? std::get<0>(budget) : limit;
+            peak = 0;
+            runCallers([&](int c) {
+                median_parallel_for(count, std::get<0>(budget), std::get<1>(budget), [&](int index, int thread) {
+                    enter();
+                    hits[c * count + index]++;
+                    if (thread < 0 || thread >= threads) badSlots++;
+                    pause();
+                    inFlight--;
+                });
+            });
+            int missed = 0;
+            for(auto& h : hits) missed += h != 1;
+            printStatsRow("pool", "-", result((!pooled || peak <= limit) && missed == 0 && badSlots == 0, missed + badSlots),
+                          "peak " + std::to_string(peak) + ", " + std::get<2>(budget));
+        }
+        
+        // With one tile at a time the loops run one after another; otherwise
+        // each loop records how many others had finished at its first tile
+        std::atomic<int> finished(0), late(0);
+        runCallers([&](int) {
+            std::atomic<bool> first(true);
+            median_parallel_for(count, 0, MedianCpuSet(), [&](int, int) {
+                if (first.exchange(false) && finished > 0) late++;
+                pause();
+            });
+            finished++;
+        });
+        printStatsRow("pool", "-", result(!pooled || limit == 1 || late == 0, limit == 1 ? 0 : int(late)),
+                      limit == 1 ? "one loop at a time" : std::to_string(late) + " loops started late");
+        
+        // A nested loop runs on the tile's thread and within its admission
+        std::atomic<int> inner(0), moved(0);
+        peak = 0;
+        runCallers([&](int) {
+            median_parallel_for(count, 0, MedianCpuSet(), [&](int, int) {
+                enter();
+                const std::thread::id self = std::this_thread::get_id();
+                median_parallel_for(4, 0, MedianCpuSet(), [&](int, int thread) {
+                    inner++;
+                    if (thread != 0 || std::this_thread::get_id() != self) moved++;
+                });
+                inFlight--;
+            });
+        });
+        bool nestedOk = inner == callers * count * 4 && moved == 0 && (!pooled || peak <= limit);
+        printStatsRow("pool", "-", result(nestedOk, moved), "nested, peak " + std::to_string(peak));
+        
+        // A throwing tile, directly or from a nested loop, reaches every
+        // caller; no tile of a loop runs after the loop has returned, and
+        // the pool keeps working
+        for(bool nested : {false, true}) {
+            std::atomic<int> caught(0), afterReturn(0), ran(0);
+            runCallers([&](int c) {
+                std::atomic<bool> returned(false);
+                try {
+                    median_parallel_for(count, c % 2 ? 1 : 0, MedianCpuSet(), [&](int index, int) {
+                        if (returned) afterReturn++;
+                        pause();
+                        if (index == count / 2) {
+                            if (!nested) throw std::runtime_error("tile");
+                            median_parallel_for(2, 0, MedianCpuSet(), [](int, int) { throw std::runtime_error("inner"); });
+                        }
+                    });
+                } catch (const std::runtime_error&) {
+                    caught++;
+                }
+                returned = true;
+                median_parallel_for(count, 0, MedianCpuSet(), [&](int, int) { ran++; });
+            });
+            bool ok = caught == callers && afterReturn == 0 && ran == callers * count;
+            printStatsRow("pool", "-", result(ok, callers - caught + afterReturn),
+                          nested ? "nested throw" : "throwing tile");
+        }
+    }
+    
+    void testRankConfiguration(int ny, int nx, int hy, int hx) {
+        std::cout << "\nRank filters: " << ny << " x " << nx << ", kernel "
+                 << (2*hy+1) << " x " << (2*hx+1) << std::endl;
+        
+        const int full = (2*hy+1) * (2*hx+1);
+        const std::pair<MedianRank, std::string> ranks[] = {
+            {median_percentile(0), "p0"}, {median_percentile(10), "p10"}, {median_percentile(50), "p50"},
+            {median_percentile(90), "p90"}, {median_percentile(100), "p100"},
+            {median_rank(1), "rank 1"}, {median_rank(full - 1), "rank " + std::to_string(full - 1)},
+        };
+        const std::pair<MedianBorder, const char *> borders[] = {
+            {MedianBorder::Shrink, "shrink"}, {MedianBorder::Reflect, "reflect"},
+        };
+        
+        auto check = [&](auto zero, const char *engine, auto filter) {
+            using T = decltype(zero);
+            auto input = testImage<T>(ny, nx);
+            for(const auto& border : borders) {
+                MedianLayout layout = median_dense_layout(ny, nx);
+                layout.border = border.first;
+                for(const auto& rank : ranks) {
+                    std::vector<T> reference(ny * nx), output(ny * nx);
+                    referenceRankFilter(input.data(), reference.data(), ny, nx, hy, hx, rank.first, border.first);
+                    filter(input.data(), output.data(), rank.first, layout);
+                    printStatsRow(engine, dtypeName<T>(), compareImages(reference, output), rank.second + ", " + border.second);
+                }
+            }
+            
+            // Ranks outside the window are rejected
+            std::vector<T> output(ny * nx);
+            bool rejected = false;
+            try {
+                filter(input.data(), output.data(), median_percentile(101), median_dense_layout(ny, nx));
+            } catch (const std::invalid_argument&) {
+                rejected = true;
+            }
+            auto stats = compareImages(input, input);
+            stats.isAccurate = rejected;
+            printStatsRow(engine, dtypeName<T>(), stats, "invalid rank");
+        };
+
+#ifdef HAVE_MFV4
+        check(float(), "v4", [&](const float *in, float *out, MedianRank rank, const MedianLayout& layout) {
+            median_filterv4_rank(in, out, ny, nx, hy, hx, rank, layout);
+        });
+#endif
+        check(uint8_t(), "v5", [&](const uint8_t *in, uint8_t *out, MedianRank rank, const MedianLayout& layout) {
+            median_filterv5_rank(in, out, ny, nx, hy, hx, rank, layout);
+        });
+    }
+    
+    // Several ranks in one pass, requested out of order, into a padded ROI
+    void testMultiRankConfiguration(int ny, int nx, int hy, int hx) {
+        std::cout << "\nMulti-rank filters: " << ny << " x " << nx << ", kernel "
+                 << (2*hy+1) << " x " << (2*hx+1) << std::endl;
+        
+        const std::vector<MedianRank> ranks = {
+            median_percentile(75), median_percentile(25), median_percentile(50), median_rank(0), median_percentile(100),
+        };
+        const char *names[] = {"p75", "p25", "p50", "rank 0", "p100"};
+        const MedianRect roi{3, ny - 2, 5, nx - 4};
+        const int width = roi.x1 - roi.x0, height = roi.y1 - roi.y0, outStride = width + 7;
+        
+        auto check = [&](auto zero, const char *engine, auto filter) {
+            using T = decltype(zero);
+            auto input = testImage<T>(ny, nx);
+            for(MedianBorder border : {MedianBorder::Shrink, MedianBorder::Reflect}) {
+                MedianLayout layout{nx, outStride, roi, border};
+                std::vector<std::vector<T>> planes(ranks.size(), std::vector<T>(height * outStride));
+                std::vector<T *> outputs;
+                for(auto& plane : planes) outputs.push_back(plane.data());
+                filter(input.data(), outputs.data(), layout);
+                
+                for(size_t k = 0; k < ranks.size(); k++) {
+                    std::vector<T> full(ny * nx), reference, output;
+                    referenceRankFilter(input.data(), full.data(), ny, nx, hy, hx, ranks[k], border);
+                    for(int y = 0; y < height; y++) {
+                        reference.insert(reference.end(), &full[(roi.y0 + y) * nx + roi.x0], &full[(roi.y0 + y) * nx + roi.x1]);
+                        output.insert(output.end(), &planes[k][y * outStride], &planes[k][y * outStride + width]);
+                    }
+                    printStatsRow(engine, dtypeName<T>(), compareImages(reference, output),
+                                  std::string(names[k]) + (border == MedianBorder::Shrink ? ", shrink" : ", reflect"));
+                }
+            }
+        };
+
+#ifdef HAVE_MFV4
+        check(float(), "v4", [&](const float *in, float *const *outs, const MedianLayout& layout) {
+            median_filterv4_ranks(in, outs, ny, nx, hy, hx, ranks.data(), (int)ranks.size(), layout);
+        });
+#endif
+        check(uint8_t(), "v5", [&](const uint8_t *in, uint8_t *const *outs, const MedianLayout& layout) {
+            median_filterv5_ranks(in, outs, ny, nx, hy, hx, ranks.data(), (int)ranks.size(), layout);
+        });
+    }
+    
+    void testWeightedConfiguration(int ny, int nx, int hy, int hx, const std::vector<int>& weights, const std::string& name) {
+        std::cout << "\nWeighted median (" << name << "): " << ny << " x " << nx << ", kernel "
+                 << (2*hy+1) << " x " << (2*hx+1) << std::endl;
+        
+        auto check = [&](auto zero, const char *engine, auto filter) {
+            using T = decltype(zero);
+            auto input = testImage<T>(ny, nx);
+            for(MedianBorder border : {MedianBorder::Shrink, MedianBorder::Reflect}) {
+                MedianLayout layout = median_dense_layout(ny, nx);
+                layout.border = border;
+                std::vector<T> reference(ny * nx), output(ny * nx);
+                referenceWeightedMedianFilter(input.data(), reference.data(), ny, nx, hy, hx, weights, border);
+                filter(input.data(), output.data(), weights.data(), layout);
+                printStatsRow(engine, dtypeName<T>(), compareImages(reference, output),
+                              border == MedianBorder::Shrink ? "shrink" : "reflect");
+            }
+            
+            // Negative weights are rejected
+            std::vector<int> invalid(weights);
+            invalid[0] = -1;
+            std::vector<T> output(ny * nx);
+            auto stats = compareImages(input, input);
+            try {
+                filter(input.data(), output.data(), invalid.data(), median_dense_layout(ny, nx));
+                stats.isAccurate = false;
+            } catch (const std::invalid_argument&) {
+            }
+            printStatsRow(engine, dtypeName<T>(), stats, "invalid weights");
+            
+            // So are masks whose sum does not fit in an int, once the kernel
+            // has room for one
+            std::vector<int> heavy(weights.size(), 65535);
+            if ((long long)heavy.size() * 65535 > std::numeric_limits<int>::max()) {
+                stats = compareImages(input, input);
+                try {
+                    filter(input.data(), output.data(), heavy.data(), median_dense_layout(ny, nx));
+                    stats.isAccurate = false;
+                } catch (const std::invalid_argument&) {
+                }
+                printStatsRow(engine, dtypeName<T>(), stats, "sum past INT_MAX");
+            }
+        };
+
+#ifdef HAVE_MFV4
+        check(float(), "v4", [&](const float *in, float *out, const int *w, const MedianLayout& layout) {
+            median_filterv4_weighted(in, out, ny, nx, hy, hx, w, layout);
+        });
+#endif
+        check(uint8_t(), "v5", [&](const uint8_t *in, uint8_t *out, const int *w, const MedianLayout& layout) {
+            median_filterv5_weighted(in, out, ny, nx, hy, hx, w, layout);
+        });
+    }
+    
+    void testFootprintConfiguration(int ny, int nx, int hy, int hx, const std::vector<uint8_t>& footprint,
+                                    const std::string& name) {
+        std::cout << "\nFootprint median (" << name << "): " << ny << " x " << nx << ", kernel "
+                 << (2*hy+1) << " x " << (2*hx+1) << std::endl;
+        
+        // A footprint is a weight mask of zeros and ones
+        std::vector<int> weights(footprint.begin(), footprint.end());
+        for(int& w : weights) w = w != 0;
+        
+        auto check = [&](auto zero, const char *engine, auto filter) {
+            using T = decltype(zero);
+            auto input = testImage<T>(ny, nx);
+            for(MedianBorder border : {MedianBorder::Shrink, MedianBorder::Reflect}) {
+                MedianLayout layout = median_dense_layout(ny, nx);
+                layout.border = border;
+                std::vector<T> reference(ny * nx), output(ny * nx);
+                referenceWeightedMedianFilter(input.data(), reference.data(), ny, nx, hy, hx, weights, border);
+                filter(input.data(), output.data(), layout);
+                printStatsRow(engine, dtypeName<T>(), compareImages(reference, output),
+                              border == MedianBorder::Shrink ? "shrink" : "reflect");
+            }
+        };
+
+#ifdef HAVE_MFV4
+        check(float(), "v4", [&](const float *in, float *out, const MedianLayout& layout) {
+            median_filterv4_footprint(in, out, ny, nx, hy, hx, footprint.data(), layout);
+        });
+#endif
+        check(uint8_t(), "v5", [&](const uint8_t *in, uint8_t *out, const MedianLayout& layout) {
+            median_filterv5_footprint(in, out, ny, nx, hy, hx, footprint.data(), layout);
+        });
+    }
+    
+    void testVolumeConfiguration(int nz, int ny, int nx, int hz, int hy, int hx) {
+        std::cout << "\n3D volumes: " << nz << " x " << ny << " x " << nx << ", kernel "
+                 << (2*hz+1) << " x " << (2*hy+1) << " x " << (2*hx+1) << std::endl;
+        
+        // A volume is a stack of nz slices
+        forEachDType([&](auto zero) {
+            using T = decltype(zero);
+            auto input = testImage<T>(nz * ny, nx);
+            std::vector<T> reference(input.size()), output(input.size());
+            referenceMedianFilter3d(input.data(), reference.data(), nz, ny, nx, hz, hy, hx);
+            median_filter3d(input.data(), output.data(), nz, ny, nx, hz, hy, hx);
+            printStatsRow("3d", dtypeName<T>(), compareImages(reference, output), "shrink");
+            
+            // Budgeted and pinned calls give the same result
+            MedianCpuSet firstCpu;
+            firstCpu.set(0);
+            std::vector<T> budgeted(input.size()), pinned(input.size());
+            median_filter3d(input.data(), budgeted.data(), nz, ny, nx, hz, hy, hx, 3);
+            median_filter3d(input.data(), pinned.data(), nz, ny, nx, hz, hy, hx, 0, firstCpu);
+            auto stats = compareImages(reference, budgeted);
+            stats.isAccurate = stats.isAccurate && compareImages(reference, pinned).isAccurate;
+            printStatsRow("3d", dtypeName<T>(), stats, "3 threads, cpu 0");
+        });
+    }
+    
+    void testAdaptiveConfiguration(int ny, int nx, int hy, int hx, const std::string& pattern, double threshold) {
+        std::cout << "\nSwitching median: " << ny << " x " << nx << ", kernel "
+                 << (2*hy+1) << " x " << (2*hx+1) << ", pattern " << pattern << ", threshold " << threshold << std::endl;
+        
+        // Reference: flag pixels with fewer than two neighbours within the
+        // threshold, then take the full filter's value at flagged pixels only
+        forEachDType([&](auto zero) {
+            using T = decltype(zero);
+            const char *type = dtypeName<T>();
+            auto input = generateTestImage<T>(ny, nx, pattern);
+            std::vector<bool> impulse(ny * nx);
+            size_t impulses = 0;
+            for(int y = 0; y < ny; y++) {
+                for(int x = 0; x < nx; x++) {
+                    int similar = 0;
+                    for(int i = std::max(y - 1, 0); i <= std::min(y + 1, ny - 1); i++) {
+                        for(int j = std::max(x - 1, 0); j <= std::min(x + 1, nx - 1); j++) {
+                            if ((i != y || j != x) &&
+                                std::abs(double(input[i * nx + j]) - double(input[y * nx + x])) <= threshold) similar++;
+                        }
+                    }
+                    impulse[y * nx + x] = similar < 2;
+                    impulses += similar < 2;
+                }
+            }
+            auto switched = [&](const std::vector<T>& full) {
+                std::vector<T> result(input);
+                for(int i = 0; i < ny * nx; i++) {
+                    if (impulse[i]) result[i] = full[i];
+                }
+                return result;
+            };
+            
+            std::vector<T> full(ny * nx), output(ny * nx);
+            referenceMedian(input.data(), full.data(), ny, nx, hy, hx);
+            std::vector<T> reference = switched(full);
+            size_t replaced = median_filter_adaptive(input.data(), output.data(), ny, nx, hy, hx, threshold,
+                                                     median_dense_layout(ny, nx));
+            printStatsRow("adaptive", type, compareImages(reference, output),
+                          std::to_string(impulses) + " impulses" + (replaced == impulses ? "" : ", wrong count"));
+            
+            // A ROI matches the same region of the full result
+            MedianLayout layout = median_dense_layout(ny, nx);
+            layout.roi = MedianRect{ny / 4, ny - ny / 3, nx / 3, nx - nx / 5};
+            const int width = layout.roi.x1 - layout.roi.x0, height = layout.roi.y1 - layout.roi.y0;
+            layout.outStride = width;
+            std::vector<T> roi(height * width), expected(height * width);
+            median_filter_adaptive(input.data(), roi.data(), ny, nx, hy, hx, threshold, layout);
+            for(int y = 0; y < height; y++) {
+                for(int x = 0; x < width; x++) {
+                    expected[y * width + x] = reference[(layout.roi.y0 + y) * nx + layout.roi.x0 + x];
+                }
+            }
+            printStatsRow("adaptive", type, compareImages(expected, roi), "ROI");
+            
+            // Padding borders only change the medians
+            layout = median_dense_layout(ny, nx);
+            layout.border = MedianBorder::Reflect;
+            referenceBorderMedianFilter(input.data(), full.data(), ny, nx, hy, hx, MedianBorder::Reflect, T(0));
+            median_filter_adaptive(input.data(), output.data(), ny, nx, hy, hx, threshold, layout);
+            printStatsRow("adaptive", type, compareImages(switched(full), output), "reflect");
+        });
+    }
+    
+    // Pass chains against the passes run one after another on whole images;
+    // untilStable must give the same image and count the passes that changed it
+    void testChainConfiguration(int ny, int nx, const std::vector<MedianPass>& passes, const std::string& pattern,
+                                const char *name) {
+        std::cout << "\nPass chain: " << ny << " x " << nx << ", " << name << ", pattern " << pattern << std::endl;
+        
+        forEachDType([&](auto zero) {
+            using T = decltype(zero);
+            auto input = generateTestImage<T>(ny, nx, pattern);
+            std::vector<T> reference(input), next(ny * nx);
+            int changing = 0;
+            for(size_t k = 0; k < passes.size(); k++) {
+                referenceMedian(reference.data(), next.data(), ny, nx, passes[k].hy, passes[k].hx);
+                if (next != reference) changing = int(k) + 1;
+                reference.swap(next);
+            }
+            
+            for(bool untilStable : {false, true}) {
+                std::vector<T> output(ny * nx);
+                int count = median_filter_chain(input.data(), output.data(), ny, nx, passes.data(), (int)passes.size(),
+                                                untilStable);
+                int expected = untilStable ? changing : int(passes.size());
+                printStatsRow("chain", dtypeName<T>(), compareImages(reference, output),
+                              std::string(untilStable ? "stable, " : "") + std::to_string(count) + " passes" +
+                              (count == expected ? "" : ", wrong count"));
+            }
+            
+            // Strided, budgeted and pinned; other borders are rejected
+            MedianLayout layout{nx + 3, nx + 5, MedianRect{0, ny, 0, nx}};
+            layout.threads = 3;
+            layout.cpus.set(0);
+            std::vector<T> strided(size_t(ny) * (nx + 3)), padded(size_t(ny) * (nx + 5)), output(ny * nx);
+            for(int y = 0; y < ny; y++) std::copy(&input[y * nx], &input[(y + 1) * nx], &strided[y * (nx + 3)]);
+            median_filter_chain(strided.data(), padded.data(), ny, nx, passes.data(), (int)passes.size(), layout, true);
+            for(int y = 0; y < ny; y++) std::copy(&padded[y * (nx + 5)], &padded[y * (nx + 5) + nx], &output[y * nx]);
+            auto stats = compareImages(reference, output);
+            layout.border = MedianBorder::Reflect;
+            try {
+                median_filter_chain(strided.data(), padded.data(), ny, nx, passes.data(), (int)passes.size(), layout);
+                stats.isAccurate = false;
+            } catch (const std::invalid_argument&) {
+            }
+            printStatsRow("chain", dtypeName<T>(), stats, "strided, pinned");
+        });
+    }
+    
+    void testTemporalConfiguration(int ny, int nx, int frames, int pushes) {
+        std::cout << "\nTemporal: " << ny << " x " << nx << ", window of " << frames
+                 << " frames, " << pushes << " pushes" << std::endl;
+        
+        // The input is a stack of `pushes` frames; every push's output is
+        // checked against the sorted window of the frames so far
+        forEachDType([&](auto zero) {
+            using T = decltype(zero);
+            const char *type = dtypeName<T>();
+            const size_t pixels = size_t(ny) * nx;
+            auto input = testImage<T>(pushes * ny, nx);
+            
+            std::vector<T> reference(input.size()), result(input.size());
+            for(int f = 0; f < pushes; f++) {
+                for(size_t i = 0; i < pixels; i++) {
+                    std::vector<T> window;
+                    for(int g = std::max(0, f - frames + 1); g <= f; g++) window.push_back(input[g * pixels + i]);
+                    std::sort(window.begin(), window.end());
+                    size_t n = window.size();
+                    T lo = window[(n - 1) / 2], hi = window[n / 2];
+                    reference[f * pixels + i] = std::is_floating_point<T>::value ? T((lo + hi) / 2)
+                                                                                 : T((int(lo) + int(hi) + 1) / 2);
+                }
+            }
+            
+            // Run twice to check reset(); median() repeats the last push
+            MedianTemporal temporal(MedianTraits<T>::dtype, ny, nx, frames);
+            for(int pass = 0; pass < 2; pass++) {
+                bool consistent = true;
+                std::vector<T> last(pixels);
+                for(int f = 0; f < pushes; f++) {
+                    temporal.push(&input[f * pixels], &result[f * pixels]);
+                    temporal.median(last.data());
+                    consistent = consistent && std::equal(last.begin(), last.end(), &result[f * pixels]);
+                }
+                consistent = consistent && temporal.frames_in() == pushes;
+                printStatsRow("temporal", type, compareImages(reference, result),
+                              std::string(pass ? "after reset" : "sliding") + (consistent ? "" : ", inconsistent"));
+                temporal.reset();
+            }
+            
+            // A budgeted, pinned window gives the same medians
+            MedianCpuSet firstCpu;
+            firstCpu.set(0);
+            MedianTemporal pinned(MedianTraits<T>::dtype, ny, nx, frames, 3, firstCpu);
+            std::fill(result.begin(), result.end(), T(0));
+            for(int f = 0; f < pushes; f++) pinned.push(&input[f * pixels], &result[f * pixels]);
+            printStatsRow("temporal", type, compareImages(reference, result), "3 threads, cpu 0");
+            
+            // A reset window has no median; frames of another type are rejected
+            bool empty = false, mismatched = false;
+            try {
+                temporal.median(result.data());
+            } catch (const std::logic_error&) {
+                empty = true;
+            }
+            try {
+                MedianTemporal other(std::is_same<T, float>::value ? MedianDType::Uint8 : MedianDType::Float, ny, nx, frames);
+                other.push(input.data(), result.data());
+            } catch (const std::invalid_argument&) {
+                mismatched = true;
+            }
+            auto stats = compareImages(input, input);
+            stats.isAccurate = empty && mismatched;
+            printStatsRow("temporal", type, stats, "invalid use");
+        });
+    }
+    
     // Run comprehensive benchmark
     void runBenchmark() {
         std::cout << "Median Filter Accuracy Benchmark" << std::endl;
@@ -432,11 +1906,144 @@ public:
             }
         }
         
+        // Mask-aware entry points
+        for(const auto& pattern : patterns) {
+            for(const auto& imgSize : {std::make_pair(64, 64), std::make_pair(100, 150)}) {
+                for(const auto& kernelSize : {std::make_pair(1, 1), std::make_pair(3, 3), std::make_pair(1, 2)}) {
+                    testMaskedConfiguration(imgSize.first, imgSize.second,
+                                            kernelSize.first, kernelSize.second, pattern);
+                }
+            }
+        }
+        
+        // Half precision and bfloat16 entry points
+        for(const auto& pattern : patterns) {
+            for(const auto& kernelSize : {std::make_pair(1, 1), std::make_pair(2, 2), std::make_pair(1, 2)}) {
+                testFloat16Configuration(100, 150, kernelSize.first, kernelSize.second, pattern);
+            }
+        }
+        
+        // Bounded-error approximate float mode
+        for(const auto& pattern : patterns) {
+            for(const auto& kernelSize : {std::make_pair(1, 1), std::make_pair(3, 3), std::make_pair(1, 2)}) {
+                testApproxConfiguration(100, 150, kernelSize.first, kernelSize.second, pattern);
+            }
+        }
+        testApproxErrorConfiguration(100, 150, 4.0f);
+        
+        // Unified API with cost-model dispatch
+        for(const auto& imgSize : {std::make_pair(32, 32), std::make_pair(100, 150), std::make_pair(256, 256)}) {
+            for(const auto& kernelSize : {std::make_pair(1, 1), std::make_pair(2, 2), std::make_pair(4, 4), std::make_pair(1, 2)}) {
+                testDispatcherConfiguration(imgSize.first, imgSize.second, kernelSize.first, kernelSize.second, "random");
+            }
+        }
+        
+        // 1D kernels, including windows longer than the line
+        testLineConfiguration(100, 150, 0, 3, "random");
+        testLineConfiguration(100, 150, 7, 0, "noise_spikes");
+        testLineConfiguration(40, 20, 0, 30, "random");
+        testLineConfiguration(20, 40, 25, 0, "gradient");
+        testLineConfiguration(30, 30, 0, 0, "random");
+        testLineConfiguration(2, 40000, 0, 5, "random");     // several segments per line
+        testLineConfiguration(1500, 8, 4, 0, "random");
+        
+        // Border modes, including windows larger than the image
+        for(const auto& kernelSize : {std::make_pair(1, 1), std::make_pair(3, 3), std::make_pair(1, 2), std::make_pair(4, 4)}) {
+            testBorderConfiguration(100, 150, kernelSize.first, kernelSize.second, "random");
+        }
+        testBorderConfiguration(5, 7, 4, 4, "random");
+        
+        // Padded rows and regions of interest
+        for(const auto& pattern : {"random", "noise_spikes"}) {
+            for(const auto& kernelSize : {std::make_pair(1, 1), std::make_pair(3, 3), std::make_pair(1, 2)}) {
+                testLayoutConfiguration(100, 150, kernelSize.first, kernelSize.second, pattern);
+            }
+        }
+        
+        // Reusable plans
+        for(const auto& kernelSize : {std::make_pair(1, 1), std::make_pair(3, 3), std::make_pair(1, 2)}) {
+            testPlanConfiguration(100, 150, kernelSize.first, kernelSize.second);
+        }
+        testPlanAllocationConfiguration(100, 150, 2, 2);
+        
+        // Batches of small patches
+        for(const auto& kernelSize : {std::make_pair(1, 1), std::make_pair(2, 2), std::make_pair(1, 2)}) {
+            testBatchConfiguration(40, 32, 32, kernelSize.first, kernelSize.second);
+        }
+        testBatchConfiguration(10, 64, 48, 3, 3);
+        
+        // Row-by-row streaming, including images shorter than the kernel
+        for(const auto& kernelSize : {std::make_pair(1, 1), std::make_pair(3, 3), std::make_pair(2, 1)}) {
+            testStreamConfiguration(90, 70, kernelSize.first, kernelSize.second);
+        }
+        testStreamConfiguration(3, 40, 4, 2);
+        
+        // Memory-mapped files filtered in bands
+        testFileConfiguration(150, 130, 2, 2, 16);
+        testFileConfiguration(64, 1000, 3, 1, 1);
+        
+        // Several asynchronous calls in flight
+        testAsyncConfiguration(4, 80, 90, 2, 2);
+        
+        // Per-call thread budgets and CPU sets
+        testThreadingConfiguration(120, 100, 2, 2);
+        
+        // Many simultaneous callers sharing the workers
+        testContentionConfiguration(16, 96, 128, 2, 2);
+        
+        // The pool itself: the admission limit, fair sharing between loops,
+        // nested and throwing loops
+        testPoolConfiguration(8, 16);
+        
+        // Percentile and rank filters
+        testRankConfiguration(100, 150, 2, 2);
+        testRankConfiguration(40, 50, 1, 3);
+        testRankConfiguration(70, 60, 6, 6);
+        testMultiRankConfiguration(120, 140, 2, 3);
+        
+        // Integer-weighted medians
+        testWeightedConfiguration(100, 150, 1, 1, {1, 1, 1, 1, 3, 1, 1, 1, 1}, "center 3");
+        testWeightedConfiguration(90, 110, 2, 2, {0, 1, 1, 1, 0,  1, 2, 3, 2, 1,  1, 3, 9, 3, 1,  1, 2, 3, 2, 1,  0, 1, 1, 1, 0},
+                                  "pyramid");
+        testWeightedConfiguration(70, 80, 1, 2, {1, 0, 1, 0, 1,  64, 2, 5, 2, 1,  1, 0, 1, 0, 1}, "sparse, weight 64");
+        {
+            // 32768 weights of 65535 and one of 32767 sum to exactly INT_MAX
+            std::vector<int> heavy(183 * 183, 0);
+            for(int i = 0; i < 32768; i++) heavy[(i * 7) % heavy.size()] = 65535;
+            heavy[(32768 * 7) % heavy.size()] = 32767;
+            testWeightedConfiguration(30, 40, 91, 91, heavy, "sum INT_MAX");
+        }
+        
+        // Disk, cross and irregular footprints
+        testFootprintConfiguration(100, 150, 3, 3, median_disk_footprint(3), "disk 3");
+        testFootprintConfiguration(90, 120, 2, 4, median_cross_footprint(2, 4), "cross");
+        testFootprintConfiguration(80, 70, 1, 2, {1, 0, 0, 1, 1,  0, 1, 1, 0, 1,  1, 1, 0, 0, 0}, "irregular");
+        
+        // 3D volumes, including several bricks and a single slice
+        testVolumeConfiguration(20, 30, 40, 1, 1, 1);
+        testVolumeConfiguration(40, 70, 50, 2, 1, 3);
+        testVolumeConfiguration(1, 60, 80, 0, 2, 2);
+        
+        // Switching median: sparse impulses, and dense ones that take the full filter
+        testAdaptiveConfiguration(100, 150, 1, 1, "noise_spikes", 40.0);
+        testAdaptiveConfiguration(100, 150, 3, 3, "noise_spikes", 40.0);
+        testAdaptiveConfiguration(64, 64, 4, 4, "random", 40.0);
+        
+        // Fused pass chains, repeated kernels until stable and mixed kernels
+        testChainConfiguration(100, 150, std::vector<MedianPass>(6, MedianPass{1, 1}), "noise_spikes", "6 x 3x3");
+        testChainConfiguration(300, 40, {{1, 1}, {2, 2}, {0, 3}, {4, 1}}, "random", "3x3, 5x5, 1x7, 9x3");
+        testChainConfiguration(24, 24, std::vector<MedianPass>(30, MedianPass{1, 1}), "noise_spikes", "30 x 3x3");
+        
+        // Sliding per-pixel medians over frames
+        testTemporalConfiguration(30, 40, 7, 20);
+        testTemporalConfiguration(60, 80, 8, 20);
+        testTemporalConfiguration(20, 30, 1, 5);
+        
         std::cout << "\nBenchmark completed!" << std::endl;
-        std::cout << "\nTo add a new version (e.g., v5):" << std::endl;
-        std::cout << "1. Implement median_filterv5() function" << std::endl;
-        std::cout << "2. Add extern declaration at the top of benchmark.cc" << std::endl;
-        std::cout << "3. Add registerVersion(\"v5\", median_filterv5, \"Description\") in constructor" << std::endl;
+        std::cout << "\nTo add a new version (e.g., v7):" << std::endl;
+        std::cout << "1. Implement median_filterv7() function" << std::endl;
+        std::cout << "2. Declare it in median_filter.h" << std::endl;
+        std::cout << "3. Add registerFloatVersion(\"v7\", median_filterv7, \"Description\") in constructor" << std::endl;
     }
 };
 
@@ -0,0 +1,553 @@
+#ifndef MEDIAN_FILTER_H
+#define MEDIAN_FILTER_H
+
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
+#include <vector>
+
+// Public interface of the median filter library.
+//
+// All images are row-major ny x nx arrays. The window around each pixel is
+// (2*hy + 1) x (2*hx + 1) and shrinks at the image border; windows with an
+// even number of pixels return the mean of the two middle values (rounded up
+// for integer types).
+//
+// Every entry point also has an overload taking a MedianLayout as its last
+// argument, for padded rows, regions of interest and other border modes (see
+// below).
+
+// Rows [y0, y1) and columns [x0, x1) of an image
+struct MedianRect {
+    int y0, y1, x0, x1;
+};
+
+// How windows that cross the image border are completed. Shrink drops the
+// missing pixels (windows may then hold an even count); the other modes pad
+// the image virtually, without copies, so every window is full:
+//   Replicate  aaa|abcd|ddd      Reflect  cba|abcd|dcb
+//   Wrap       bcd|abcd|abc      Constant kkk|abcd|kkk  (k = borderValue)
+enum class MedianBorder {
+    Shrink,
+    Replicate,
+    Reflect,
+    Wrap,
+    Constant
+};
+
+// CPUs by index, for pinning worker threads (see MedianLayout::cpus)
+typedef std::bitset<1024> MedianCpuSet;
+
+// Memory layout, border handling and threading of a call. The input is the
+// whole ny x nx image with rows inStride elements apart; only `roi` is
+// filtered, and `output` points at the output pixel of the ROI origin with
+// rows outStride elements apart. Windows read halo pixels outside the ROI and
+// only shrink at the image border, so a ROI result equals the same region of
+// a full-image result. Masks share the input layout. Requires inStride >= nx
+// and outStride >= roi width.
+// borderValue is converted to the element type (for fp16/bf16 it is the
+// value to encode, not a bit pattern).
+//
+// `threads` caps the worker threads of the call (0: one per CPU in `cpus`,
+// or the library default). With a non-empty `cpus` the tiles run on the
+// workers pinned to the CPUs of the set (Linux), one per CPU of the machine
+// and shared by every set that includes it, so independent streams can be
+// kept on disjoint cores; the calling thread then only waits. CPUs the
+// process may not use leave their worker unpinned; a set naming none of the
+// machine's CPUs runs on the shared workers.
+struct MedianLayout {
+    ptrdiff_t inStride;
+    ptrdiff_t outStride;
+    MedianRect roi;
+    MedianBorder border = MedianBorder::Shrink;
+    double borderValue = 0.0;
+    int threads = 0;
+    MedianCpuSet cpus = MedianCpuSet();
+};
+
+// Layout of a dense ny x nx buffer filtered as a whole
+inline MedianLayout median_dense_layout(int ny, int nx) {
+    return MedianLayout{nx, nx, MedianRect{0, ny, 0, nx}};
+}
+
+// Order statistic of a rank filter, as a percentile in [0, 100] or an
+// absolute 0-based rank in [0, N - 1] of the full N = (2hy+1)(2hx+1) window.
+// Either is a fraction q of the window (p / 100 or r / (N - 1)), and a window
+// of n pixels yields its pixel of rank round(q * (n - 1)): 0 is the minimum,
+// 100 (or N - 1) the maximum, absolute ranks hold exactly in full windows and
+// scale with windows shrunk at the border. Unlike the median, even windows
+// are not averaged (p50 takes the upper middle pixel).
+struct MedianRank {
+    enum Kind { Percentile, Absolute };
+    Kind kind;
+    double value;
+};
+
+inline MedianRank median_percentile(double p) { return MedianRank{MedianRank::Percentile, p}; }
+inline MedianRank median_rank(int r) { return MedianRank{MedianRank::Absolute, double(r)}; }
+
+// Rank selected in a window of n > 0 pixels out of `full`
+inline int median_rank_index(const MedianRank &rank, int n, int full) {
+    if (rank.kind == MedianRank::Absolute) {
+        if (full <= 1) return 0;
+        long long r = (long long)rank.value;
+        return int((r * (n - 1) + (full - 1) / 2) / (full - 1));
+    }
+    return int(rank.value / 100.0 * (n - 1) + 0.5);
+}
+
+// Footprints for the *_footprint engines, row-major: a (2r+1) x (2r+1) disk
+// (pixels within r + 1/2 of the centre) and a (2hy+1) x (2hx+1) cross (the
+// centre row and column)
+inline std::vector<uint8_t> median_disk_footprint(int r) {
+    std::vector<uint8_t> footprint((2 * r + 1) * (2 * r + 1));
+    for (int dy = -r; dy <= r; dy++) {
+        for (int dx = -r; dx <= r; dx++) footprint[(dy + r) * (2 * r + 1) + (dx + r)] = dy * dy + dx * dx <= r * r + r;
+    }
+    return footprint;
+}
+
+inline std::vector<uint8_t> median_cross_footprint(int hy, int hx) {
+    std::vector<uint8_t> footprint((2 * hy + 1) * (2 * hx + 1));
+    for (int dy = -hy; dy <= hy; dy++) {
+        for (int dx = -hx; dx <= hx; dx++) footprint[(dy + hy) * (2 * hx + 1) + (dx + hx)] = dy == 0 || dx == 0;
+    }
+    return footprint;
+}
+
+// ---------------------------------------------------------------------------
+// Engines (one per mfv*.cc)
+// ---------------------------------------------------------------------------
+
+void median_filterv1(const float *input, float *output, int ny, int nx, int hy, int hx);
+void median_filterv1(const float *input, float *output, int ny, int nx, int hy, int hx, const MedianLayout &layout);
+void median_filterv2(const float *input, float *output, int ny, int nx, int hy, int hx);
+void median_filterv2(const float *input, float *output, int ny, int nx, int hy, int hx, const MedianLayout &layout);
+void median_filterv3(const float *input, float *output, int ny, int nx, int hy, int hx);
+void median_filterv3(const float *input, float *output, int ny, int nx, int hy, int hx, const MedianLayout &layout);
+
+// v4 is only available on x86_64 architectures
+#ifdef HAVE_MFV4
+void median_filterv4(const float *input, float *output, int ny, int nx, int hy, int hx);
+void median_filterv4(const float *input, float *output, int ny, int nx, int hy, int hx, const MedianLayout &layout);
+void median_filterv4_masked(const float *input, const uint8_t *mask, float *output, int ny, int nx, int hy, int hx, float fill);
+void median_filterv4_masked(const float *input, const uint8_t *mask, float *output, int ny, int nx, int hy, int hx, float fill,
+                            const MedianLayout &layout);
+void median_filterv4_rank(const float *input, float *output, int ny, int nx, int hy, int hx, MedianRank rank);
+void median_filterv4_rank(const float *input, float *output, int ny, int nx, int hy, int hx, MedianRank rank,
+                          const MedianLayout &layout);
+// Several ranks in one pass: outputs[k] (laid out like output) receives ranks[k]
+void median_filterv4_ranks(const float *input, float *const *outputs, int ny, int nx, int hy, int hx,
+                           const MedianRank *ranks, int count);
+void median_filterv4_ranks(const float *input, float *const *outputs, int ny, int nx, int hy, int hx,
+                           const MedianRank *ranks, int count, const MedianLayout &layout);
+// Weighted median: weights is a (2hy+1) x (2hx+1) row-major mask of counts in [0, 65535]
+// summing to at most INT_MAX
+void median_filterv4_weighted(const float *input, float *output, int ny, int nx, int hy, int hx, const int *weights);
+void median_filterv4_weighted(const float *input, float *output, int ny, int nx, int hy, int hx, const int *weights,
+                              const MedianLayout &layout);
+// Footprint median: the (2hy+1) x (2hx+1) row-major footprint selects the window pixels (non-zero)
+void median_filterv4_footprint(const float *input, float *output, int ny, int nx, int hy, int hx, const uint8_t *footprint);
+void median_filterv4_footprint(const float *input, float *output, int ny, int nx, int hy, int hx, const uint8_t *footprint,
+                               const MedianLayout &layout);
+#endif
+
+// v5+ use integer keys
+void median_filterv5(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx);
+void median_filterv5(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx, const MedianLayout &layout);
+void median_filterv5_masked(const uint8_t *input, const uint8_t *mask, uint8_t *output, int ny, int nx, int hy, int hx, uint8_t fill);
+void median_filterv5_masked(const uint8_t *input, const uint8_t *mask, uint8_t *output, int ny, int nx, int hy, int hx, uint8_t fill,
+                            const MedianLayout &layout);
+void median_filterv5_rank(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx, MedianRank rank);
+void median_filterv5_rank(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx, MedianRank rank,
+                          const MedianLayout &layout);
+// Several ranks in one pass: outputs[k] (laid out like output) receives ranks[k]
+void median_filterv5_ranks(const uint8_t *input, uint8_t *const *outputs, int ny, int nx, int hy, int hx,
+                           const MedianRank *ranks, int count);
+void median_filterv5_ranks(const uint8_t *input, uint8_t *const *outputs, int ny, int nx, int hy, int hx,
+                           const MedianRank *ranks, int count, const MedianLayout &layout);
+// Weighted median: weights is a (2hy+1) x (2hx+1) row-major mask of counts in [0, 65535]
+// summing to at most INT_MAX
+void median_filterv5_weighted(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx, const int *weights);
+void median_filterv5_weighted(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx, const int *weights,
+                              const MedianLayout &layout);
+// Footprint median: the (2hy+1) x (2hx+1) row-major footprint selects the window pixels (non-zero)
+void median_filterv5_footprint(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx, const uint8_t *footprint);
+void median_filterv5_footprint(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx, const uint8_t *footprint,
+                               const MedianLayout &layout);
+
+void median_filterv6(const uint16_t *input, uint16_t *output, int ny, int nx, int hy, int hx);
+void median_filterv6(const uint16_t *input, uint16_t *output, int ny, int nx, int hy, int hx, const MedianLayout &layout);
+void median_filterv6_fp16(const uint16_t *input, uint16_t *output, int ny, int nx, int hy, int hx);
+void median_filterv6_fp16(const uint16_t *input, uint16_t *output, int ny, int nx, int hy, int hx, const MedianLayout &layout);
+void median_filterv6_bf16(const uint16_t *input, uint16_t *output, int ny, int nx, int hy, int hx);
+void median_filterv6_bf16(const uint16_t *input, uint16_t *output, int ny, int nx, int hy, int hx, const MedianLayout &layout);
+// Approximate float median within `tolerance` of the exact one. Returns the
+// largest error the outputs can have: the farthest any input value lies
+// from the centre of its bin, over the bins the outputs were decoded from,
+// plus float rounding (<= tolerance). Returns 0 when it falls back to the
+// exact filter.
+float median_filterv6_approx(const float *input, float *output, int ny, int nx, int hy, int hx, float tolerance);
+float median_filterv6_approx(const float *input, float *output, int ny, int nx, int hy, int hx, float tolerance,
+                             const MedianLayout &layout);
+
+// v7: 1D kernels (hy == 0 or hx == 0) for every type; throws
+// std::invalid_argument for 2D kernels. The dispatcher picks it for all 1D kernels.
+void median_filterv7(const float *input, float *output, int ny, int nx, int hy, int hx);
+void median_filterv7(const float *input, float *output, int ny, int nx, int hy, int hx, const MedianLayout &layout);
+void median_filterv7(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx);
+void median_filterv7(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx, const MedianLayout &layout);
+void median_filterv7(const uint16_t *input, uint16_t *output, int ny, int nx, int hy, int hx);
+void median_filterv7(const uint16_t *input, uint16_t *output, int ny, int nx, int hy, int hx, const MedianLayout &layout);
+
+// Signals of n samples (beyond int range) with windows of 2h + 1 samples,
+// shrinking at the ends, on `threads` workers pinned to `cpus` as in MedianLayout
+void median_filter1d(const float *input, float *output, size_t n, int h, int threads = 0,
+                     const MedianCpuSet &cpus = MedianCpuSet());
+void median_filter1d(const uint8_t *input, uint8_t *output, size_t n, int h, int threads = 0,
+                     const MedianCpuSet &cpus = MedianCpuSet());
+void median_filter1d(const uint16_t *input, uint16_t *output, size_t n, int h, int threads = 0,
+                     const MedianCpuSet &cpus = MedianCpuSet());
+
+// OpenCV implementations (if available)
+#ifdef HAVE_OPENCV
+void median_filter_opencv_float(const float *input, float *output, int ny, int nx, int hy, int hx);
+void median_filter_opencv_float(const float *input, float *output, int ny, int nx, int hy, int hx, const MedianLayout &layout);
+void median_filter_opencv_uint8(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx);
+void median_filter_opencv_uint8(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx, const MedianLayout &layout);
+#endif
+
+// ---------------------------------------------------------------------------
+// Dispatcher
+// ---------------------------------------------------------------------------
+
+enum class MedianEngine {
+    None,
+    V1,
+    V2,
+    V3,
+    V4,
+    V5,
+    V6,
+    V7,
+    OpenCV
+};
+
+enum class MedianDType {
+    Float,
+    Uint8,
+    Uint16
+};
+
+template <typename T> struct MedianTraits;
+template <> struct MedianTraits<float> { static constexpr MedianDType dtype = MedianDType::Float; };
+template <> struct MedianTraits<uint8_t> { static constexpr MedianDType dtype = MedianDType::Uint8; };
+template <> struct MedianTraits<uint16_t> { static constexpr MedianDType dtype = MedianDType::Uint16; };
+
+const char *median_engine_name(MedianEngine engine);
+const char *median_dtype_name(MedianDType dtype);
+
+// Engines the cost model may pick for a data type; 1D kernels always go to
+// v7. Others (v1, OpenCV) can still be run explicitly through the engine
+// overload of median_filter().
+std::vector<MedianEngine> median_filter_engines(MedianDType dtype);
+
+// Engine the cost model picks for this geometry
+MedianEngine median_filter_select(MedianDType dtype, int ny, int nx, int hy, int hx);
+
+template <typename T>
+inline MedianEngine median_filter_select(int ny, int nx, int hy, int hx) {
+    return median_filter_select(MedianTraits<T>::dtype, ny, nx, hy, hx);
+}
+
+// Filter with the engine chosen by the cost model; `chosen` (optional)
+// receives the engine that ran. Defined for float, uint8_t and uint16_t.
+template <typename T>
+void median_filter(const T *input, T *output, int ny, int nx, int hy, int hx, MedianEngine *chosen = nullptr);
+
+// Filter with a specific registered engine. Returns false if the engine is
+// not registered for T or cannot handle the kernel shape.
+template <typename T>
+bool median_filter(const T *input, T *output, int ny, int nx, int hy, int hx, MedianEngine engine);
+
+// Strided / ROI forms of the two calls above; the cost model sees the ROI size
+template <typename T>
+void median_filter(const T *input, T *output, int ny, int nx, int hy, int hx, const MedianLayout &layout,
+                   MedianEngine *chosen = nullptr);
+template <typename T>
+bool median_filter(const T *input, T *output, int ny, int nx, int hy, int hx, const MedianLayout &layout,
+                   MedianEngine engine);
+
+// Replace the cost model's crossover table with one written by
+// `./timing --calibrate` (CSV: dtype,engine,pixels,window,ns_per_pixel).
+// The table is also loaded on first use from $MEDIAN_FILTER_TABLE if set.
+bool median_filter_load_table(const char *path);
+
+// ---------------------------------------------------------------------------
+// Asynchronous calls
+// ---------------------------------------------------------------------------
+
+// Receives the engine that ran, or the exception the call threw. Runs on a
+// library worker and must not throw.
+typedef std::function<void(MedianEngine engine, std::exception_ptr error)> MedianCallback;
+
+// Queue a filter call on the library's job workers and return immediately;
+// several calls may be in flight at once. input and output must stay valid
+// until the call completes. The future yields the engine that ran, or
+// rethrows std::invalid_argument if an explicit `engine` cannot run. Defined
+// for float, uint8_t and uint16_t.
+template <typename T>
+std::future<MedianEngine> median_filter_submit(const T *input, T *output, int ny, int nx, int hy, int hx,
+                                               MedianEngine engine = MedianEngine::None);
+template <typename T>
+std::future<MedianEngine> median_filter_submit(const T *input, T *output, int ny, int nx, int hy, int hx,
+                                               const MedianLayout &layout, MedianEngine engine = MedianEngine::None);
+
+// Callback form: `done` runs on the worker once the call has finished
+template <typename T>
+void median_filter_submit(const T *input, T *output, int ny, int nx, int hy, int hx, const MedianLayout &layout,
+                          MedianCallback done, MedianEngine engine = MedianEngine::None);
+
+// ---------------------------------------------------------------------------
+// Plans
+// ---------------------------------------------------------------------------
+
+// A plan fixes the data type and geometry of a stream of frames. The engine
+// (picked by the cost model unless given), the tile layout, every thread's
+// scratch memory and the parallel loop's bookkeeping are set up once in the
+// constructor, so execute() and execute_batch() do no allocation. Engines
+// without a tile engine (v1, v2, v7, OpenCV) simply forward to their
+// one-shot entry point, which may allocate.
+class MedianPlan {
+public:
+    MedianPlan(MedianDType dtype, int ny, int nx, int hy, int hx, MedianEngine engine = MedianEngine::None);
+    MedianPlan(MedianDType dtype, int ny, int nx, int hy, int hx, const MedianLayout &layout,
+               MedianEngine engine = MedianEngine::None);
+    ~MedianPlan();
+
+    MedianPlan(MedianPlan &&other) noexcept;
+    MedianPlan &operator=(MedianPlan &&other) noexcept;
+    MedianPlan(const MedianPlan &) = delete;
+    MedianPlan &operator=(const MedianPlan &) = delete;
+
+    MedianEngine engine() const;
+    MedianDType dtype() const;
+
+    // Throw std::invalid_argument if the element type is not the plan's dtype.
+    // A plan may only execute one frame at a time.
+    void execute(const float *input, float *output);
+    void execute(const uint8_t *input, uint8_t *output);
+    void execute(const uint16_t *input, uint16_t *output);
+
+    // Filter `count` frames, parallel across frames rather than within them:
+    // each worker runs whole frames with its own scratch. Frames come either
+    // as pointer arrays or packed back to back (frame i at input +
+    // i * ny * inStride and output + i * roi height * outStride).
+    void execute_batch(const float *const *inputs, float *const *outputs, int count);
+    void execute_batch(const uint8_t *const *inputs, uint8_t *const *outputs, int count);
+    void execute_batch(const uint16_t *const *inputs, uint16_t *const *outputs, int count);
+    void execute_batch(const float *input, float *output, int count);
+    void execute_batch(const uint8_t *input, uint8_t *output, int count);
+    void execute_batch(const uint16_t *input, uint16_t *output, int count);
+
+    struct Impl;
+
+private:
+    Impl *impl;
+};
+
+// One-shot batch of `count` dense ny x nx images (many small patches):
+// plans once and runs MedianPlan::execute_batch. `chosen` (optional)
+// receives the engine. Defined for float, uint8_t and uint16_t.
+template <typename T>
+void median_filter_batch(const T *const *inputs, T *const *outputs, int count, int ny, int nx, int hy, int hx,
+                         MedianEngine *chosen = nullptr);
+template <typename T>
+void median_filter_batch(const T *input, T *output, int count, int ny, int nx, int hy, int hx,
+                         MedianEngine *chosen = nullptr);
+
+// ---------------------------------------------------------------------------
+// Pass chains
+// ---------------------------------------------------------------------------
+
+// Kernel of one pass of a chain
+struct MedianPass {
+    int hy, hx;
+};
+
+// Apply `count` medians in sequence to a dense ny x nx image (pass k filters
+// the output of pass k - 1). The passes run as a pipeline over bands of
+// rows, each consuming the previous pass's rows while they are still in
+// cache, instead of streaming the whole frame through memory once per pass.
+// With untilStable, a pass with the same kernel as the previous one skips
+// the rows the previous pass left unchanged (they are a fixed point), so
+// repeating a kernel costs work only where the image still changes; the
+// call then returns the number of passes up to the last that changed a
+// pixel, else `count`. Defined for float, uint8_t and uint16_t.
+template <typename T>
+int median_filter_chain(const T *input, T *output, int ny, int nx, const MedianPass *passes, int count,
+                        bool untilStable = false);
+
+// With a layout: the input and output strides, and the thread budget and
+// CPUs every band of every pass runs on. Passes always use the Shrink border
+// (windows shrink at the image edges), so the ROI must be the whole image and
+// the border Shrink; anything else throws std::invalid_argument.
+template <typename T>
+int median_filter_chain(const T *input, T *output, int ny, int nx, const MedianPass *passes, int count,
+                        const MedianLayout &layout, bool untilStable = false);
+
+// ---------------------------------------------------------------------------
+// Streaming
+// ---------------------------------------------------------------------------
+
+// Row-by-row filter for images of unbounded height (line-scan cameras). Only
+// the last 2*hy + 1 input rows are kept, so memory is O(nx * hy) plus a
+// 256-bin histogram per column for uint8. Pushing input row y + hy completes
+// output row y; after the last input row, finish() returns the remaining
+// hy rows one by one. Windows shrink at the image border as in the one-shot
+// filters. Throws std::invalid_argument on a dtype mismatch and
+// std::logic_error when pushing after finish() without reset().
+class MedianStream {
+public:
+    MedianStream(MedianDType dtype, int nx, int hy, int hx);
+    ~MedianStream();
+
+    MedianStream(MedianStream &&other) noexcept;
+    MedianStream &operator=(MedianStream &&other) noexcept;
+    MedianStream(const MedianStream &) = delete;
+    MedianStream &operator=(const MedianStream &) = delete;
+
+    MedianDType dtype() const;
+    long long rows_in() const;     // input rows pushed
+    long long rows_out() const;    // output rows produced
+
+    // Add one input row of nx pixels. Returns true if output row
+    // rows_out() - 1 was written to `output`.
+    bool push(const float *row, float *output);
+    bool push(const uint8_t *row, uint8_t *output);
+    bool push(const uint16_t *row, uint16_t *output);
+
+    // End of input: write the next remaining output row, false once all
+    // rows have been produced
+    bool finish(float *output);
+    bool finish(uint8_t *output);
+    bool finish(uint16_t *output);
+
+    // Start a new image, keeping the buffers
+    void reset();
+
+    struct Impl;
+
+private:
+    Impl *impl;
+};
+
+// ---------------------------------------------------------------------------
+// Switching median
+// ---------------------------------------------------------------------------
+
+// Impulse-noise removal that leaves clean pixels untouched. A pixel is an
+// impulse when fewer than two of its 8 neighbours (those inside the image)
+// differ from it by at most `threshold`; impulses get the median of their
+// window, all other pixels are copied. The cost follows the number of
+// impulses, not the image area. Returns the number of pixels replaced;
+// throws std::invalid_argument for a negative threshold.
+size_t median_filter_adaptive(const float *input, float *output, int ny, int nx, int hy, int hx, double threshold);
+size_t median_filter_adaptive(const float *input, float *output, int ny, int nx, int hy, int hx, double threshold,
+                              const MedianLayout &layout);
+size_t median_filter_adaptive(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx, double threshold);
+size_t median_filter_adaptive(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx, double threshold,
+                              const MedianLayout &layout);
+size_t median_filter_adaptive(const uint16_t *input, uint16_t *output, int ny, int nx, int hy, int hx, double threshold);
+size_t median_filter_adaptive(const uint16_t *input, uint16_t *output, int ny, int nx, int hy, int hx, double threshold,
+                              const MedianLayout &layout);
+
+// ---------------------------------------------------------------------------
+// Temporal median
+// ---------------------------------------------------------------------------
+
+// Per-pixel median of the last `frames` dense ny x nx frames (background
+// estimation). Each pixel keeps its window sorted, so a push costs O(frames)
+// per pixel, vectorized across pixels, instead of a sort. Until `frames`
+// frames have been pushed the median is over those pushed so far; even
+// counts average the two middle values as in the spatial filters. Pushes run
+// on `threads` workers pinned to `cpus`, as in MedianLayout. Throws
+// std::invalid_argument on a dtype mismatch and std::logic_error for the
+// median of an empty window.
+class MedianTemporal {
+public:
+    MedianTemporal(MedianDType dtype, int ny, int nx, int frames, int threads = 0,
+                   const MedianCpuSet &cpus = MedianCpuSet());
+    ~MedianTemporal();
+
+    MedianTemporal(MedianTemporal &&other) noexcept;
+    MedianTemporal &operator=(MedianTemporal &&other) noexcept;
+    MedianTemporal(const MedianTemporal &) = delete;
+    MedianTemporal &operator=(const MedianTemporal &) = delete;
+
+    MedianDType dtype() const;
+    long long frames_in() const;    // frames pushed
+
+    // Add a frame, dropping the oldest once the window is full, and write
+    // the median of the window to `output` (may be nullptr)
+    void push(const float *frame, float *output);
+    void push(const uint8_t *frame, uint8_t *output);
+    void push(const uint16_t *frame, uint16_t *output);
+
+    // Median of the current window, without pushing
+    void median(float *output) const;
+    void median(uint8_t *output) const;
+    void median(uint16_t *output) const;
+
+    // Empty the window, keeping the buffers
+    void reset();
+
+    struct Impl;
+
+private:
+    Impl *impl;
+};
+
+// ---------------------------------------------------------------------------
+// Out-of-core
+// ---------------------------------------------------------------------------
+
+struct MedianFileOptions {
+    size_t memoryBudget = size_t(1) << 30;        // bytes of input and output kept resident
+    MedianBorder border = MedianBorder::Shrink;
+    double borderValue = 0.0;
+    MedianEngine engine = MedianEngine::None;     // None: cost model per band
+    int threads = 0;                              // as in MedianLayout
+    MedianCpuSet cpus = MedianCpuSet();
+};
+
+// Filter a raw row-major ny x nx image file (dtype pixels in native byte
+// order, no header) into a new file of the same format, for images larger
+// than memory. Both files are memory-mapped and filtered in bands of rows
+// sized to the memory budget; the next band is prefetched while the current
+// one is filtered. Returns the engine that ran the last band. Throws
+// std::system_error on I/O errors and std::invalid_argument if the input is
+// too small, the output names the input file or the engine cannot run.
+MedianEngine median_filter_file(MedianDType dtype, const char *inputPath, const char *outputPath, int ny, int nx,
+                                int hy, int hx, const MedianFileOptions &options = MedianFileOptions());
+
+// ---------------------------------------------------------------------------
+// Volumes
+// ---------------------------------------------------------------------------
+
+// 3D median of a dense nz x ny x nx volume (x fastest) over a
+// (2hz+1) x (2hy+1) x (2hx+1) box. Windows shrink at the faces and even
+// windows average their two middle values, as in 2D. Runs in bricks on
+// `threads` workers pinned to `cpus`, as in MedianLayout; throws
+// std::invalid_argument on invalid sizes.
+void median_filter3d(const float *input, float *output, int nz, int ny, int nx, int hz, int hy, int hx,
+                     int threads = 0, const MedianCpuSet &cpus = MedianCpuSet());
+void median_filter3d(const uint8_t *input, uint8_t *output, int nz, int ny, int nx, int hz, int hy, int hx,
+                     int threads = 0, const MedianCpuSet &cpus = MedianCpuSet());
+void median_filter3d(const uint16_t *input, uint16_t *output, int nz, int ny, int nx, int hz, int hy, int hx,
+                     int threads = 0, const MedianCpuSet &cpus = MedianCpuSet());
+
+#endif
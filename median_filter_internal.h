@@ -0,0 +1,329 @@
+#ifndef MEDIAN_FILTER_INTERNAL_H
+#define MEDIAN_FILTER_INTERNAL_H
+
+#include "median_filter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Interfaces shared by the engines, the dispatcher and MedianPlan. Not part
+// of the public API.
+//
+// Every parallel engine computes its output tile by tile. A tile engine
+// describes how an image is split, what per-thread scratch a tile needs and
+// how one tile is filtered, so that the one-shot entry points and MedianPlan
+// run exactly the same code.
+
+// Image, kernel, memory layout and border of a call (see MedianLayout)
+struct MedianGeometry {
+    int ny, nx, hy, hx;
+    ptrdiff_t inStride, outStride;
+    MedianRect roi;
+    MedianBorder border;
+    double borderValue;
+    int threads;
+    MedianCpuSet cpus;
+};
+
+inline MedianGeometry median_geometry(int ny, int nx, int hy, int hx, const MedianLayout &layout) {
+    return MedianGeometry{ny, nx, hy, hx, layout.inStride, layout.outStride, layout.roi,
+                          layout.border, layout.borderValue, layout.threads, layout.cpus};
+}
+
+inline MedianLayout median_layout(const MedianGeometry &g) {
+    return MedianLayout{g.inStride, g.outStride, g.roi, g.border, g.borderValue, g.threads, g.cpus};
+}
+
+// Virtual padding: source index of coordinate i along an axis of n pixels,
+// or -1 if the pixel is missing (Shrink) or takes the constant (Constant)
+inline int median_border_index(MedianBorder border, int i, int n) {
+    if (i >= 0 && i < n) return i;
+    switch (border) {
+        case MedianBorder::Replicate:
+            return i < 0 ? 0 : n - 1;
+        case MedianBorder::Reflect: {
+            int m = i % (2 * n);
+            if (m < 0) m += 2 * n;
+            return m < n ? m : 2 * n - 1 - m;
+        }
+        case MedianBorder::Wrap: {
+            int m = i % n;
+            return m < 0 ? m + n : m;
+        }
+        default:
+            return -1;
+    }
+}
+
+// Constant border value in the element type
+template <typename T>
+inline T median_border_constant(const MedianGeometry &g) {
+    if (std::is_integral<T>::value) {
+        double lo = double(std::numeric_limits<T>::min()), hi = double(std::numeric_limits<T>::max());
+        return T(std::min(std::max(std::round(g.borderValue), lo), hi));
+    }
+    return T(g.borderValue);
+}
+
+// Full window around (y, x) under a padding border (not Shrink), row by row
+// into pixels[0, (2hy+1)(2hx+1))
+template <typename T>
+inline void median_gather_padded(const T *input, const MedianGeometry &g, int y, int x, T *pixels) {
+    const T constant = median_border_constant<T>(g);
+    int len = 0;
+    for (int i = y - g.hy; i <= y + g.hy; i++) {
+        int r = median_border_index(g.border, i, g.ny);
+        for (int j = x - g.hx; j <= x + g.hx; j++) {
+            int c = median_border_index(g.border, j, g.nx);
+            pixels[len++] = (r < 0 || c < 0) ? constant : input[r * g.inStride + c];
+        }
+    }
+}
+
+// Throw std::invalid_argument unless `rank` lies within a full window
+inline void median_check_rank(const MedianRank &rank, int hy, int hx, const char *who) {
+    const double full = double(2 * hy + 1) * (2 * hx + 1);
+    bool valid = rank.kind == MedianRank::Percentile ? rank.value >= 0.0 && rank.value <= 100.0
+                                                      : rank.value >= 0.0 && rank.value < full;
+    if (!valid) throw std::invalid_argument(std::string(who) + ": rank outside the window");
+}
+
+// Fraction q of the full window that a valid rank selects
+inline double median_rank_fraction(const MedianRank &rank, int hy, int hx) {
+    const int full = (2 * hy + 1) * (2 * hx + 1);
+    if (rank.kind == MedianRank::Percentile) return rank.value / 100.0;
+    return full > 1 ? rank.value / (full - 1) : 0.0;
+}
+
+// Checked ranks of a multi-rank filter with their output planes, lowest
+// rank first, so that the searches of one window move in one direction
+template <typename T>
+std::vector<std::pair<MedianRank, T *>> median_sorted_ranks(const MedianRank *ranks, T *const *outputs, int count,
+                                                            int hy, int hx, const char *who) {
+    std::vector<std::pair<MedianRank, T *>> planes;
+    for (int i = 0; i < count; i++) {
+        median_check_rank(ranks[i], hy, hx, who);
+        planes.push_back({ranks[i], outputs[i]});
+    }
+    std::stable_sort(planes.begin(), planes.end(), [&](const auto &a, const auto &b) {
+        return median_rank_fraction(a.first, hy, hx) < median_rank_fraction(b.first, hy, hx);
+    });
+    return planes;
+}
+
+// Throw std::invalid_argument unless the (2hy+1) x (2hx+1) weights lie in
+// [0, 65535], at least one is positive and their sum fits in an int, which
+// the engines count window weight in
+inline void median_check_weights(const int *weights, int hy, int hx, const char *who) {
+    long long sum = 0;
+    for (int i = 0; i < (2 * hy + 1) * (2 * hx + 1); i++) {
+        if (weights[i] < 0 || weights[i] > 65535) {
+            throw std::invalid_argument(std::string(who) + ": weights must lie in [0, 65535]");
+        }
+        sum += weights[i];
+    }
+    if (sum == 0) throw std::invalid_argument(std::string(who) + ": all weights are zero");
+    if (sum > std::numeric_limits<int>::max()) {
+        throw std::invalid_argument(std::string(who) + ": weights sum past INT_MAX");
+    }
+}
+
+// Weights 0 and 1 of a (2hy+1) x (2hx+1) footprint; throws
+// std::invalid_argument if it selects no pixel
+inline std::vector<int> median_footprint_weights(const uint8_t *footprint, int hy, int hx, const char *who) {
+    std::vector<int> weights((2 * hy + 1) * (2 * hx + 1));
+    for (size_t i = 0; i < weights.size(); i++) weights[i] = footprint[i] ? 1 : 0;
+    if (std::find(weights.begin(), weights.end(), 1) == weights.end()) {
+        throw std::invalid_argument(std::string(who) + ": empty footprint");
+    }
+    return weights;
+}
+
+// Change of a pixel's weight when the window centre moves by one pixel:
+// the pixel at offset (dy, dx) from the old centre gains `delta`
+struct MedianWeightStep {
+    int dy, dx;
+    int delta;
+};
+
+// Non-zero weight changes for a move of the centre by (sy, sx), each of
+// -1, 0 or 1. For a box or any other footprint these are the entering and
+// leaving pixels; a centre-weighted box adds the two centres. Decreases come
+// first, so a window's weight never exceeds the sum of the mask mid-step.
+inline std::vector<MedianWeightStep> median_weight_steps(const int *weights, int hy, int hx, int sy, int sx) {
+    auto weight = [&](int dy, int dx) {
+        if (dy < -hy || dy > hy || dx < -hx || dx > hx) return 0;
+        return weights[(dy + hy) * (2 * hx + 1) + (dx + hx)];
+    };
+    std::vector<MedianWeightStep> steps;
+    for (int dy = -hy - 1; dy <= hy + 1; dy++) {
+        for (int dx = -hx - 1; dx <= hx + 1; dx++) {
+            int delta = weight(dy - sy, dx - sx) - weight(dy, dx);
+            if (delta != 0) steps.push_back({dy, dx, delta});
+        }
+    }
+    std::stable_partition(steps.begin(), steps.end(), [](const MedianWeightStep &s) { return s.delta < 0; });
+    return steps;
+}
+
+// Output pixels [y0, y1) x [x0, x1) in image coordinates, inside the ROI
+typedef MedianRect MedianTile;
+
+// Output element of image pixel (y, x); `output` points at the ROI origin
+template <typename T>
+inline T *median_output_at(T *output, const MedianGeometry &g, int y, int x) {
+    return output + ptrdiff_t(y - g.roi.y0) * g.outStride + (x - g.roi.x0);
+}
+
+// Split [begin, end) into pieces of `size` (the last may be shorter)
+inline std::vector<std::pair<int, int>> median_split(int begin, int end, int size) {
+    std::vector<std::pair<int, int>> pieces;
+    for (int i = begin; i < end; i += size) pieces.push_back({i, std::min(i + size, end)});
+    return pieces;
+}
+
+// Per-thread working memory of an engine, reused across tiles and frames
+struct MedianScratch {
+    virtual ~MedianScratch() = default;
+};
+
+template <typename T>
+struct MedianTileEngine {
+    // Split the ROI into tiles for `threads` workers
+    std::vector<MedianTile> (*tiles)(const MedianGeometry &g, int threads);
+    // Scratch sized for the largest of `tiles` (may be null)
+    std::unique_ptr<MedianScratch> (*scratch)(const MedianGeometry &g, const std::vector<MedianTile> &tiles);
+    void (*run)(MedianScratch *scratch, const T *input, T *output, const MedianGeometry &g, const MedianTile &tile);
+};
+
+extern const MedianTileEngine<float> median_tiles_v3;
+#ifdef HAVE_MFV4
+extern const MedianTileEngine<float> median_tiles_v4;
+#endif
+extern const MedianTileEngine<uint8_t> median_tiles_v5;
+extern const MedianTileEngine<uint16_t> median_tiles_v6;
+
+// Tile engine of a registered engine, or null if it has none (v1, v2, OpenCV)
+template <typename T>
+const MedianTileEngine<T> *median_tile_engine(MedianEngine engine);
+
+template <>
+inline const MedianTileEngine<float> *median_tile_engine<float>(MedianEngine engine) {
+    switch (engine) {
+        case MedianEngine::V3: return &median_tiles_v3;
+#ifdef HAVE_MFV4
+        case MedianEngine::V4: return &median_tiles_v4;
+#endif
+        default: return nullptr;
+    }
+}
+
+template <>
+inline const MedianTileEngine<uint8_t> *median_tile_engine<uint8_t>(MedianEngine engine) {
+    return engine == MedianEngine::V5 ? &median_tiles_v5 : nullptr;
+}
+
+template <>
+inline const MedianTileEngine<uint16_t> *median_tile_engine<uint16_t>(MedianEngine engine) {
+    return engine == MedianEngine::V6 ? &median_tiles_v6 : nullptr;
+}
+
+// True if `engine` is registered for dtype and handles this kernel shape
+bool median_filter_supports(MedianDType dtype, MedianEngine engine, int hy, int hx);
+
+// Number of worker threads a parallel loop uses by default
+int median_max_threads();
+
+// Worker threads of a call: its budget, else one per CPU of its set, else
+// the default
+inline int median_threads(int threads, const MedianCpuSet &cpus) {
+    if (threads > 0) return threads;
+    if (cpus.any()) return int(cpus.count());
+    return median_max_threads();
+}
+
+inline int median_threads(const MedianGeometry &g) {
+    return median_threads(g.threads, g.cpus);
+}
+
+// Bookkeeping of a parallel loop, kept by a caller that runs loops of up to
+// `threads` workers one after another (MedianPlan), so that
+// median_parallel_for allocates nothing per call. Holds one loop at a time.
+class MedianLoopState {
+public:
+    explicit MedianLoopState(int threads);
+    ~MedianLoopState();
+
+    MedianLoopState(const MedianLoopState &) = delete;
+    MedianLoopState &operator=(const MedianLoopState &) = delete;
+
+    struct Impl;
+    Impl *impl;
+};
+
+// Call body(ctx, index, thread) for index in [0, count) on up to `threads`
+// workers, pinned to `cpus` unless it is empty; thread is in [0, threads)
+// and identifies the scratch slot of the calling worker. If a body throws,
+// indices not yet started are skipped and the first exception is rethrown
+// once the running ones have finished. `state` (optional) is reused for the
+// loop's bookkeeping.
+void median_parallel_for(int count, int threads, const MedianCpuSet &cpus,
+                         void (*body)(void *ctx, int index, int thread), void *ctx,
+                         MedianLoopState *state = nullptr);
+
+template <typename F>
+inline void median_parallel_for(int count, int threads, const MedianCpuSet &cpus, MedianLoopState *state, F &&f) {
+    using Body = typename std::remove_reference<F>::type;
+    median_parallel_for(count, threads, cpus, [](void *ctx, int index, int thread) {
+        (*static_cast<Body *>(ctx))(index, thread);
+    }, &f, state);
+}
+
+template <typename F>
+inline void median_parallel_for(int count, int threads, const MedianCpuSet &cpus, F &&f) {
+    median_parallel_for(count, threads, cpus, nullptr, std::forward<F>(f));
+}
+
+// Loop over the workers of a call
+template <typename F>
+inline void median_parallel_for(int count, const MedianGeometry &g, F &&f) {
+    median_parallel_for(count, median_threads(g), g.cpus, std::forward<F>(f));
+}
+
+// Run `job` on one of the library's job workers, which exist for the
+// asynchronous entry points; the job's tiles still go through
+// median_parallel_for. Jobs must not throw.
+void median_submit_job(std::function<void()> job);
+
+// One-shot driver: split, allocate scratch lazily per thread and call
+// run(scratch, tile) for every tile. Entry points with parameters of their
+// own (masks, ranks, weights) pass their tile body here and share the
+// engine's tiles and scratch.
+template <typename T, typename Run>
+void median_filter_tiled(const MedianTileEngine<T> &engine, const MedianGeometry &g, Run &&run) {
+    int threads = median_threads(g);
+    std::vector<MedianTile> tiles = engine.tiles(g, threads);
+    std::vector<std::unique_ptr<MedianScratch>> scratch(threads);
+
+    median_parallel_for((int)tiles.size(), g, [&](int index, int thread) {
+        if (!scratch[thread]) scratch[thread] = engine.scratch(g, tiles);
+        run(scratch[thread].get(), tiles[index]);
+    });
+}
+
+template <typename T>
+void median_filter_tiled(const MedianTileEngine<T> &engine, const T *input, T *output, const MedianGeometry &g) {
+    median_filter_tiled(engine, g, [&](MedianScratch *scratch, const MedianTile &tile) {
+        engine.run(scratch, input, output, g, tile);
+    });
+}
+
+#endif
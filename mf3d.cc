@@ -0,0 +1,252 @@
+#include "median_filter_internal.h"
+
+#include <stdexcept>
+
+#ifdef __BMI2__
+#include <x86intrin.h>
+#endif
+
+// 3D median filter over dense nz x ny x nx volumes (x fastest).
+//
+// The volume is cut into bricks of output voxels, filtered in parallel, each
+// reading its halo straight from the input. Within a brick the window follows
+// a 3D snake: down and up the y columns, one x step at the end of each, and
+// one z step at the end of each slice before the slice is walked back, so
+// every move adds and removes one face of the window. The window is a rank
+// bit buffer over the sorted brick for float (as in v4) and a histogram of
+// the window slab for the integer types, so no window is rebuilt.
+
+namespace {
+
+struct Volume {
+    int nz, ny, nx;
+    int hz, hy, hx;
+};
+
+// Output voxels [z0, z1) x [y0, y1) x [x0, x1) and their clamped halo
+struct Brick {
+    int z0, z1, y0, y1, x0, x1;
+    int hz0, hz1, hy0, hy1, hx0, hx1;   // halo, inclusive
+
+    Brick(const Volume &v, int z0, int z1, int y0, int y1, int x0, int x1)
+        : z0(z0), z1(z1), y0(y0), y1(y1), x0(x0), x1(x1),
+          hz0(std::max(z0 - v.hz, 0)), hz1(std::min(z1 - 1 + v.hz, v.nz - 1)),
+          hy0(std::max(y0 - v.hy, 0)), hy1(std::min(y1 - 1 + v.hy, v.ny - 1)),
+          hx0(std::max(x0 - v.hx, 0)), hx1(std::min(x1 - 1 + v.hx, v.nx - 1)) {}
+
+    int sy() const { return hy1 - hy0 + 1; }
+    int sx() const { return hx1 - hx0 + 1; }
+
+    // Voxel of the halo, relative to its origin
+    size_t local(int z, int y, int x) const { return (size_t(z - hz0) * sy() + (y - hy0)) * sx() + (x - hx0); }
+};
+
+// Rank window (float): the brick's halo sorted once, the window a bit per rank
+struct RankWindow {
+    std::vector<std::pair<float, int>> sorted;
+    std::vector<int> ranks;
+    std::vector<uint64_t> buff;
+    int p = 0, below = 0, total = 0;    // words [0, p) hold `below` set bits
+
+    void begin(const float *input, const Volume &v, const Brick &b) {
+        sorted.clear();
+        for (int z = b.hz0; z <= b.hz1; z++) {
+            for (int y = b.hy0; y <= b.hy1; y++) {
+                const float *row = input + (size_t(z) * v.ny + y) * v.nx;
+                for (int x = b.hx0; x <= b.hx1; x++) sorted.push_back({row[x], int(b.local(z, y, x))});
+            }
+        }
+        std::sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &c) { return a.first < c.first; });
+        ranks.resize(sorted.size());
+        for (int i = 0; i < (int)sorted.size(); i++) ranks[sorted[i].second] = i;
+
+        int words = ((int)sorted.size() + 63) / 64;
+        buff.assign(words, 0);
+        p = words / 2;
+        below = total = 0;
+    }
+
+    inline void add(size_t local, float) {
+        int rank = ranks[local];
+        buff[rank >> 6] |= uint64_t(1) << (rank & 63);
+        below += (rank >> 6) < p;
+        total++;
+    }
+
+    inline void remove(size_t local, float) {
+        int rank = ranks[local];
+        buff[rank >> 6] &= ~(uint64_t(1) << (rank & 63));
+        below -= (rank >> 6) < p;
+        total--;
+    }
+
+    int search(int target) {
+        while (below > target) below -= __builtin_popcountll(buff[--p]);
+        while (below + __builtin_popcountll(buff[p]) <= target) below += __builtin_popcountll(buff[p++]);
+        int n = target - below;
+#ifdef __BMI2__
+        int bit = __builtin_ctzll(_pdep_u64(uint64_t(1) << n, buff[p]));
+#else
+        uint64_t bits = buff[p];
+        for (int i = 0; i < n; i++) bits &= bits - 1;
+        int bit = __builtin_ctzll(bits);
+#endif
+        return (p << 6) | bit;
+    }
+
+    float median() {
+        float a = sorted[search((total - 1) / 2)].first;
+        if (total % 2 == 1) return a;
+        return (a + sorted[search(total / 2)].first) / 2;
+    }
+};
+
+// Slab histogram (uint8, uint16): the window's keys counted in fine bins and
+// in coarse bins of 2^SHIFT fine ones, so a median scans at most
+// 2^(BITS - SHIFT) + 2^SHIFT bins
+template <typename T>
+struct HistogramWindow3D {
+    static constexpr int BITS = sizeof(T) * 8;
+    static constexpr int SHIFT = BITS / 2;  // fine bins per coarse bin: 2^SHIFT
+    std::vector<int> fine = std::vector<int>(size_t(1) << BITS, 0);
+    std::vector<int> coarse = std::vector<int>(size_t(1) << (BITS - SHIFT), 0);
+    int total = 0;
+
+    void begin(const T *, const Volume &, const Brick &) {
+        // Left empty by the previous brick's final removals
+    }
+
+    inline void add(size_t, T value) {
+        fine[value]++;
+        coarse[value >> SHIFT]++;
+        total++;
+    }
+
+    inline void remove(size_t, T value) {
+        fine[value]--;
+        coarse[value >> SHIFT]--;
+        total--;
+    }
+
+    int kth(int target) const {
+        int count = 0, c = 0;
+        while (count + coarse[c] <= target) count += coarse[c++];
+        int k = c << SHIFT;
+        while (count + fine[k] <= target) count += fine[k++];
+        return k;
+    }
+
+    T median() const {
+        int a = kth((total - 1) / 2);
+        if (total % 2 == 1) return T(a);
+        return T((a + kth(total / 2) + 1) / 2);
+    }
+};
+
+template <typename T, typename Window>
+void snake_brick(const T *input, T *output, const Volume &v, const Brick &b, Window &window) {
+    window.begin(input, v, b);
+
+    // Add (+1) or remove (-1) the voxels of [za, zb] x [ya, yb] x [xa, xb],
+    // clamped to the volume
+    auto box = [&](int za, int zb, int ya, int yb, int xa, int xb, int sign) {
+        za = std::max(za, 0); zb = std::min(zb, v.nz - 1);
+        ya = std::max(ya, 0); yb = std::min(yb, v.ny - 1);
+        xa = std::max(xa, 0); xb = std::min(xb, v.nx - 1);
+        for (int z = za; z <= zb; z++) {
+            for (int y = ya; y <= yb; y++) {
+                const T *row = input + (size_t(z) * v.ny + y) * v.nx;
+                size_t local = b.local(z, y, xa);
+                for (int x = xa; x <= xb; x++, local++) {
+                    if (sign > 0) window.add(local, row[x]); else window.remove(local, row[x]);
+                }
+            }
+        }
+    };
+
+    int z = b.z0, y = b.y0, x = b.x0, diry = 1, dirx = 1;
+    box(z - v.hz, z + v.hz, y - v.hy, y + v.hy, x - v.hx, x + v.hx, 1);
+
+    while (true) {
+        output[(size_t(z) * v.ny + y) * v.nx + x] = window.median();
+
+        if (diry > 0 ? y < b.y1 - 1 : y > b.y0) {
+            // Leaving face at y - diry * hy, entering face at y + diry * (hy + 1)
+            int out = y - diry * v.hy, in = y + diry * (v.hy + 1);
+            box(z - v.hz, z + v.hz, out, out, x - v.hx, x + v.hx, -1);
+            box(z - v.hz, z + v.hz, in, in, x - v.hx, x + v.hx, 1);
+            y += diry;
+        } else if (dirx > 0 ? x < b.x1 - 1 : x > b.x0) {
+            int out = x - dirx * v.hx, in = x + dirx * (v.hx + 1);
+            box(z - v.hz, z + v.hz, y - v.hy, y + v.hy, out, out, -1);
+            box(z - v.hz, z + v.hz, y - v.hy, y + v.hy, in, in, 1);
+            x += dirx;
+            diry = -diry;
+        } else if (z < b.z1 - 1) {
+            box(z - v.hz, z - v.hz, y - v.hy, y + v.hy, x - v.hx, x + v.hx, -1);
+            box(z + v.hz + 1, z + v.hz + 1, y - v.hy, y + v.hy, x - v.hx, x + v.hx, 1);
+            z++;
+            diry = -diry;
+            dirx = -dirx;
+        } else {
+            break;
+        }
+    }
+
+    // Leave the window empty for the next brick
+    box(z - v.hz, z + v.hz, y - v.hy, y + v.hy, x - v.hx, x + v.hx, -1);
+}
+
+// Bricks of about `edge` output voxels per side, at least two per thread
+std::vector<Brick> bricks(const Volume &v, int threads) {
+    int edge = 32;
+    auto count = [&](int e) {
+        return size_t((v.nz + e - 1) / e) * ((v.ny + e - 1) / e) * ((v.nx + e - 1) / e);
+    };
+    while (edge > 8 && count(edge) < size_t(2 * threads)) edge /= 2;
+
+    std::vector<Brick> result;
+    for (auto zs : median_split(0, v.nz, edge)) {
+        for (auto ys : median_split(0, v.ny, edge)) {
+            for (auto xs : median_split(0, v.nx, edge)) {
+                result.emplace_back(v, zs.first, zs.second, ys.first, ys.second, xs.first, xs.second);
+            }
+        }
+    }
+    return result;
+}
+
+template <typename T, typename Window>
+void filter3d(const T *input, T *output, int nz, int ny, int nx, int hz, int hy, int hx,
+              int budget, const MedianCpuSet &cpus) {
+    if (nz <= 0 || ny <= 0 || nx <= 0 || hz < 0 || hy < 0 || hx < 0) {
+        throw std::invalid_argument("median_filter3d: invalid volume or kernel size");
+    }
+
+    const Volume v{nz, ny, nx, hz, hy, hx};
+    const int threads = median_threads(budget, cpus);
+    const std::vector<Brick> work = bricks(v, threads);
+    std::vector<std::unique_ptr<Window>> windows(threads);
+
+    median_parallel_for((int)work.size(), threads, cpus, [&](int index, int thread) {
+        if (!windows[thread]) windows[thread] = std::make_unique<Window>();
+        snake_brick(input, output, v, work[index], *windows[thread]);
+    });
+}
+
+} // namespace
+
+void median_filter3d(const float *input, float *output, int nz, int ny, int nx, int hz, int hy, int hx,
+                     int threads, const MedianCpuSet &cpus) {
+    filter3d<float, RankWindow>(input, output, nz, ny, nx, hz, hy, hx, threads, cpus);
+}
+
+void median_filter3d(const uint8_t *input, uint8_t *output, int nz, int ny, int nx, int hz, int hy, int hx,
+                     int threads, const MedianCpuSet &cpus) {
+    filter3d<uint8_t, HistogramWindow3D<uint8_t>>(input, output, nz, ny, nx, hz, hy, hx, threads, cpus);
+}
+
+void median_filter3d(const uint16_t *input, uint16_t *output, int nz, int ny, int nx, int hz, int hy, int hx,
+                     int threads, const MedianCpuSet &cpus) {
+    filter3d<uint16_t, HistogramWindow3D<uint16_t>>(input, output, nz, ny, nx, hz, hy, hx, threads, cpus);
+}
@@ -0,0 +1,171 @@
+#include "median_filter_internal.h"
+
+#include <stdexcept>
+
+// Switching median: only impulses are filtered.
+//
+// A first pass flags a pixel as an impulse when fewer than two of its eight
+// neighbours lie within `threshold` of it. The test is a handful of
+// vectorized comparisons per pixel, tolerates a pair of touching impulses and
+// leaves one-pixel lines and edges, which always have two similar
+// neighbours, alone. A second pass replaces each flagged pixel by the median
+// of its window, gathered and selected on its own, and copies the others, so
+// the work follows the noise density rather than the image area. When so
+// many pixels are flagged that the full filter is cheaper, the dispatcher
+// filters the ROI and the clean pixels are copied back over it.
+
+namespace {
+
+constexpr int BAND = 16;    // ROI rows per parallel task
+
+// Neighbours within threshold of a pixel that make it clean
+constexpr int SIMILAR = 2;
+
+// |a - b| <= t, in int for the integer types so that rows vectorize
+template <typename T>
+inline bool similar(T a, T b, typename std::conditional<std::is_integral<T>::value, int, T>::type t) {
+    return std::is_integral<T>::value ? std::abs(int(a) - int(b)) <= t : std::abs(a - b) <= t;
+}
+
+// Flag the impulses of ROI row y into flags[x - roi.x0]; returns their count
+template <typename T, typename Threshold>
+int flag_row(const T *input, const MedianGeometry &g, int y, Threshold t, uint8_t *flags, uint8_t *count) {
+    const int x0 = g.roi.x0, x1 = g.roi.x1;
+    const T *row = input + ptrdiff_t(y) * g.inStride;
+    std::fill(count, count + (x1 - x0), 0);
+
+    for (int dy = -1; dy <= 1; dy++) {
+        if (y + dy < 0 || y + dy >= g.ny) continue;
+        const T *other = row + ptrdiff_t(dy) * g.inStride;
+        for (int dx = -1; dx <= 1; dx++) {
+            if (dy == 0 && dx == 0) continue;
+            // Columns whose neighbour (y + dy, x + dx) is inside the image
+            const int a = std::max(x0, -dx), b = std::min(x1, g.nx - dx);
+            for (int x = a; x < b; x++) count[x - x0] += similar(row[x], other[x + dx], t);
+        }
+    }
+
+    int flagged = 0;
+    for (int x = 0; x < x1 - x0; x++) {
+        flags[x] = count[x] < SIMILAR;
+        flagged += flags[x];
+    }
+    return flagged;
+}
+
+// Median of the window around (y, x) under the call's border, using
+// `pixels` as room for (2hy+1)(2hx+1) values
+template <typename T>
+T window_median(const T *input, const MedianGeometry &g, int y, int x, T *pixels) {
+    int n = 0;
+    if (g.border == MedianBorder::Shrink) {
+        const int ya = std::max(y - g.hy, 0), yb = std::min(y + g.hy, g.ny - 1);
+        const int xa = std::max(x - g.hx, 0), xb = std::min(x + g.hx, g.nx - 1);
+        for (int i = ya; i <= yb; i++) {
+            const T *row = input + ptrdiff_t(i) * g.inStride;
+            for (int j = xa; j <= xb; j++) pixels[n++] = row[j];
+        }
+    } else {
+        median_gather_padded(input, g, y, x, pixels);
+        n = (2 * g.hy + 1) * (2 * g.hx + 1);
+    }
+
+    T *mid = pixels + (n - 1) / 2;
+    std::nth_element(pixels, mid, pixels + n);
+    if (n % 2 == 1) return *mid;
+    const T hi = *std::min_element(mid + 1, pixels + n);
+    return std::is_floating_point<T>::value ? T((*mid + hi) / 2) : T((int(*mid) + int(hi) + 1) / 2);
+}
+
+template <typename T>
+size_t adaptive(const T *input, T *output, int ny, int nx, int hy, int hx, double threshold,
+                const MedianLayout &layout, const char *who) {
+    if (ny <= 0 || nx <= 0 || hy < 0 || hx < 0) throw std::invalid_argument(std::string(who) + ": invalid image or kernel size");
+    if (!(threshold >= 0.0)) throw std::invalid_argument(std::string(who) + ": threshold must be non-negative");
+
+    const MedianGeometry g = median_geometry(ny, nx, hy, hx, layout);
+    const int width = g.roi.x1 - g.roi.x0;
+    const int height = g.roi.y1 - g.roi.y0;
+    using Threshold = typename std::conditional<std::is_integral<T>::value, int, T>::type;
+    const Threshold t = std::is_integral<T>::value ? Threshold(std::min(threshold, 65536.0)) : Threshold(threshold);
+
+    // Pass 1: flags of the ROI
+    const std::vector<std::pair<int, int>> bands = median_split(g.roi.y0, g.roi.y1, BAND);
+    std::vector<uint8_t> flags(size_t(height) * width);
+    std::vector<size_t> flagged(bands.size(), 0);
+    const int threads = median_threads(g);
+    std::vector<std::vector<uint8_t>> counts(threads);
+    median_parallel_for((int)bands.size(), g, [&](int index, int thread) {
+        counts[thread].resize(width);
+        for (int y = bands[index].first; y < bands[index].second; y++) {
+            uint8_t *rowFlags = &flags[size_t(y - g.roi.y0) * width];
+            flagged[index] += flag_row(input, g, y, t, rowFlags, counts[thread].data());
+        }
+    });
+    size_t total = 0;
+    for (size_t f : flagged) total += f;
+
+    auto copyClean = [&](int y) {
+        const T *in = input + ptrdiff_t(y) * g.inStride;
+        T *out = median_output_at(output, g, y, g.roi.x0);
+        const uint8_t *rowFlags = &flags[size_t(y - g.roi.y0) * width];
+        for (int x = 0; x < width; x++) {
+            if (!rowFlags[x]) out[x] = in[g.roi.x0 + x];
+        }
+    };
+
+    // A selection costs about a window per flagged pixel; the full filters
+    // run at a small, kernel-independent cost per pixel
+    const double window = double(2 * hy + 1) * (2 * hx + 1);
+    if (double(total) * window > 8.0 * double(height) * width) {
+        median_filter(input, output, ny, nx, hy, hx, layout);
+        median_parallel_for((int)bands.size(), g, [&](int index, int) {
+            for (int y = bands[index].first; y < bands[index].second; y++) copyClean(y);
+        });
+        return total;
+    }
+
+    // Pass 2: medians of the flagged pixels
+    std::vector<std::vector<T>> pixels(threads);
+    median_parallel_for((int)bands.size(), g, [&](int index, int thread) {
+        pixels[thread].resize(size_t(window));
+        for (int y = bands[index].first; y < bands[index].second; y++) {
+            copyClean(y);
+            T *out = median_output_at(output, g, y, g.roi.x0);
+            const uint8_t *rowFlags = &flags[size_t(y - g.roi.y0) * width];
+            for (int x = 0; x < width; x++) {
+                if (rowFlags[x]) out[x] = window_median(input, g, y, g.roi.x0 + x, pixels[thread].data());
+            }
+        }
+    });
+    return total;
+}
+
+} // namespace
+
+size_t median_filter_adaptive(const float *input, float *output, int ny, int nx, int hy, int hx, double threshold) {
+    return median_filter_adaptive(input, output, ny, nx, hy, hx, threshold, median_dense_layout(ny, nx));
+}
+
+size_t median_filter_adaptive(const float *input, float *output, int ny, int nx, int hy, int hx, double threshold,
+                              const MedianLayout &layout) {
+    return adaptive(input, output, ny, nx, hy, hx, threshold, layout, "median_filter_adaptive");
+}
+
+size_t median_filter_adaptive(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx, double threshold) {
+    return median_filter_adaptive(input, output, ny, nx, hy, hx, threshold, median_dense_layout(ny, nx));
+}
+
+size_t median_filter_adaptive(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx, double threshold,
+                              const MedianLayout &layout) {
+    return adaptive(input, output, ny, nx, hy, hx, threshold, layout, "median_filter_adaptive");
+}
+
+size_t median_filter_adaptive(const uint16_t *input, uint16_t *output, int ny, int nx, int hy, int hx, double threshold) {
+    return median_filter_adaptive(input, output, ny, nx, hy, hx, threshold, median_dense_layout(ny, nx));
+}
+
+size_t median_filter_adaptive(const uint16_t *input, uint16_t *output, int ny, int nx, int hy, int hx, double threshold,
+                              const MedianLayout &layout) {
+    return adaptive(input, output, ny, nx, hy, hx, threshold, layout, "median_filter_adaptive");
+}
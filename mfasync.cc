@@ -0,0 +1,66 @@
+#include "median_filter_internal.h"
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+// Asynchronous entry points: each call becomes one job on the library's job
+// workers and runs the same dispatcher as median_filter().
+
+template <typename T>
+void median_filter_submit(const T *input, T *output, int ny, int nx, int hy, int hx, const MedianLayout &layout,
+                          MedianCallback done, MedianEngine engine) {
+    median_submit_job([=]() {
+        MedianEngine chosen = engine;
+        std::exception_ptr error;
+        try {
+            if (engine == MedianEngine::None) {
+                median_filter<T>(input, output, ny, nx, hy, hx, layout, &chosen);
+            } else if (!median_filter<T>(input, output, ny, nx, hy, hx, layout, engine)) {
+                throw std::invalid_argument(std::string("median_filter_submit: engine ") + median_engine_name(engine) +
+                                            " cannot filter " + median_dtype_name(MedianTraits<T>::dtype) +
+                                            " with this kernel");
+            }
+        } catch (...) {
+            error = std::current_exception();
+        }
+        done(chosen, error);
+    });
+}
+
+template <typename T>
+std::future<MedianEngine> median_filter_submit(const T *input, T *output, int ny, int nx, int hy, int hx,
+                                               const MedianLayout &layout, MedianEngine engine) {
+    auto promise = std::make_shared<std::promise<MedianEngine>>();
+    std::future<MedianEngine> future = promise->get_future();
+    median_filter_submit<T>(input, output, ny, nx, hy, hx, layout, [promise](MedianEngine chosen, std::exception_ptr error) {
+        if (error) {
+            promise->set_exception(error);
+        } else {
+            promise->set_value(chosen);
+        }
+    }, engine);
+    return future;
+}
+
+template <typename T>
+std::future<MedianEngine> median_filter_submit(const T *input, T *output, int ny, int nx, int hy, int hx,
+                                               MedianEngine engine) {
+    return median_filter_submit<T>(input, output, ny, nx, hy, hx, median_dense_layout(ny, nx), engine);
+}
+
+template std::future<MedianEngine> median_filter_submit<float>(const float *, float *, int, int, int, int, MedianEngine);
+template std::future<MedianEngine> median_filter_submit<uint8_t>(const uint8_t *, uint8_t *, int, int, int, int, MedianEngine);
+template std::future<MedianEngine> median_filter_submit<uint16_t>(const uint16_t *, uint16_t *, int, int, int, int, MedianEngine);
+template std::future<MedianEngine> median_filter_submit<float>(const float *, float *, int, int, int, int,
+                                                               const MedianLayout &, MedianEngine);
+template std::future<MedianEngine> median_filter_submit<uint8_t>(const uint8_t *, uint8_t *, int, int, int, int,
+                                                                 const MedianLayout &, MedianEngine);
+template std::future<MedianEngine> median_filter_submit<uint16_t>(const uint16_t *, uint16_t *, int, int, int, int,
+                                                                  const MedianLayout &, MedianEngine);
+template void median_filter_submit<float>(const float *, float *, int, int, int, int, const MedianLayout &,
+                                          MedianCallback, MedianEngine);
+template void median_filter_submit<uint8_t>(const uint8_t *, uint8_t *, int, int, int, int, const MedianLayout &,
+                                            MedianCallback, MedianEngine);
+template void median_filter_submit<uint16_t>(const uint16_t *, uint16_t *, int, int, int, int, const MedianLayout &,
+                                             MedianCallback, MedianEngine);
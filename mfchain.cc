@@ -0,0 +1,159 @@
+#include "median_filter_internal.h"
+
+#include <cstring>
+#include <stdexcept>
+
+// Pass chains: several medians applied in sequence, fused over row bands.
+//
+// The final output is produced a band of rows at a time. For each band, every
+// pass first computes the rows the passes after it will need, from the rows
+// of the pass before it, which were computed for the previous band and are
+// still in cache; pass k keeps only rows [lo, done) in a small buffer. An
+// engine call filters rows [y0, y1) of a pass as the ROI of a sub-image that
+// starts hy rows above it (or at the image border), so windows shrink
+// exactly where the full image's do; it runs on the chain's thread budget
+// and CPUs. Only the first pass reads with the caller's input stride and only
+// the last writes with its output stride.
+//
+// With untilStable, every pass records which rows it changed. A pass with
+// the same kernel as the one before it copies the rows whose whole window
+// the previous pass left unchanged: its input equals the previous pass's
+// input there, so its output does too. Repeating a kernel until the image is
+// stable thus only costs work where it still changes.
+
+namespace {
+
+template <typename T>
+struct ChainRows {
+    std::vector<T> rows;            // image rows [lo, done), nx each
+    int lo = 0, done = 0;
+    std::vector<uint8_t> changed;   // by image row (untilStable)
+};
+
+template <typename T>
+int chain(const T *input, T *output, int ny, int nx, const MedianPass *passes, int count, const MedianLayout &layout,
+          bool untilStable) {
+    if (ny <= 0 || nx <= 0 || count <= 0) throw std::invalid_argument("median_filter_chain: invalid image size or pass count");
+    for (int k = 0; k < count; k++) {
+        if (passes[k].hy < 0 || passes[k].hx < 0) throw std::invalid_argument("median_filter_chain: invalid kernel size");
+    }
+    const MedianRect &roi = layout.roi;
+    if (roi.y0 != 0 || roi.y1 != ny || roi.x0 != 0 || roi.x1 != nx || layout.inStride < nx || layout.outStride < nx) {
+        throw std::invalid_argument("median_filter_chain: layout must cover the whole image");
+    }
+    if (layout.border != MedianBorder::Shrink) {
+        throw std::invalid_argument("median_filter_chain: passes only use the Shrink border");
+    }
+
+    // tail[k]: rows below a final band that pass k must already have produced
+    std::vector<int> tail(count, 0);
+    for (int k = count - 2; k >= 0; k--) tail[k] = tail[k + 1] + passes[k + 1].hy;
+
+    // Bands of about 256 KB, and not thinner than the windows they feed
+    int band = int(std::max<size_t>((size_t(256) << 10) / (size_t(nx) * sizeof(T)), 16));
+    for (int k = 0; k < count; k++) band = std::max(band, 2 * passes[k].hy + 1);
+
+    std::vector<ChainRows<T>> state(count);
+    for (auto &s : state) {
+        if (untilStable) s.changed.assign(ny, 0);
+    }
+
+    // Row y of pass k's output, and of its input (pass k - 1, or the image)
+    auto row = [&](int k, int y) -> T * {
+        if (k == count - 1) return output + y * layout.outStride;
+        return &state[k].rows[size_t(y - state[k].lo) * nx];
+    };
+    auto source = [&](int k, int y) -> const T * {
+        return k == 0 ? input + y * layout.inStride : row(k - 1, y);
+    };
+
+    // Filter rows [y0, y1) of pass k into its output
+    auto filter = [&](int k, int y0, int y1) {
+        const int hy = passes[k].hy, hx = passes[k].hx;
+        const int s0 = std::max(y0 - hy, 0), s1 = std::min(y1 + hy, ny);
+        MedianLayout band{k == 0 ? layout.inStride : nx, k == count - 1 ? layout.outStride : nx,
+                          MedianRect{y0 - s0, y1 - s0, 0, nx}};
+        band.threads = layout.threads;
+        band.cpus = layout.cpus;
+        median_filter(source(k, s0), row(k, y0), s1 - s0, nx, hy, hx, band);
+        if (untilStable) {
+            for (int y = y0; y < y1; y++) {
+                state[k].changed[y] = std::memcmp(row(k, y), source(k, y), sizeof(T) * nx) != 0;
+            }
+        }
+    };
+
+    // Rows [y0, y1) of pass k: copied where the previous pass with the same
+    // kernel left the whole window unchanged, filtered in runs elsewhere
+    auto produce = [&](int k, int y0, int y1) {
+        const bool same = untilStable && k > 0 && passes[k].hy == passes[k - 1].hy && passes[k].hx == passes[k - 1].hx;
+        if (!same) {
+            filter(k, y0, y1);
+            return;
+        }
+        const int hy = passes[k].hy;
+        const std::vector<uint8_t> &before = state[k - 1].changed;
+        int run = y0;
+        for (int y = y0; y < y1; y++) {
+            bool stable = true;
+            for (int r = std::max(y - hy, 0); r <= std::min(y + hy, ny - 1) && stable; r++) stable = !before[r];
+            if (!stable) continue;
+            if (run < y) filter(k, run, y);
+            std::memcpy(row(k, y), source(k, y), sizeof(T) * nx);
+            state[k].changed[y] = 0;
+            run = y + 1;
+        }
+        if (run < y1) filter(k, run, y1);
+    };
+
+    for (int b = band; b - band < ny; b += band) {
+        for (int k = 0; k < count; k++) {
+            ChainRows<T> &s = state[k];
+            const int end = std::min(b + tail[k], ny);
+            if (end <= s.done) continue;
+            if (k < count - 1) s.rows.resize(size_t(end - s.lo) * nx);
+            produce(k, s.done, end);
+            s.done = end;
+        }
+
+        // Drop the rows no later pass will read again
+        for (int k = 0; k < count - 1; k++) {
+            ChainRows<T> &s = state[k];
+            const int keep = std::max(state[k + 1].done - passes[k + 1].hy, 0);
+            if (keep <= s.lo) continue;
+            std::memmove(s.rows.data(), &s.rows[size_t(keep - s.lo) * nx], sizeof(T) * size_t(s.done - keep) * nx);
+            s.lo = keep;
+            s.rows.resize(size_t(s.done - s.lo) * nx);
+        }
+    }
+
+    if (!untilStable) return count;
+    int changing = 0;
+    for (int k = 0; k < count; k++) {
+        if (std::find(state[k].changed.begin(), state[k].changed.end(), 1) != state[k].changed.end()) changing = k + 1;
+    }
+    return changing;
+}
+
+} // namespace
+
+template <typename T>
+int median_filter_chain(const T *input, T *output, int ny, int nx, const MedianPass *passes, int count,
+                        const MedianLayout &layout, bool untilStable) {
+    return chain(input, output, ny, nx, passes, count, layout, untilStable);
+}
+
+template <typename T>
+int median_filter_chain(const T *input, T *output, int ny, int nx, const MedianPass *passes, int count, bool untilStable) {
+    return chain(input, output, ny, nx, passes, count, median_dense_layout(ny, nx), untilStable);
+}
+
+template int median_filter_chain<float>(const float *, float *, int, int, const MedianPass *, int, bool);
+template int median_filter_chain<uint8_t>(const uint8_t *, uint8_t *, int, int, const MedianPass *, int, bool);
+template int median_filter_chain<uint16_t>(const uint16_t *, uint16_t *, int, int, const MedianPass *, int, bool);
+template int median_filter_chain<float>(const float *, float *, int, int, const MedianPass *, int, const MedianLayout &,
+                                        bool);
+template int median_filter_chain<uint8_t>(const uint8_t *, uint8_t *, int, int, const MedianPass *, int,
+                                          const MedianLayout &, bool);
+template int median_filter_chain<uint16_t>(const uint16_t *, uint16_t *, int, int, const MedianPass *, int,
+                                           const MedianLayout &, bool);
@@ -0,0 +1,319 @@
+#include "median_filter_internal.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+// Algorithm dispatcher: a cost model built from per-engine timings picks the
+// fastest registered engine for each (dtype, image size, kernel size).
+
+namespace {
+
+template <typename T>
+using MedianFunc = void (*)(const T *input, T *output, int ny, int nx, int hy, int hx, const MedianLayout &layout);
+
+template <typename T>
+struct EngineEntry {
+    MedianEngine engine;
+    MedianFunc<T> func;
+    bool automatic;     // may be picked by the cost model (exact, shrinking borders)
+    bool squareOnly;    // only handles hy == hx
+    bool lineOnly;      // only handles hy == 0 or hx == 0, and is picked for those
+};
+
+// Registered engines per data type
+const EngineEntry<float> float_engines[] = {
+    {MedianEngine::V1, median_filterv1, false, false, false},
+    {MedianEngine::V2, median_filterv2, true, false, false},
+    {MedianEngine::V3, median_filterv3, true, false, false},
+#ifdef HAVE_MFV4
+    {MedianEngine::V4, median_filterv4, true, false, false},
+#endif
+    {MedianEngine::V7, median_filterv7, false, false, true},
+#ifdef HAVE_OPENCV
+    // Converts to uint8 and replicates borders: explicit use only
+    {MedianEngine::OpenCV, median_filter_opencv_float, false, true, false},
+#endif
+};
+
+const EngineEntry<uint8_t> uint8_engines[] = {
+    {MedianEngine::V5, median_filterv5, true, false, false},
+    {MedianEngine::V7, median_filterv7, false, false, true},
+#ifdef HAVE_OPENCV
+    // Replicates borders instead of shrinking the window: explicit use only
+    {MedianEngine::OpenCV, median_filter_opencv_uint8, false, true, false},
+#endif
+};
+
+const EngineEntry<uint16_t> uint16_engines[] = {
+    {MedianEngine::V6, median_filterv6, true, false, false},
+    {MedianEngine::V7, median_filterv7, false, false, true},
+};
+
+template <typename T> struct Registry;
+template <> struct Registry<float> {
+    static const EngineEntry<float> *begin() { return std::begin(float_engines); }
+    static const EngineEntry<float> *end() { return std::end(float_engines); }
+};
+template <> struct Registry<uint8_t> {
+    static const EngineEntry<uint8_t> *begin() { return std::begin(uint8_engines); }
+    static const EngineEntry<uint8_t> *end() { return std::end(uint8_engines); }
+};
+template <> struct Registry<uint16_t> {
+    static const EngineEntry<uint16_t> *begin() { return std::begin(uint16_engines); }
+    static const EngineEntry<uint16_t> *end() { return std::end(uint16_engines); }
+};
+
+// One timing sample of the crossover table
+struct CostSample {
+    MedianDType dtype;
+    MedianEngine engine;
+    long pixels;
+    int window;             // (2hy+1)(2hx+1)
+    double nsPerPixel;
+};
+
+// Default crossover table, measured with `./timing --calibrate` on a single
+// core x86_64 machine. Replace at run time with median_filter_load_table().
+const CostSample default_table[] = {
+#include "median_dispatch.inc"
+};
+
+std::mutex table_mutex;
+std::vector<CostSample> table;
+bool table_loaded = false;
+
+bool parse_dtype(const std::string &name, MedianDType &dtype) {
+    for (MedianDType d : {MedianDType::Float, MedianDType::Uint8, MedianDType::Uint16}) {
+        if (name == median_dtype_name(d)) { dtype = d; return true; }
+    }
+    return false;
+}
+
+bool parse_engine(const std::string &name, MedianEngine &engine) {
+    for (MedianEngine e : {MedianEngine::V1, MedianEngine::V2, MedianEngine::V3, MedianEngine::V4,
+                           MedianEngine::V5, MedianEngine::V6, MedianEngine::V7, MedianEngine::OpenCV}) {
+        if (name == median_engine_name(e)) { engine = e; return true; }
+    }
+    return false;
+}
+
+bool read_table(const char *path, std::vector<CostSample> &samples) {
+    std::ifstream file(path);
+    if (!file.is_open()) return false;
+
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#' || line.compare(0, 5, "dtype") == 0) continue;
+
+        std::istringstream row(line);
+        std::string dtype, engine, pixels, window, ns;
+        if (!std::getline(row, dtype, ',') || !std::getline(row, engine, ',') ||
+            !std::getline(row, pixels, ',') || !std::getline(row, window, ',') ||
+            !std::getline(row, ns)) return false;
+
+        CostSample sample;
+        if (!parse_dtype(dtype, sample.dtype) || !parse_engine(engine, sample.engine)) return false;
+        sample.pixels = std::atol(pixels.c_str());
+        sample.window = std::atoi(window.c_str());
+        sample.nsPerPixel = std::atof(ns.c_str());
+        samples.push_back(sample);
+    }
+    return !samples.empty();
+}
+
+// Must be called with table_mutex held
+void ensure_table() {
+    if (table_loaded) return;
+    table_loaded = true;
+
+    const char *path = std::getenv("MEDIAN_FILTER_TABLE");
+    if (path && read_table(path, table)) return;
+    table.assign(std::begin(default_table), std::end(default_table));
+}
+
+// Predicted run time in ns, or infinity when the table has no data. The
+// image-size class closest in log(pixels) is used, and the per-pixel cost is
+// interpolated linearly in the window size (extrapolated past the ends).
+double predict(const std::vector<CostSample> &samples, MedianDType dtype, MedianEngine engine,
+               long pixels, int window) {
+
+    long best_class = -1;
+    double best_distance = std::numeric_limits<double>::infinity();
+    for (const CostSample &s : samples) {
+        if (s.dtype != dtype || s.engine != engine) continue;
+        double distance = std::fabs(std::log(double(s.pixels)) - std::log(double(pixels)));
+        if (distance < best_distance) { best_distance = distance; best_class = s.pixels; }
+    }
+    if (best_class < 0) return std::numeric_limits<double>::infinity();
+
+    std::vector<std::pair<int, double>> points;
+    for (const CostSample &s : samples) {
+        if (s.dtype == dtype && s.engine == engine && s.pixels == best_class) points.push_back({s.window, s.nsPerPixel});
+    }
+    std::sort(points.begin(), points.end());
+
+    double ns = points[0].second;
+    if (points.size() > 1) {
+        size_t i = 1;
+        while (i + 1 < points.size() && points[i].first < window) i++;
+        const auto &a = points[i - 1];
+        const auto &b = points[i];
+        double t = double(window - a.first) / double(b.first - a.first);
+        if (window < a.first) t = 0.0;
+        ns = std::max(a.second + t * (b.second - a.second), 0.0);
+    }
+    return ns * double(pixels);
+}
+
+template <typename T>
+const EngineEntry<T> *find_engine(MedianEngine engine, int hy, int hx) {
+    for (const auto *e = Registry<T>::begin(); e != Registry<T>::end(); ++e) {
+        if (e->engine == engine && (!e->squareOnly || hy == hx) && (!e->lineOnly || hy == 0 || hx == 0)) return e;
+    }
+    return nullptr;
+}
+
+template <typename T>
+MedianEngine select_engine(int ny, int nx, int hy, int hx) {
+    MedianDType dtype = MedianTraits<T>::dtype;
+    long pixels = long(ny) * long(nx);
+    int window = (2 * hy + 1) * (2 * hx + 1);
+
+    MedianEngine best = MedianEngine::None;
+    MedianEngine fallback = MedianEngine::None;
+    double best_cost = std::numeric_limits<double>::infinity();
+
+    // 1D kernels go to the 1D engine ahead of the cost model
+    if (hy == 0 || hx == 0) {
+        for (const auto *e = Registry<T>::begin(); e != Registry<T>::end(); ++e) {
+            if (e->lineOnly) return e->engine;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(table_mutex);
+    ensure_table();
+
+    for (const auto *e = Registry<T>::begin(); e != Registry<T>::end(); ++e) {
+        if (!e->automatic || (e->squareOnly && hy != hx)) continue;
+        fallback = e->engine;   // last registered engine is the default
+        double cost = predict(table, dtype, e->engine, pixels, window);
+        if (cost < best_cost) { best_cost = cost; best = e->engine; }
+    }
+    return best != MedianEngine::None ? best : fallback;
+}
+
+} // namespace
+
+const char *median_engine_name(MedianEngine engine) {
+    switch (engine) {
+        case MedianEngine::None: return "none";
+        case MedianEngine::V1: return "v1";
+        case MedianEngine::V2: return "v2";
+        case MedianEngine::V3: return "v3";
+        case MedianEngine::V4: return "v4";
+        case MedianEngine::V5: return "v5";
+        case MedianEngine::V6: return "v6";
+        case MedianEngine::V7: return "v7";
+        case MedianEngine::OpenCV: return "opencv";
+    }
+    return "none";
+}
+
+const char *median_dtype_name(MedianDType dtype) {
+    switch (dtype) {
+        case MedianDType::Float: return "float";
+        case MedianDType::Uint8: return "uint8";
+        case MedianDType::Uint16: return "uint16";
+    }
+    return "float";
+}
+
+std::vector<MedianEngine> median_filter_engines(MedianDType dtype) {
+    std::vector<MedianEngine> engines;
+    auto collect = [&](auto begin, auto end) {
+        for (auto e = begin; e != end; ++e) {
+            if (e->automatic) engines.push_back(e->engine);
+        }
+    };
+    switch (dtype) {
+        case MedianDType::Float: collect(Registry<float>::begin(), Registry<float>::end()); break;
+        case MedianDType::Uint8: collect(Registry<uint8_t>::begin(), Registry<uint8_t>::end()); break;
+        case MedianDType::Uint16: collect(Registry<uint16_t>::begin(), Registry<uint16_t>::end()); break;
+    }
+    return engines;
+}
+
+MedianEngine median_filter_select(MedianDType dtype, int ny, int nx, int hy, int hx) {
+    switch (dtype) {
+        case MedianDType::Float: return select_engine<float>(ny, nx, hy, hx);
+        case MedianDType::Uint8: return select_engine<uint8_t>(ny, nx, hy, hx);
+        case MedianDType::Uint16: return select_engine<uint16_t>(ny, nx, hy, hx);
+    }
+    return MedianEngine::None;
+}
+
+bool median_filter_supports(MedianDType dtype, MedianEngine engine, int hy, int hx) {
+    switch (dtype) {
+        case MedianDType::Float: return find_engine<float>(engine, hy, hx) != nullptr;
+        case MedianDType::Uint8: return find_engine<uint8_t>(engine, hy, hx) != nullptr;
+        case MedianDType::Uint16: return find_engine<uint16_t>(engine, hy, hx) != nullptr;
+    }
+    return false;
+}
+
+template <typename T>
+void median_filter(const T *input, T *output, int ny, int nx, int hy, int hx, const MedianLayout &layout,
+                   MedianEngine *chosen) {
+    const MedianRect &roi = layout.roi;
+    MedianEngine engine = select_engine<T>(roi.y1 - roi.y0, roi.x1 - roi.x0, hy, hx);
+    find_engine<T>(engine, hy, hx)->func(input, output, ny, nx, hy, hx, layout);
+    if (chosen) *chosen = engine;
+}
+
+template <typename T>
+bool median_filter(const T *input, T *output, int ny, int nx, int hy, int hx, const MedianLayout &layout,
+                   MedianEngine engine) {
+    const EngineEntry<T> *e = find_engine<T>(engine, hy, hx);
+    if (!e) return false;
+    e->func(input, output, ny, nx, hy, hx, layout);
+    return true;
+}
+
+template <typename T>
+void median_filter(const T *input, T *output, int ny, int nx, int hy, int hx, MedianEngine *chosen) {
+    median_filter(input, output, ny, nx, hy, hx, median_dense_layout(ny, nx), chosen);
+}
+
+template <typename T>
+bool median_filter(const T *input, T *output, int ny, int nx, int hy, int hx, MedianEngine engine) {
+    return median_filter(input, output, ny, nx, hy, hx, median_dense_layout(ny, nx), engine);
+}
+
+template void median_filter<float>(const float *, float *, int, int, int, int, MedianEngine *);
+template void median_filter<uint8_t>(const uint8_t *, uint8_t *, int, int, int, int, MedianEngine *);
+template void median_filter<uint16_t>(const uint16_t *, uint16_t *, int, int, int, int, MedianEngine *);
+template bool median_filter<float>(const float *, float *, int, int, int, int, MedianEngine);
+template bool median_filter<uint8_t>(const uint8_t *, uint8_t *, int, int, int, int, MedianEngine);
+template bool median_filter<uint16_t>(const uint16_t *, uint16_t *, int, int, int, int, MedianEngine);
+template void median_filter<float>(const float *, float *, int, int, int, int, const MedianLayout &, MedianEngine *);
+template void median_filter<uint8_t>(const uint8_t *, uint8_t *, int, int, int, int, const MedianLayout &, MedianEngine *);
+template void median_filter<uint16_t>(const uint16_t *, uint16_t *, int, int, int, int, const MedianLayout &, MedianEngine *);
+template bool median_filter<float>(const float *, float *, int, int, int, int, const MedianLayout &, MedianEngine);
+template bool median_filter<uint8_t>(const uint8_t *, uint8_t *, int, int, int, int, const MedianLayout &, MedianEngine);
+template bool median_filter<uint16_t>(const uint16_t *, uint16_t *, int, int, int, int, const MedianLayout &, MedianEngine);
+
+bool median_filter_load_table(const char *path) {
+    std::vector<CostSample> samples;
+    if (!read_table(path, samples)) return false;
+
+    std::lock_guard<std::mutex> lock(table_mutex);
+    table = std::move(samples);
+    table_loaded = true;
+    return true;
+}
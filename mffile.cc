@@ -0,0 +1,162 @@
+#include "median_filter_internal.h"
+
+#include <cerrno>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Out-of-core driver: both files are memory-mapped and the image is filtered
+// in bands of output rows. Each band is a ROI call on the mapped input, so
+// its halo rows come straight from the file. The next band's input is
+// prefetched with MADV_WILLNEED before the current band is filtered, and
+// pages behind the band are released so that the resident set stays within
+// the memory budget.
+
+namespace {
+
+[[noreturn]] void throw_errno(const std::string &what, const char *path) {
+    throw std::system_error(errno, std::generic_category(), "median_filter_file: " + what + " " + path);
+}
+
+// File descriptor and mapping, released on scope exit
+struct MappedFile {
+    int fd = -1;
+    void *data = MAP_FAILED;
+    size_t size = 0;
+
+    ~MappedFile() {
+        if (data != MAP_FAILED) munmap(data, size);
+        if (fd >= 0) close(fd);
+    }
+};
+
+void map_input(MappedFile &file, const char *path, size_t size) {
+    file.fd = open(path, O_RDONLY);
+    if (file.fd < 0) throw_errno("cannot open", path);
+
+    struct stat st;
+    if (fstat(file.fd, &st) != 0) throw_errno("cannot stat", path);
+    if (size_t(st.st_size) < size) {
+        throw std::invalid_argument("median_filter_file: " + std::string(path) + " is smaller than ny * nx pixels");
+    }
+
+    file.size = size;
+    file.data = mmap(nullptr, size, PROT_READ, MAP_SHARED, file.fd, 0);
+    if (file.data == MAP_FAILED) throw_errno("cannot map", path);
+    madvise(file.data, size, MADV_SEQUENTIAL);
+}
+
+// Opening the output truncates it, so it must not be the mapped input under
+// another (or the same) name
+void check_distinct(const MappedFile &input, const char *inputPath, const char *outputPath) {
+    struct stat in, out;
+    if (fstat(input.fd, &in) != 0) throw_errno("cannot stat", inputPath);
+    if (stat(outputPath, &out) != 0) {
+        if (errno == ENOENT) return;
+        throw_errno("cannot stat", outputPath);
+    }
+    if (in.st_dev == out.st_dev && in.st_ino == out.st_ino) {
+        throw std::invalid_argument("median_filter_file: output " + std::string(outputPath) + " is the input file " +
+                                    inputPath);
+    }
+}
+
+void map_output(MappedFile &file, const char *path, size_t size) {
+    file.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (file.fd < 0) throw_errno("cannot create", path);
+    if (ftruncate(file.fd, off_t(size)) != 0) throw_errno("cannot resize", path);
+
+    file.size = size;
+    file.data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file.fd, 0);
+    if (file.data == MAP_FAILED) throw_errno("cannot map", path);
+}
+
+size_t page_size() {
+    static const size_t page = size_t(sysconf(_SC_PAGESIZE));
+    return page;
+}
+
+// madvise() on bytes [begin, end) of a mapping: prefetches cover every page
+// touching the range, releases only the pages fully inside it
+void advise(const MappedFile &file, size_t begin, size_t end, int advice) {
+    const size_t page = page_size();
+    end = std::min(end, file.size);
+    if (advice == MADV_DONTNEED) {
+        begin = (begin + page - 1) / page * page;
+        end = end / page * page;
+    } else {
+        begin = begin / page * page;
+        end = (end + page - 1) / page * page;
+    }
+    if (begin < end) madvise(static_cast<char *>(file.data) + begin, end - begin, advice);
+}
+
+template <typename T>
+MedianEngine filter_file(const char *inputPath, const char *outputPath, int ny, int nx, int hy, int hx,
+                         const MedianFileOptions &options) {
+
+    const size_t rowBytes = size_t(nx) * sizeof(T);
+    const size_t size = size_t(ny) * rowBytes;
+
+    // A band of B output rows keeps B + 2hy input rows and B output rows resident
+    long long budgetRows = (long long)(options.memoryBudget / rowBytes);
+    int band = int(std::max(1LL, std::min((budgetRows - 2LL * hy) / 2, (long long)ny)));
+
+    MappedFile input, output;
+    map_input(input, inputPath, size);
+    check_distinct(input, inputPath, outputPath);
+    map_output(output, outputPath, size);
+
+    const T *in = static_cast<const T *>(input.data);
+    T *out = static_cast<T *>(output.data);
+    auto rows = [&](long long y) { return size_t(std::min(std::max(y, 0LL), (long long)ny)) * rowBytes; };
+
+    advise(input, 0, rows(band + hy), MADV_WILLNEED);
+
+    MedianEngine chosen = options.engine;
+    for (int y0 = 0; y0 < ny; y0 += band) {
+        const int y1 = std::min(y0 + band, ny);
+
+        // Start reading the next band's input while this one is filtered
+        if (y1 < ny) advise(input, rows(y1 + hy), rows(y1 + band + hy), MADV_WILLNEED);
+
+        MedianLayout layout{nx, nx, MedianRect{y0, y1, 0, nx}, options.border, options.borderValue, options.threads,
+                            options.cpus};
+        T *bandOutput = out + size_t(y0) * nx;
+        if (options.engine == MedianEngine::None) {
+            median_filter<T>(in, bandOutput, ny, nx, hy, hx, layout, &chosen);
+        } else if (!median_filter<T>(in, bandOutput, ny, nx, hy, hx, layout, options.engine)) {
+            throw std::invalid_argument(std::string("median_filter_file: engine ") + median_engine_name(options.engine) +
+                                        " cannot filter " + median_dtype_name(MedianTraits<T>::dtype) +
+                                        " with this kernel");
+        }
+
+        // Write back the finished rows and drop pages no later band reads
+        size_t first = rows(y0) / page_size() * page_size();
+        msync(static_cast<char *>(output.data) + first, rows(y1) - first, MS_ASYNC);
+        advise(output, 0, rows(y1), MADV_DONTNEED);
+        advise(input, 0, rows(y1 - hy), MADV_DONTNEED);
+    }
+
+    if (msync(output.data, size, MS_SYNC) != 0) throw_errno("cannot write", outputPath);
+    return chosen;
+}
+
+} // namespace
+
+MedianEngine median_filter_file(MedianDType dtype, const char *inputPath, const char *outputPath, int ny, int nx,
+                                int hy, int hx, const MedianFileOptions &options) {
+    if (ny <= 0 || nx <= 0 || hy < 0 || hx < 0) throw std::invalid_argument("median_filter_file: invalid image or kernel size");
+
+    switch (dtype) {
+        case MedianDType::Float: return filter_file<float>(inputPath, outputPath, ny, nx, hy, hx, options);
+        case MedianDType::Uint8: return filter_file<uint8_t>(inputPath, outputPath, ny, nx, hy, hx, options);
+        case MedianDType::Uint16: return filter_file<uint16_t>(inputPath, outputPath, ny, nx, hy, hx, options);
+    }
+    return MedianEngine::None;
+}
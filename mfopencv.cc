@@ -1,9 +1,38 @@
 #include <opencv2/opencv.hpp>
 #include <cstdint>
 
+#include "median_filter.h"
+
+// OpenCV filters whole images, so the layout variants filter the full input
+// and copy the ROI out of the result. medianBlur always replicates the border
+// (Shrink is approximated by it); the other padding modes are materialized
+// with copyMakeBorder first.
+
+// medianBlur with the layout's border mode
+static cv::Mat median_blur_bordered(const cv::Mat &inputMat, int kernelSize, const MedianLayout &layout) {
+    cv::Mat outputMat;
+    int borderType = -1;
+    switch (layout.border) {
+        case MedianBorder::Reflect: borderType = cv::BORDER_REFLECT; break;
+        case MedianBorder::Wrap: borderType = cv::BORDER_WRAP; break;
+        case MedianBorder::Constant: borderType = cv::BORDER_CONSTANT; break;
+        default: break;
+    }
+    if (borderType < 0) {
+        cv::medianBlur(inputMat, outputMat, kernelSize);
+        return outputMat;
+    }
+    
+    int h = kernelSize / 2;
+    cv::Mat paddedMat;
+    cv::copyMakeBorder(inputMat, paddedMat, h, h, h, h, borderType, cv::Scalar(layout.borderValue));
+    cv::medianBlur(paddedMat, outputMat, kernelSize);
+    return outputMat(cv::Rect(h, h, inputMat.cols, inputMat.rows));
+}
+
 // OpenCV median filter implementation for float data
 // Note: OpenCV's medianBlur only supports 8U format, so we convert float->uint8->float
-void median_filter_opencv_float(const float *input, float *output, int ny, int nx, int hy, int hx) {
+void median_filter_opencv_float(const float *input, float *output, int ny, int nx, int hy, int hx, const MedianLayout &layout) {
     // Convert float input to uint8 Mat (scale from [0,255] range)
     cv::Mat inputMat(ny, nx, CV_8UC1);
     
@@ -11,14 +40,13 @@ void median_filter_opencv_float(const float *input, float *output, int ny, int n
     for(int y = 0; y < ny; y++) {
         for(int x = 0; x < nx; x++) {
             // Clamp to [0, 255] range and convert to uint8
-            float val = input[y * nx + x];
+            float val = input[y * layout.inStride + x];
             val = std::max(0.0f, std::min(255.0f, val));
             inputMat.at<uint8_t>(y, x) = static_cast<uint8_t>(std::round(val));
         }
     }
     
     // Apply median filter
-    cv::Mat outputMat;
     int kernelSize = 2 * std::max(hx, hy) + 1;  // OpenCV uses square kernels
     
     // Ensure odd kernel size
@@ -26,30 +54,27 @@ void median_filter_opencv_float(const float *input, float *output, int ny, int n
         kernelSize++;
     }
     
-    cv::medianBlur(inputMat, outputMat, kernelSize);
+    cv::Mat outputMat = median_blur_bordered(inputMat, kernelSize, layout);
     
     // Copy result back to float array
-    for(int y = 0; y < ny; y++) {
-        for(int x = 0; x < nx; x++) {
-            output[y * nx + x] = static_cast<float>(outputMat.at<uint8_t>(y, x));
+    for(int y = layout.roi.y0; y < layout.roi.y1; y++) {
+        float *out = output + (y - layout.roi.y0) * layout.outStride;
+        for(int x = layout.roi.x0; x < layout.roi.x1; x++) {
+            out[x - layout.roi.x0] = static_cast<float>(outputMat.at<uint8_t>(y, x));
         }
     }
 }
 
+void median_filter_opencv_float(const float *input, float *output, int ny, int nx, int hy, int hx) {
+    median_filter_opencv_float(input, output, ny, nx, hy, hx, median_dense_layout(ny, nx));
+}
+
 // OpenCV median filter implementation for uint8_t data
-void median_filter_opencv_uint8(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx) {
-    // Convert flat array to OpenCV Mat
-    cv::Mat inputMat(ny, nx, CV_8UC1);
-    
-    // Copy data from flat array to Mat
-    for(int y = 0; y < ny; y++) {
-        for(int x = 0; x < nx; x++) {
-            inputMat.at<uint8_t>(y, x) = input[y * nx + x];
-        }
-    }
+void median_filter_opencv_uint8(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx, const MedianLayout &layout) {
+    // Wrap the strided input without copying
+    cv::Mat inputMat(ny, nx, CV_8UC1, const_cast<uint8_t *>(input), size_t(layout.inStride));
     
     // Apply median filter
-    cv::Mat outputMat;
     int kernelSize = 2 * std::max(hx, hy) + 1;  // OpenCV uses square kernels
     
     // Ensure odd kernel size
@@ -57,12 +82,17 @@ void median_filter_opencv_uint8(const uint8_t *input, uint8_t *output, int ny, i
         kernelSize++;
     }
     
-    cv::medianBlur(inputMat, outputMat, kernelSize);
+    cv::Mat outputMat = median_blur_bordered(inputMat, kernelSize, layout);
     
-    // Copy result back to flat array
-    for(int y = 0; y < ny; y++) {
-        for(int x = 0; x < nx; x++) {
-            output[y * nx + x] = outputMat.at<uint8_t>(y, x);
+    // Copy the ROI back to the strided output
+    for(int y = layout.roi.y0; y < layout.roi.y1; y++) {
+        uint8_t *out = output + (y - layout.roi.y0) * layout.outStride;
+        for(int x = layout.roi.x0; x < layout.roi.x1; x++) {
+            out[x - layout.roi.x0] = outputMat.at<uint8_t>(y, x);
         }
     }
 }
+
+void median_filter_opencv_uint8(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx) {
+    median_filter_opencv_uint8(input, output, ny, nx, hy, hx, median_dense_layout(ny, nx));
+}
@@ -0,0 +1,649 @@
+#include "median_filter_internal.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#ifdef MEDIAN_USE_OPENMP
+#include <omp.h>
+#endif
+
+// Parallel loop used by every tiled engine, and the job workers behind the
+// asynchronous entry points.
+//
+// By default loops run on persistent pools of workers with one deque of
+// tile ranges each, under a process-wide governor that bounds the tiles
+// running at once; workers favour the loop with the fewest running tiles,
+// so concurrent calls share them fairly, and the calling thread works
+// alongside them until its own loop's tiles are all taken. A tile that
+// throws cancels the tiles of its loop not yet started, and the caller
+// rethrows the first exception once the others have finished. Building with
+// -DMEDIAN_USE_OPENMP (make PARALLEL=openmp) uses an OpenMP parallel for per
+// loop instead.
+
+int median_max_threads() {
+    static const int threads = [] {
+        const char *env = std::getenv("MEDIAN_NUM_THREADS");
+        int n = env ? std::atoi(env) : 0;
+#ifdef MEDIAN_USE_OPENMP
+        return n > 0 ? n : omp_get_max_threads();
+#else
+        return n > 0 ? n : int(std::max(1u, std::thread::hardware_concurrency()));
+#endif
+    }();
+    return threads;
+}
+
+#ifdef MEDIAN_USE_OPENMP
+
+// CPU sets are not supported here: OpenMP places its own threads, and keeps
+// no state between loops
+struct MedianLoopState::Impl {};
+
+MedianLoopState::MedianLoopState(int) : impl(new Impl) {}
+
+void median_parallel_for(int count, int threads, const MedianCpuSet &,
+                         void (*body)(void *ctx, int index, int thread), void *ctx, MedianLoopState *) {
+    if (threads <= 0) threads = median_max_threads();
+
+    // Exceptions must not leave the parallel region: keep the first and
+    // rethrow it once the loop has finished
+    std::exception_ptr error;
+    #pragma omp parallel for schedule(dynamic) num_threads(threads)
+    for (int i = 0; i < count; i++) {
+        try {
+            body(ctx, i, omp_get_thread_num());
+        } catch (...) {
+            #pragma omp critical(median_parallel_for_error)
+            if (!error) error = std::current_exception();
+        }
+    }
+    if (error) std::rethrow_exception(error);
+}
+
+#else
+
+namespace {
+
+// Set while running a tile: nested loops run inline
+thread_local bool inTile = false;
+
+// Marks the calling thread as running a tile for its lifetime
+struct TileScope {
+    bool outer = inTile;
+    TileScope() { inTile = true; }
+    ~TileScope() { inTile = outer; }
+};
+
+// A thread that sleeps until work may have been queued for it, or until the
+// governor frees a tile it waits for. Flags are set and signalled under the mutex so
+// that a waiter on the caller's stack may return as soon as it sees them.
+struct Waiter {
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool woken = false;
+    bool freed = false;
+    Waiter *next = nullptr;         // behind it in the governor's queue
+
+    void wake() {
+        std::lock_guard<std::mutex> lock(mutex);
+        woken = true;
+        cv.notify_one();
+    }
+
+    void free() {
+        std::lock_guard<std::mutex> lock(mutex);
+        freed = true;
+        cv.notify_one();
+    }
+
+    // Returns at once if woken since the last call
+    void wait_work() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return woken; });
+        woken = false;
+    }
+
+    void wait_admission() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return freed; });
+        freed = false;
+    }
+};
+
+// Process-wide admission shared by every pool and caller: at most `limit`
+// tiles run at once, whichever threads run them. Admission is a counter;
+// threads that must wait for it queue up, and a released tile wakes the
+// oldest of them alone. The queue is linked through the waiters, so waiting
+// allocates nothing.
+struct Governor {
+    const int limit = median_max_threads();
+    std::atomic<int> running{0};
+    std::atomic<int> waiting{0};
+    std::mutex mutex;               // guards the queue
+    Waiter *head = nullptr;         // oldest first
+    Waiter *tail = nullptr;
+
+    bool try_acquire() {
+        int n = running.load(std::memory_order_relaxed);
+        while (n < limit) {
+            if (running.compare_exchange_weak(n, n + 1)) return true;
+        }
+        return false;
+    }
+
+    // A woken waiter competes for the freed tile again rather than being
+    // handed it, so a busy caller is not stalled behind a context switch;
+    // one that loses goes back to the front of the queue.
+    void acquire(Waiter &waiter) {
+        bool front = false;
+        while (!try_acquire()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                waiting++;
+                if (try_acquire()) {
+                    waiting--;
+                    return;
+                }
+                if (front) push_front(waiter);
+                else push_back(waiter);
+            }
+            waiter.wait_admission();
+            front = true;
+        }
+    }
+
+    void release() {
+        running--;
+        if (waiting == 0) return;
+        Waiter *next;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!head) return;
+            next = head;
+            head = next->next;
+            if (!head) tail = nullptr;
+            waiting--;
+        }
+        next->free();
+    }
+
+private:
+    void push_front(Waiter &waiter) {
+        waiter.next = head;
+        head = &waiter;
+        if (!tail) tail = &waiter;
+    }
+
+    void push_back(Waiter &waiter) {
+        waiter.next = nullptr;
+        if (tail) tail->next = &waiter;
+        else head = &waiter;
+        tail = &waiter;
+    }
+};
+
+Governor &governor() {
+    // Never destroyed, like the pools
+    static Governor *instance = new Governor;
+    return *instance;
+}
+
+// Releases an admitted tile on scope exit
+struct Admission {
+    ~Admission() { governor().release(); }
+};
+
+// One median_parallel_for call. A worker takes a free scratch slot for each
+// tile it runs, which also caps the loop at `threads` concurrent tiles; the
+// caller keeps its own slot for its own tiles. The caller waits on `done`
+// alone. A MedianLoopState keeps one for loop after loop, its vectors
+// keeping their capacity.
+struct Loop {
+    void (*body)(void *ctx, int index, int thread);
+    void *ctx;
+    const MedianCpuSet *cpus;       // pinned loops: the CPUs whose workers may run it
+    std::vector<int> workers;       // the workers its tiles were queued on
+    int callerSlot;                 // -1 if the caller does not help
+    std::atomic<int> running{0};    // tiles running, for fair picking
+    std::atomic<int> started{0};    // tiles taken off the deques so far
+    std::atomic<int> idleSlots{0};
+
+    std::mutex mutex;
+    std::condition_variable done;
+    std::vector<int> freeSlots;
+    int remaining = 0;              // tiles not finished
+    std::exception_ptr error;       // first exception a tile threw
+
+    int acquire_slot() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (freeSlots.empty()) return -1;
+        int slot = freeSlots.back();
+        freeSlots.pop_back();
+        idleSlots--;
+        return slot;
+    }
+
+    // Count `tiles` as finished; the caller may return once none remain, so
+    // nothing may touch the loop afterwards
+    void complete(int tiles, int slot = -1) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (slot >= 0 && slot != callerSlot) {
+            freeSlots.push_back(slot);
+            idleSlots++;
+        }
+        remaining -= tiles;
+        if (remaining == 0) done.notify_one();
+    }
+};
+
+// Tiles [begin, end) of a loop waiting in a worker's deque. The owner runs
+// them from the front, thieves from the back.
+struct Range {
+    Loop *loop;
+    int begin, end;
+};
+
+// A vector rather than a std::deque, which would allocate and free blocks
+// as ranges come and go; erasing shifts only the few ranges behind.
+struct Worker {
+    std::mutex mutex;
+    std::vector<Range> ranges;
+    std::atomic<int> queued{0};     // ranges in the deque
+    std::atomic<bool> idle{false};  // waiting for work
+    Waiter waiter;
+    std::once_flag started;
+    std::thread thread;
+};
+
+// Workers with one deque of tile ranges each, locked separately. A loop
+// queues one contiguous range per worker it spreads over and wakes an idle
+// worker; a worker runs tiles of the loop with the fewest running tiles
+// from its own deque, else steals one from another, and wakes another idle
+// worker while tiles remain. Tiles run without any lock held.
+//
+// There are two pools: the shared unpinned workers, and one worker pinned
+// to each CPU of the machine, started when a loop first names its CPU and
+// shared by every CPU set that includes it. A pinned worker only runs loops
+// whose set includes its CPU.
+class ThreadPool {
+public:
+    ThreadPool(int workers, bool pinned) : pinned(pinned) {
+        for (int w = 0; w < workers; w++) queues.emplace_back(new Worker);
+        if (!pinned) {
+            for (int w = 0; w < workers; w++) start(w);
+        }
+    }
+
+    int size() const { return int(queues.size()); }
+
+    // CPUs of a set that have a pinned worker
+    int cpus_in(const MedianCpuSet &cpus) const {
+        int n = 0;
+        for (int cpu = 0; cpu < size(); cpu++) n += cpus[cpu];
+        return n;
+    }
+
+    void run(Loop &loop, int count, int threads, const MedianCpuSet &cpus,
+             void (*body)(void *ctx, int index, int thread), void *ctx) {
+        // The caller helps unless the workers are pinned
+        const int firstSlot = pinned ? 0 : 1;
+        loop.body = body;
+        loop.ctx = ctx;
+        loop.cpus = pinned ? &cpus : nullptr;
+        loop.workers.clear();
+        loop.callerSlot = pinned ? -1 : 0;
+        loop.running = 0;
+        loop.started = 0;
+        loop.freeSlots.clear();
+        loop.remaining = count;
+        loop.error = nullptr;
+        for (int slot = threads - 1; slot >= firstSlot; slot--) loop.freeSlots.push_back(slot);
+        loop.idleSlots = int(loop.freeSlots.size());
+
+        // Concurrent loops start at different workers
+        const int candidates = pinned ? cpus_in(cpus) : size();
+        const int deques = std::min(std::max(threads - firstSlot, 1), candidates);
+        const int skip = int(next.fetch_add(unsigned(deques)) % unsigned(candidates));
+        for (int w = 0, seen = 0; w < 2 * size() && int(loop.workers.size()) < deques; w++) {
+            if (pinned && !cpus[w % size()]) continue;
+            if (seen++ >= skip) loop.workers.push_back(w % size());
+        }
+
+        for (int d = 0; d < deques; d++) {
+            Worker &q = worker(loop.workers[d]);
+            const int begin = int(int64_t(count) * d / deques), end = int(int64_t(count) * (d + 1) / deques);
+            if (pinned) start(loop.workers[d]);
+            if (begin == end) continue;
+            std::lock_guard<std::mutex> lock(q.mutex);
+            q.ranges.push_back({&loop, begin, end});
+            q.queued++;
+        }
+        pushes++;
+        wake_idle(loop.workers);
+
+        // The caller works like a worker while tiles of its own loop are
+        // queued and the governor admits it, taking the fairest tile it
+        // finds, which need not be its own
+        Governor &gov = governor();
+        while (loop.callerSlot >= 0 && loop.started < count && gov.try_acquire()) {
+            Loop *next;
+            int index, slot;
+            if (!take(loop.workers[0], next, index, slot, &loop)) {
+                gov.release();
+                break;
+            }
+            run_tile(*next, index, slot);
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(loop.mutex);
+            loop.done.wait(lock, [&] { return loop.remaining == 0; });
+        }
+        if (loop.error) std::rethrow_exception(loop.error);
+    }
+
+private:
+    Worker &worker(int w) { return *queues[w % size()]; }
+
+    void start(int w) {
+        Worker &q = worker(w);
+        std::call_once(q.started, [&] { q.thread = std::thread([this, w] { work(w); }); });
+    }
+
+    // Whether `a` should run before `b`: the loop with the fewest running
+    // tiles, then the one that has had the fewest so far
+    static bool fairer(const Loop &a, const Loop &b) {
+        const int ra = a.running, rb = b.running;
+        return ra < rb || (ra == rb && a.started < b.started);
+    }
+
+    // Whether worker w may run tiles of `loop`
+    bool serves(int w, const Loop &loop) const {
+        return !loop.cpus || (*loop.cpus)[w];
+    }
+
+    // Run tile `index` of an admitted loop on the calling thread. A throwing
+    // tile records the exception and cancels the tiles not yet started.
+    void run_tile(Loop &loop, int index, int slot) {
+        {
+            Admission admission;
+            TileScope scope;
+            try {
+                loop.body(loop.ctx, index, slot);
+            } catch (...) {
+                {
+                    std::lock_guard<std::mutex> lock(loop.mutex);
+                    if (!loop.error) loop.error = std::current_exception();
+                }
+                cancel(loop);
+            }
+        }
+        loop.running--;
+        loop.complete(1, slot);
+    }
+
+    // Drop the queued tiles of a loop
+    void cancel(Loop &loop) {
+        int dropped = 0;
+        for (int w : loop.workers) {
+            Worker &q = worker(w);
+            std::lock_guard<std::mutex> lock(q.mutex);
+            for (auto it = q.ranges.begin(); it != q.ranges.end();) {
+                if (it->loop != &loop) {
+                    ++it;
+                    continue;
+                }
+                dropped += it->end - it->begin;
+                it = q.ranges.erase(it);
+                q.queued--;
+            }
+        }
+        loop.started += dropped;
+        if (dropped) loop.complete(dropped);
+    }
+
+    // Take a tile and a scratch slot for worker w: from its own deque first,
+    // else from the back of a range in another; within a deque, the loop
+    // with a free slot that is fairer() than the others goes first. A
+    // caller passes its loop as `own`, whose tiles run in the caller's slot.
+    bool take(int w, Loop *&loop, int &index, int &slot, Loop *own = nullptr) {
+        for (int d = 0; d < size(); d++) {
+            Worker &q = worker(w + d);
+            if (q.queued == 0) continue;
+            std::lock_guard<std::mutex> lock(q.mutex);
+            auto best = q.ranges.end();
+            for (auto it = q.ranges.begin(); it != q.ranges.end(); ++it) {
+                if ((it->loop != own && it->loop->idleSlots <= 0) || !serves(w, *it->loop)) continue;
+                if (best == q.ranges.end() || fairer(*it->loop, *best->loop)) best = it;
+            }
+            if (best == q.ranges.end()) continue;
+            slot = best->loop == own ? own->callerSlot : best->loop->acquire_slot();
+            if (slot < 0) continue;
+
+            loop = best->loop;
+            index = d == 0 ? best->begin++ : --best->end;
+            loop->running++;
+            loop->started++;
+            if (best->begin == best->end) {
+                q.ranges.erase(best);
+                q.queued--;
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // Wake one idle worker among `workers`
+    void wake_idle(const std::vector<int> &workers) {
+        for (int w : workers) {
+            Worker &q = worker(w);
+            if (q.idle) {
+                q.waiter.wake();
+                return;
+            }
+        }
+    }
+
+    // Wake one idle worker with tiles in its deque, looking from w on, or
+    // any idle worker that may steal them. Workers are woken one at a time,
+    // each passing the work on once it has a tile, so a small loop does not
+    // wake workers it has no tiles left for.
+    void wake_idle(int w) {
+        Worker *thief = nullptr;
+        for (int d = 0; d < size(); d++) {
+            Worker &q = worker(w + d);
+            if (!q.idle) continue;
+            if (q.queued > 0) {
+                q.waiter.wake();
+                return;
+            }
+            if (!thief) thief = &q;
+        }
+        // Pinned workers cannot tell which deques hold tiles they may run
+        if (thief && !pinned) thief->waiter.wake();
+    }
+
+    // Sleep unless a loop queued tiles since `seen`; a loop publishes its
+    // tiles before it looks for idle workers, and a worker declares itself
+    // idle before it looks for new tiles, so one of them sees the other
+    void wait(int w, unsigned seen) {
+        Worker &q = worker(w);
+        q.idle = true;
+        if (pushes == seen) q.waiter.wait_work();
+        q.idle = false;
+    }
+
+    bool has_work() const {
+        for (const auto &q : queues) {
+            if (q->queued > 0) return true;
+        }
+        return false;
+    }
+
+    void work(int w) {
+#ifdef __linux__
+        if (pinned && w < CPU_SETSIZE) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(w, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        }
+#endif
+        Governor &gov = governor();
+        Waiter &waiter = worker(w).waiter;
+        while (true) {
+            const unsigned seen = pushes;
+            if (has_work()) {
+                gov.acquire(waiter);
+                Loop *loop;
+                int index, slot;
+                if (take(w, loop, index, slot)) {
+                    // More tiles queued: pass the work on to one more worker
+                    if (has_work()) wake_idle(w + 1);
+                    run_tile(*loop, index, slot);
+                    continue;
+                }
+                gov.release();
+            }
+            wait(w, seen);
+        }
+    }
+
+    std::vector<std::unique_ptr<Worker>> queues;
+    const bool pinned;
+    std::atomic<unsigned> next{0};
+    std::atomic<unsigned> pushes{0};    // loops queued so far
+};
+
+// Pools are created on first use and never destroyed: job workers may still
+// run loops during exit
+ThreadPool &shared_pool() {
+    static ThreadPool *instance = new ThreadPool(median_max_threads() - 1, false);
+    return *instance;
+}
+
+ThreadPool &pinned_pool() {
+    static ThreadPool *instance =
+        new ThreadPool(int(std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), MedianCpuSet().size())), true);
+    return *instance;
+}
+
+// A loop on the calling thread alone, still counted against the limit
+void run_serial(int count, void (*body)(void *ctx, int index, int thread), void *ctx) {
+    Waiter waiter;
+    governor().acquire(waiter);
+    Admission admission;
+    TileScope scope;
+    for (int i = 0; i < count; i++) body(ctx, i, 0);
+}
+
+} // namespace
+
+struct MedianLoopState::Impl {
+    Loop loop;
+};
+
+MedianLoopState::MedianLoopState(int threads) : impl(new Impl) {
+    impl->loop.workers.reserve(threads);
+    impl->loop.freeSlots.reserve(threads);
+}
+
+void median_parallel_for(int count, int threads, const MedianCpuSet &cpus,
+                         void (*body)(void *ctx, int index, int thread), void *ctx, MedianLoopState *state) {
+    if (threads <= 0) threads = median_max_threads();
+    if (count <= 0) return;
+
+    // Inside a tile the caller already holds its share
+    if (inTile) {
+        for (int i = 0; i < count; i++) body(ctx, i, 0);
+        return;
+    }
+
+    // Pinned loops always run on their workers; a set without any CPU of
+    // the machine runs unpinned
+    Loop local;
+    Loop &loop = state ? state->impl->loop : local;
+    if (cpus.any() && pinned_pool().cpus_in(cpus) > 0) {
+        pinned_pool().run(loop, count, threads, cpus, body, ctx);
+        return;
+    }
+    ThreadPool &workers = shared_pool();
+    if (threads == 1 || count == 1 || workers.size() == 0) {
+        run_serial(count, body, ctx);
+        return;
+    }
+    workers.run(loop, count, threads, MedianCpuSet(), body, ctx);
+}
+
+#endif
+
+MedianLoopState::~MedianLoopState() {
+    delete impl;
+}
+
+namespace {
+
+// Job workers are started on demand, up to one per hardware thread, and
+// drain the queue before the process exits
+class JobQueue {
+public:
+    ~JobQueue() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        wake.notify_all();
+        for (auto &worker : workers) worker.join();
+    }
+
+    void submit(std::function<void()> job) {
+        std::unique_lock<std::mutex> lock(mutex);
+        jobs.push_back(std::move(job));
+        if (jobs.size() > size_t(idle) && workers.size() < limit) workers.emplace_back([this] { work(); });
+        lock.unlock();
+        wake.notify_one();
+    }
+
+private:
+    void work() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            idle++;
+            wake.wait(lock, [this] { return stop || !jobs.empty(); });
+            idle--;
+            if (jobs.empty()) return;
+
+            std::function<void()> job = std::move(jobs.front());
+            jobs.pop_front();
+            lock.unlock();
+            job();
+            lock.lock();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<std::function<void()>> jobs;
+    std::vector<std::thread> workers;
+    size_t limit = std::max(2u, std::thread::hardware_concurrency());
+    int idle = 0;
+    bool stop = false;
+};
+
+} // namespace
+
+void median_submit_job(std::function<void()> job) {
+    static JobQueue queue;
+    queue.submit(std::move(job));
+}
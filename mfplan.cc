@@ -0,0 +1,203 @@
+#include "median_filter_internal.h"
+
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+// MedianPlan: engine choice, tile layout, per-thread scratch and the parallel
+// loop's bookkeeping set up once per geometry and reused for every frame or
+// batch of frames, so that executing a tiled engine allocates nothing.
+
+struct MedianPlan::Impl {
+    MedianDType dtype;
+    MedianEngine engine;
+    MedianGeometry g;
+    int threads;
+
+    // MedianTileEngine<T> for the plan's dtype, or null if the engine has none
+    const void *tileEngine;
+    std::vector<MedianTile> tiles;
+    std::vector<MedianTile> batchTiles;   // one worker per frame
+    std::vector<std::unique_ptr<MedianScratch>> scratch;
+    std::unique_ptr<MedianLoopState> loop;
+};
+
+namespace {
+
+template <typename T>
+void plan_tiles(MedianPlan::Impl &p) {
+    const MedianTileEngine<T> *engine = median_tile_engine<T>(p.engine);
+    p.tileEngine = engine;
+    if (!engine) return;
+
+    p.tiles = engine->tiles(p.g, p.threads);
+    p.batchTiles = engine->tiles(p.g, 1);
+
+    // Scratch must fit the largest tile of either layout
+    std::vector<MedianTile> all = p.tiles;
+    all.insert(all.end(), p.batchTiles.begin(), p.batchTiles.end());
+    p.scratch.resize(p.threads);
+    for (auto &s : p.scratch) s = engine->scratch(p.g, all);
+}
+
+template <typename T>
+void check_dtype(const MedianPlan::Impl *p) {
+    if (!p) throw std::invalid_argument("MedianPlan: plan has been moved from");
+    if (p->dtype != MedianTraits<T>::dtype) {
+        throw std::invalid_argument(std::string("MedianPlan: plan is for ") + median_dtype_name(p->dtype) +
+                                    " images, not " + median_dtype_name(MedianTraits<T>::dtype));
+    }
+}
+
+template <typename T>
+void plan_execute(MedianPlan::Impl *p, const T *input, T *output) {
+    check_dtype<T>(p);
+
+    const auto *engine = static_cast<const MedianTileEngine<T> *>(p->tileEngine);
+    if (!engine) {
+        const MedianGeometry &g = p->g;
+        median_filter(input, output, g.ny, g.nx, g.hy, g.hx, median_layout(g), p->engine);
+        return;
+    }
+
+    median_parallel_for((int)p->tiles.size(), p->threads, p->g.cpus, p->loop.get(), [&](int index, int thread) {
+        engine->run(p->scratch[thread].get(), input, output, p->g, p->tiles[index]);
+    });
+}
+
+// frame(i, input, output) yields the buffers of frame i
+template <typename T, typename Frame>
+void plan_execute_batch(MedianPlan::Impl *p, int count, Frame frame) {
+    check_dtype<T>(p);
+
+    const auto *engine = static_cast<const MedianTileEngine<T> *>(p->tileEngine);
+    const MedianGeometry &g = p->g;
+
+    // Contiguous runs of frames, about four per thread, so that a task
+    // amortizes its scheduling over many small frames
+    const int chunk = std::max((count + 4 * p->threads - 1) / (4 * p->threads), 1);
+    const int runs = (count + chunk - 1) / chunk;
+
+    median_parallel_for(runs, p->threads, g.cpus, p->loop.get(), [&](int index, int thread) {
+        for (int i = index * chunk; i < std::min((index + 1) * chunk, count); i++) {
+            const T *input;
+            T *output;
+            frame(i, input, output);
+            if (!engine) {
+                median_filter(input, output, g.ny, g.nx, g.hy, g.hx, median_layout(g), p->engine);
+                continue;
+            }
+            for (const MedianTile &t : p->batchTiles) engine->run(p->scratch[thread].get(), input, output, g, t);
+        }
+    });
+}
+
+template <typename T>
+void plan_execute_batch(MedianPlan::Impl *p, const T *const *inputs, T *const *outputs, int count) {
+    plan_execute_batch<T>(p, count, [&](int i, const T *&input, T *&output) {
+        input = inputs[i];
+        output = outputs[i];
+    });
+}
+
+template <typename T>
+void plan_execute_batch(MedianPlan::Impl *p, const T *input, T *output, int count) {
+    if (!p) throw std::invalid_argument("MedianPlan: plan has been moved from");
+    ptrdiff_t inFrame = ptrdiff_t(p->g.ny) * p->g.inStride;
+    ptrdiff_t outFrame = ptrdiff_t(p->g.roi.y1 - p->g.roi.y0) * p->g.outStride;
+    plan_execute_batch<T>(p, count, [&](int i, const T *&in, T *&out) {
+        in = input + i * inFrame;
+        out = output + i * outFrame;
+    });
+}
+
+} // namespace
+
+MedianPlan::MedianPlan(MedianDType dtype, int ny, int nx, int hy, int hx, MedianEngine engine)
+    : MedianPlan(dtype, ny, nx, hy, hx, median_dense_layout(ny, nx), engine) {}
+
+MedianPlan::MedianPlan(MedianDType dtype, int ny, int nx, int hy, int hx, const MedianLayout &layout,
+                       MedianEngine engine) : impl(nullptr) {
+    if (ny <= 0 || nx <= 0 || hy < 0 || hx < 0) throw std::invalid_argument("MedianPlan: invalid image or kernel size");
+
+    const MedianRect &roi = layout.roi;
+    if (roi.y0 < 0 || roi.y0 >= roi.y1 || roi.y1 > ny || roi.x0 < 0 || roi.x0 >= roi.x1 || roi.x1 > nx ||
+        layout.inStride < nx || layout.outStride < roi.x1 - roi.x0) {
+        throw std::invalid_argument("MedianPlan: invalid layout");
+    }
+
+    if (engine == MedianEngine::None) engine = median_filter_select(dtype, roi.y1 - roi.y0, roi.x1 - roi.x0, hy, hx);
+    if (!median_filter_supports(dtype, engine, hy, hx)) {
+        throw std::invalid_argument(std::string("MedianPlan: engine ") + median_engine_name(engine) +
+                                    " does not support " + median_dtype_name(dtype) + " with this kernel");
+    }
+
+    MedianGeometry g = median_geometry(ny, nx, hy, hx, layout);
+    impl = new Impl{dtype, engine, g, median_threads(g), nullptr, {}, {}, {}, nullptr};
+    impl->loop = std::make_unique<MedianLoopState>(impl->threads);
+    switch (dtype) {
+        case MedianDType::Float: plan_tiles<float>(*impl); break;
+        case MedianDType::Uint8: plan_tiles<uint8_t>(*impl); break;
+        case MedianDType::Uint16: plan_tiles<uint16_t>(*impl); break;
+    }
+}
+
+MedianPlan::~MedianPlan() {
+    delete impl;
+}
+
+MedianPlan::MedianPlan(MedianPlan &&other) noexcept : impl(std::exchange(other.impl, nullptr)) {}
+
+MedianPlan &MedianPlan::operator=(MedianPlan &&other) noexcept {
+    std::swap(impl, other.impl);
+    return *this;
+}
+
+MedianEngine MedianPlan::engine() const { return impl ? impl->engine : MedianEngine::None; }
+MedianDType MedianPlan::dtype() const { return impl ? impl->dtype : MedianDType::Float; }
+
+void MedianPlan::execute(const float *input, float *output) { plan_execute(impl, input, output); }
+void MedianPlan::execute(const uint8_t *input, uint8_t *output) { plan_execute(impl, input, output); }
+void MedianPlan::execute(const uint16_t *input, uint16_t *output) { plan_execute(impl, input, output); }
+
+void MedianPlan::execute_batch(const float *const *inputs, float *const *outputs, int count) {
+    plan_execute_batch(impl, inputs, outputs, count);
+}
+void MedianPlan::execute_batch(const uint8_t *const *inputs, uint8_t *const *outputs, int count) {
+    plan_execute_batch(impl, inputs, outputs, count);
+}
+void MedianPlan::execute_batch(const uint16_t *const *inputs, uint16_t *const *outputs, int count) {
+    plan_execute_batch(impl, inputs, outputs, count);
+}
+void MedianPlan::execute_batch(const float *input, float *output, int count) {
+    plan_execute_batch(impl, input, output, count);
+}
+void MedianPlan::execute_batch(const uint8_t *input, uint8_t *output, int count) {
+    plan_execute_batch(impl, input, output, count);
+}
+void MedianPlan::execute_batch(const uint16_t *input, uint16_t *output, int count) {
+    plan_execute_batch(impl, input, output, count);
+}
+
+template <typename T>
+void median_filter_batch(const T *const *inputs, T *const *outputs, int count, int ny, int nx, int hy, int hx,
+                         MedianEngine *chosen) {
+    MedianPlan plan(MedianTraits<T>::dtype, ny, nx, hy, hx);
+    plan.execute_batch(inputs, outputs, count);
+    if (chosen) *chosen = plan.engine();
+}
+
+template <typename T>
+void median_filter_batch(const T *input, T *output, int count, int ny, int nx, int hy, int hx,
+                         MedianEngine *chosen) {
+    MedianPlan plan(MedianTraits<T>::dtype, ny, nx, hy, hx);
+    plan.execute_batch(input, output, count);
+    if (chosen) *chosen = plan.engine();
+}
+
+template void median_filter_batch<float>(const float *const *, float *const *, int, int, int, int, int, MedianEngine *);
+template void median_filter_batch<uint8_t>(const uint8_t *const *, uint8_t *const *, int, int, int, int, int, MedianEngine *);
+template void median_filter_batch<uint16_t>(const uint16_t *const *, uint16_t *const *, int, int, int, int, int, MedianEngine *);
+template void median_filter_batch<float>(const float *, float *, int, int, int, int, int, MedianEngine *);
+template void median_filter_batch<uint8_t>(const uint8_t *, uint8_t *, int, int, int, int, int, MedianEngine *);
+template void median_filter_batch<uint16_t>(const uint16_t *, uint16_t *, int, int, int, int, int, MedianEngine *);
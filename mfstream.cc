@@ -0,0 +1,210 @@
+#include "median_filter_internal.h"
+
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+// MedianStream: row-by-row filtering with a ring of the last 2*hy + 1 rows.
+//
+// float and uint16 keep every ring row twice (slots i and i + k), so any k
+// consecutive rows are contiguous and an output row is one ROI row of a small
+// band image, filtered by the engine's tile code with scratch allocated up
+// front. uint8 keeps one 256-bin histogram per column, updated by one row in
+// and one row out per output row, so the cost of a row does not depend on
+// the kernel size.
+
+struct MedianStream::Impl {
+    MedianDType dtype;
+    int nx, hy, hx, k;
+    long long rowsIn = 0, rowsOut = 0;
+    bool finished = false;
+
+    Impl(MedianDType dtype, int nx, int hy, int hx) : dtype(dtype), nx(nx), hy(hy), hx(hx), k(2 * hy + 1) {}
+    virtual ~Impl() = default;
+
+    // Store input row rowsIn
+    virtual void store(const void *row) = 0;
+    // Compute output row rowsOut from input rows [first, last]
+    virtual void produce(long long first, long long last, void *output) = 0;
+    virtual void clear() {}
+
+    void produce_next(void *output) {
+        long long y = rowsOut++;
+        produce(std::max(y - hy, 0LL), std::min(y + hy, rowsIn - 1), output);
+    }
+};
+
+namespace {
+
+// Band stream over an engine's tile code (float, uint16)
+template <typename T>
+struct BandStream : MedianStream::Impl {
+    const MedianTileEngine<T> *engine;
+    std::vector<T> ring;
+    std::unique_ptr<MedianScratch> scratch;
+
+    BandStream(int nx, int hy, int hx)
+        : Impl(MedianTraits<T>::dtype, nx, hy, hx), ring(size_t(2) * k * nx) {
+
+        // Engine for one output row of a k-row band; v3 when the choice has no tile code
+        engine = median_tile_engine<T>(median_filter_select(dtype, k, nx, hy, hx));
+        if (!engine) engine = MedianTraits<T>::dtype == MedianDType::Float ? median_tile_engine<T>(MedianEngine::V3)
+                                                                             : median_tile_engine<T>(MedianEngine::V6);
+
+        MedianGeometry g = geometry(k, hy);
+        scratch = engine->scratch(g, {g.roi});
+    }
+
+    MedianGeometry geometry(int rows, int y) const {
+        return median_geometry(rows, nx, hy, hx, MedianLayout{nx, nx, MedianRect{y, y + 1, 0, nx}});
+    }
+
+    void store(const void *row) override {
+        size_t slot = size_t(rowsIn % k);
+        const T *in = static_cast<const T *>(row);
+        std::copy(in, in + nx, &ring[slot * nx]);
+        std::copy(in, in + nx, &ring[(slot + k) * nx]);
+    }
+
+    void produce(long long first, long long last, void *output) override {
+        const T *band = &ring[size_t(first % k) * nx];
+        MedianGeometry g = geometry(int(last - first + 1), int(rowsOut - 1 - first));
+        engine->run(scratch.get(), band, static_cast<T *>(output), g, g.roi);
+    }
+};
+
+// Column-histogram stream (uint8)
+struct HistogramStream : MedianStream::Impl {
+    std::vector<uint8_t> ring;
+    std::vector<uint16_t> columns;   // 256 bins per column
+    long long colFirst = 0, colLast = -1;
+
+    HistogramStream(int nx, int hy, int hx)
+        : Impl(MedianDType::Uint8, nx, hy, hx), ring(size_t(k) * nx), columns(size_t(nx) * 256, 0) {}
+
+    void store(const void *row) override {
+        // The slot's previous row must leave the column histograms first
+        while (colFirst <= std::min(rowsIn - k, colLast)) update_columns(colFirst++, -1);
+
+        const uint8_t *in = static_cast<const uint8_t *>(row);
+        std::copy(in, in + nx, &ring[size_t(rowsIn % k) * nx]);
+    }
+
+    void update_columns(long long y, int delta) {
+        const uint8_t *row = &ring[size_t(y % k) * nx];
+        for (int x = 0; x < nx; x++) columns[size_t(x) * 256 + row[x]] += delta;
+    }
+
+    void produce(long long first, long long last, void *output) override {
+        // Slide the column windows down to rows [first, last]
+        while (colLast < last) update_columns(++colLast, 1);
+        while (colFirst < first) update_columns(colFirst++, -1);
+
+        const int rows = int(last - first + 1);
+        uint8_t *out = static_cast<uint8_t *>(output);
+        int hist[256] = {};
+
+        auto add_column = [&](int x, int sign) {
+            const uint16_t *c = &columns[size_t(x) * 256];
+            for (int i = 0; i < 256; i++) hist[i] += sign * c[i];
+        };
+
+        // Bin holding the element of 0-indexed rank `target`
+        auto kth = [&](int target) {
+            int count = 0, i = 0;
+            while (count + hist[i] <= target) count += hist[i++];
+            return i;
+        };
+
+        for (int x = 0; x <= std::min(hx, nx - 1); x++) add_column(x, 1);
+        for (int x = 0; x < nx; x++) {
+            int n = rows * (std::min(x + hx, nx - 1) - std::max(x - hx, 0) + 1);
+            if (n % 2 == 1) {
+                out[x] = uint8_t(kth(n / 2));
+            } else {
+                out[x] = uint8_t((kth(n / 2 - 1) + kth(n / 2) + 1) / 2);
+            }
+            if (x - hx >= 0) add_column(x - hx, -1);
+            if (x + hx + 1 < nx) add_column(x + hx + 1, 1);
+        }
+    }
+
+    void clear() override {
+        std::fill(columns.begin(), columns.end(), 0);
+        colFirst = 0;
+        colLast = -1;
+    }
+};
+
+template <typename T>
+MedianStream::Impl *checked(MedianStream::Impl *impl) {
+    if (!impl) throw std::invalid_argument("MedianStream: stream has been moved from");
+    if (impl->dtype != MedianTraits<T>::dtype) {
+        throw std::invalid_argument(std::string("MedianStream: stream is for ") + median_dtype_name(impl->dtype) +
+                                    " rows, not " + median_dtype_name(MedianTraits<T>::dtype));
+    }
+    return impl;
+}
+
+template <typename T>
+bool stream_push(MedianStream::Impl *impl, const T *row, T *output) {
+    MedianStream::Impl *s = checked<T>(impl);
+    if (s->finished) throw std::logic_error("MedianStream: push after finish");
+
+    s->store(row);
+    s->rowsIn++;
+    if (s->rowsIn <= s->hy) return false;
+    s->produce_next(output);
+    return true;
+}
+
+template <typename T>
+bool stream_finish(MedianStream::Impl *impl, T *output) {
+    MedianStream::Impl *s = checked<T>(impl);
+    s->finished = true;
+    if (s->rowsOut >= s->rowsIn) return false;
+    s->produce_next(output);
+    return true;
+}
+
+} // namespace
+
+MedianStream::MedianStream(MedianDType dtype, int nx, int hy, int hx) : impl(nullptr) {
+    if (nx <= 0 || hy < 0 || hx < 0) throw std::invalid_argument("MedianStream: invalid row or kernel size");
+
+    switch (dtype) {
+        case MedianDType::Float: impl = new BandStream<float>(nx, hy, hx); break;
+        case MedianDType::Uint8: impl = new HistogramStream(nx, hy, hx); break;
+        case MedianDType::Uint16: impl = new BandStream<uint16_t>(nx, hy, hx); break;
+    }
+}
+
+MedianStream::~MedianStream() {
+    delete impl;
+}
+
+MedianStream::MedianStream(MedianStream &&other) noexcept : impl(std::exchange(other.impl, nullptr)) {}
+
+MedianStream &MedianStream::operator=(MedianStream &&other) noexcept {
+    std::swap(impl, other.impl);
+    return *this;
+}
+
+MedianDType MedianStream::dtype() const { return impl ? impl->dtype : MedianDType::Float; }
+long long MedianStream::rows_in() const { return impl ? impl->rowsIn : 0; }
+long long MedianStream::rows_out() const { return impl ? impl->rowsOut : 0; }
+
+bool MedianStream::push(const float *row, float *output) { return stream_push(impl, row, output); }
+bool MedianStream::push(const uint8_t *row, uint8_t *output) { return stream_push(impl, row, output); }
+bool MedianStream::push(const uint16_t *row, uint16_t *output) { return stream_push(impl, row, output); }
+
+bool MedianStream::finish(float *output) { return stream_finish(impl, output); }
+bool MedianStream::finish(uint8_t *output) { return stream_finish(impl, output); }
+bool MedianStream::finish(uint16_t *output) { return stream_finish(impl, output); }
+
+void MedianStream::reset() {
+    if (!impl) return;
+    impl->rowsIn = impl->rowsOut = 0;
+    impl->finished = false;
+    impl->clear();
+}
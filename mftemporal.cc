@@ -0,0 +1,199 @@
+#include "median_filter_internal.h"
+
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+// MedianTemporal: per-pixel median of the last T frames.
+//
+// Every pixel keeps its window sorted, stored structure-of-arrays: rank k of
+// all pixels is one contiguous plane, so each pass below is a loop over
+// pixels that the compiler vectorizes. A push finds, per pixel, where the
+// leaving value sits and where the new one goes (one pass of comparisons),
+// then shifts the ranks between the two by one (one pass of selects): O(T)
+// per pixel with no branches, against O(T log T) for re-sorting. A ring of
+// the raw frames supplies the leaving values. Pixels are processed in chunks
+// that keep their T planes in cache, in parallel on the workers the window
+// was constructed with.
+
+struct MedianTemporal::Impl {
+    MedianDType dtype;
+    size_t pixels;
+    int frames;
+    int threads;
+    MedianCpuSet cpus;
+    long long framesIn = 0;
+
+    Impl(MedianDType dtype, size_t pixels, int frames, int threads, const MedianCpuSet &cpus)
+        : dtype(dtype), pixels(pixels), frames(frames), threads(median_threads(threads, cpus)), cpus(cpus) {}
+    virtual ~Impl() = default;
+
+    // Add a frame and, if output is given, write the new median
+    virtual void push(const void *frame, void *output) = 0;
+    virtual void median(void *output) const = 0;
+
+    // Frames in the window
+    int count() const { return int(std::min(framesIn, (long long)frames)); }
+};
+
+namespace {
+
+constexpr size_t CHUNK = 4096;
+
+template <typename T>
+inline T middle(T a, T b) {
+    return std::is_floating_point<T>::value ? T((a + b) / 2) : T((int(a) + int(b) + 1) / 2);
+}
+
+template <typename T>
+struct SortedWindows : MedianTemporal::Impl {
+    std::vector<T> sorted;          // sorted[k * pixels + i]: rank k of pixel i
+    std::vector<T> ring;            // the window's frames, oldest at framesIn % frames once full
+    std::vector<int32_t> out, in;   // per pixel: rank of the leaving value, of the new one
+    std::vector<T> prev;
+
+    SortedWindows(size_t pixels, int frames, int threads, const MedianCpuSet &cpus)
+        : Impl(MedianTraits<T>::dtype, pixels, frames, threads, cpus), sorted(size_t(frames) * pixels), ring(size_t(frames) * pixels),
+          out(pixels), in(pixels), prev(pixels) {}
+
+    void push(const void *data, void *output) override {
+        const T *frame = static_cast<const T *>(data);
+        const int n = count();
+        const bool full = n == frames;
+        T *oldest = &ring[size_t(framesIn % frames) * pixels];
+
+        // The median of a chunk is read while its planes are in cache
+        const int chunks = int((pixels + CHUNK - 1) / CHUNK);
+        median_parallel_for(chunks, threads, cpus, [&](int c, int) {
+            const size_t i0 = c * CHUNK, i1 = std::min(i0 + CHUNK, pixels);
+            update(frame, oldest, n, full, i0, i1);
+            if (output) median(static_cast<T *>(output), full ? n : n + 1, i0, i1);
+        });
+
+        std::copy(frame, frame + pixels, oldest);
+        framesIn++;
+    }
+
+    // Replace the leaving value of pixels [i0, i1) by the new one (or insert
+    // it while the window is filling), keeping every window sorted
+    void update(const T *__restrict v, const T *__restrict leaving, int n, bool full, size_t i0, size_t i1) {
+        // Restrict-qualified locals: stores through uint8_t would otherwise
+        // alias everything and keep the loops scalar
+        int32_t *__restrict o = out.data();
+        int32_t *__restrict p = in.data();
+        T *__restrict before = prev.data();
+        T *const base = sorted.data();
+        const size_t pixels = this->pixels;
+
+        // Ranks: the first copy of the leaving value is at rank o, the new
+        // value goes at rank p of the window without it. While filling,
+        // nothing leaves (o = n).
+        for (size_t i = i0; i < i1; i++) {
+            o[i] = full ? 0 : n;
+            p[i] = 0;
+        }
+        for (int k = 0; k < n; k++) {
+            const T *__restrict a = base + size_t(k) * pixels;
+            if (full) {
+                for (size_t i = i0; i < i1; i++) o[i] += a[i] < leaving[i];
+            }
+            for (size_t i = i0; i < i1; i++) p[i] += a[i] < v[i];
+        }
+        if (full) {
+            for (size_t i = i0; i < i1; i++) p[i] -= leaving[i] < v[i];
+        }
+
+        // Without the leaving value, rank k is a[k] below o and a[k + 1]
+        // from o on; the new value then shifts the ranks above p up by one
+        const int length = full ? n : n + 1;
+        for (int k = 0; k < length; k++) {
+            T *__restrict a = base + size_t(k) * pixels;
+            // Past the last rank `without` is never selected; read any plane
+            const T *__restrict next = k + 1 < n ? base + size_t(k + 1) * pixels : v;
+            for (size_t i = i0; i < i1; i++) {
+                T cur = a[i];
+                T without = k < o[i] ? cur : next[i];
+                T below = k - 1 < o[i] ? before[i] : cur;
+                before[i] = cur;
+                a[i] = k < p[i] ? without : (k == p[i] ? v[i] : below);
+            }
+        }
+    }
+
+    // Median of windows of n frames, pixels [i0, i1)
+    void median(T *output, int n, size_t i0, size_t i1) const {
+        const T *lo = &sorted[size_t((n - 1) / 2) * pixels];
+        const T *hi = &sorted[size_t(n / 2) * pixels];
+        if (n % 2 == 1) {
+            std::copy(lo + i0, lo + i1, output + i0);
+        } else {
+            for (size_t i = i0; i < i1; i++) output[i] = middle(lo[i], hi[i]);
+        }
+    }
+
+    void median(void *output) const override {
+        median(static_cast<T *>(output), count(), 0, pixels);
+    }
+};
+
+template <typename T, typename Impl>
+Impl *checked(Impl *impl) {
+    if (!impl) throw std::invalid_argument("MedianTemporal: object has been moved from");
+    if (impl->dtype != MedianTraits<T>::dtype) {
+        throw std::invalid_argument(std::string("MedianTemporal: window is of ") + median_dtype_name(impl->dtype) +
+                                    " frames, not " + median_dtype_name(MedianTraits<T>::dtype));
+    }
+    return impl;
+}
+
+template <typename T>
+void temporal_push(MedianTemporal::Impl *impl, const T *frame, T *output) {
+    checked<T>(impl)->push(frame, output);
+}
+
+template <typename T>
+void temporal_median(const MedianTemporal::Impl *impl, T *output) {
+    const MedianTemporal::Impl *t = checked<T>(impl);
+    if (t->framesIn == 0) throw std::logic_error("MedianTemporal: no frames pushed");
+    t->median(output);
+}
+
+} // namespace
+
+MedianTemporal::MedianTemporal(MedianDType dtype, int ny, int nx, int frames, int threads, const MedianCpuSet &cpus)
+    : impl(nullptr) {
+    if (ny <= 0 || nx <= 0 || frames <= 0) throw std::invalid_argument("MedianTemporal: invalid frame size or count");
+
+    const size_t pixels = size_t(ny) * nx;
+    switch (dtype) {
+        case MedianDType::Float: impl = new SortedWindows<float>(pixels, frames, threads, cpus); break;
+        case MedianDType::Uint8: impl = new SortedWindows<uint8_t>(pixels, frames, threads, cpus); break;
+        case MedianDType::Uint16: impl = new SortedWindows<uint16_t>(pixels, frames, threads, cpus); break;
+    }
+}
+
+MedianTemporal::~MedianTemporal() {
+    delete impl;
+}
+
+MedianTemporal::MedianTemporal(MedianTemporal &&other) noexcept : impl(std::exchange(other.impl, nullptr)) {}
+
+MedianTemporal &MedianTemporal::operator=(MedianTemporal &&other) noexcept {
+    std::swap(impl, other.impl);
+    return *this;
+}
+
+MedianDType MedianTemporal::dtype() const { return impl ? impl->dtype : MedianDType::Float; }
+long long MedianTemporal::frames_in() const { return impl ? impl->framesIn : 0; }
+
+void MedianTemporal::push(const float *frame, float *output) { temporal_push(impl, frame, output); }
+void MedianTemporal::push(const uint8_t *frame, uint8_t *output) { temporal_push(impl, frame, output); }
+void MedianTemporal::push(const uint16_t *frame, uint16_t *output) { temporal_push(impl, frame, output); }
+
+void MedianTemporal::median(float *output) const { temporal_median(impl, output); }
+void MedianTemporal::median(uint8_t *output) const { temporal_median(impl, output); }
+void MedianTemporal::median(uint16_t *output) const { temporal_median(impl, output); }
+
+void MedianTemporal::reset() {
+    if (impl) impl->framesIn = 0;
+}
@@ -1,20 +1,31 @@
 #include <algorithm>
 #include <cstdlib>
+
+#include "median_filter_internal.h"
+
 using namespace std;
 
-void median_filterv1(const float *input, float *output, int ny, int nx, int hy, int hx) {
+void median_filterv1(const float *input, float *output, int ny, int nx, int hy, int hx, const MedianLayout &layout) {
 
+    MedianGeometry g = median_geometry(ny, nx, hy, hx, layout);
     float *pixels = (float *)malloc((2 * hy + 1) * (2 * hx + 1) * sizeof(float));
 
-    for(int y=0; y<ny; y++) {
-        for(int x=0; x<nx; x++) {
+    for(int y=layout.roi.y0; y<layout.roi.y1; y++) {
+        float *out = output + (y - layout.roi.y0) * layout.outStride;
+        for(int x=layout.roi.x0; x<layout.roi.x1; x++) {
 
             int len = 0;
-			for(int i=max(y - hy, 0); i<min(y + hy + 1, ny); i++) {
-				for(int j=max(x - hx, 0); j<min(x + hx + 1, nx); j++) {
-					pixels[len++] = input[nx*i + j];
+            if (layout.border == MedianBorder::Shrink) {
+				for(int i=max(y - hy, 0); i<min(y + hy + 1, ny); i++) {
+					for(int j=max(x - hx, 0); j<min(x + hx + 1, nx); j++) {
+						pixels[len++] = input[layout.inStride*i + j];
+					}
 				}
-			}
+            } else {
+                // Virtually padded: the window is always full
+                median_gather_padded(input, g, y, x, pixels);
+                len = (2 * hy + 1) * (2 * hx + 1);
+            }
 
             // Sort the pixels
             sort(pixels, pixels + len);
@@ -22,9 +33,9 @@ void median_filterv1(const float *input, float *output, int ny, int nx, int hy,
             const int mid = len / 2;
 
             if (len % 2 == 1) {
-                output[nx*y + x] = pixels[mid];
+                out[x - layout.roi.x0] = pixels[mid];
             } else {
-                output[nx*y + x] = 0.5f * (pixels[mid] + pixels[mid - 1]);
+                out[x - layout.roi.x0] = 0.5f * (pixels[mid] + pixels[mid - 1]);
             }
 
         }
@@ -32,4 +43,10 @@ void median_filterv1(const float *input, float *output, int ny, int nx, int hy,
 
 	free(pixels);
 
-}
\ No newline at end of file
+}
+
+void median_filterv1(const float *input, float *output, int ny, int nx, int hy, int hx) {
+
+    median_filterv1(input, output, ny, nx, hy, hx, median_dense_layout(ny, nx));
+
+}
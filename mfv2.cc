@@ -1,20 +1,31 @@
 #include <algorithm>
 #include <cstdlib>
+
+#include "median_filter_internal.h"
+
 using namespace std;
 
-void median_filterv2(const float *input, float *output, int ny, int nx, int hy, int hx) {
+void median_filterv2(const float *input, float *output, int ny, int nx, int hy, int hx, const MedianLayout &layout) {
 
+    MedianGeometry g = median_geometry(ny, nx, hy, hx, layout);
     float *pixels = (float *)malloc((2 * hy + 1) * (2 * hx + 1) * sizeof(float));
 
-    for(int y=0; y<ny; y++) {
-        for(int x=0; x<nx; x++) {
+    for(int y=layout.roi.y0; y<layout.roi.y1; y++) {
+        float *out = output + (y - layout.roi.y0) * layout.outStride;
+        for(int x=layout.roi.x0; x<layout.roi.x1; x++) {
 
             int len = 0;
-			for(int i=max(y - hy, 0); i<min(y + hy + 1, ny); i++) {
-				for(int j=max(x - hx, 0); j<min(x + hx + 1, nx); j++) {
-					pixels[len++] = input[nx*i + j];
+            if (layout.border == MedianBorder::Shrink) {
+				for(int i=max(y - hy, 0); i<min(y + hy + 1, ny); i++) {
+					for(int j=max(x - hx, 0); j<min(x + hx + 1, nx); j++) {
+						pixels[len++] = input[layout.inStride*i + j];
+					}
 				}
-			}
+            } else {
+                // Virtually padded: the window is always full
+                median_gather_padded(input, g, y, x, pixels);
+                len = (2 * hy + 1) * (2 * hx + 1);
+            }
 
             const int mid = len / 2;
 
@@ -23,14 +34,14 @@ void median_filterv2(const float *input, float *output, int ny, int nx, int hy,
 
             if (len & 1) {
 				// odd count and mid is the median
-                output[nx*y + x] = pixels[mid];
+                out[x - layout.roi.x0] = pixels[mid];
             } else {
                 // even count and need the two middle values
                 // find the max in the lower half
                 float hi = pixels[mid];
                 float lo = pixels[mid - 1];
 				for(float *p=pixels; p<pixels + mid - 1; p++) lo = max(lo, *p);
-                output[nx*y + x] = 0.5f * (lo + hi);
+                out[x - layout.roi.x0] = 0.5f * (lo + hi);
 
             }
 
@@ -39,4 +50,10 @@ void median_filterv2(const float *input, float *output, int ny, int nx, int hy,
 
 	free(pixels);
 
-}
\ No newline at end of file
+}
+
+void median_filterv2(const float *input, float *output, int ny, int nx, int hy, int hx) {
+
+    median_filterv2(input, output, ny, nx, hy, hx, median_dense_layout(ny, nx));
+
+}
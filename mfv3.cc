@@ -1,59 +1,273 @@
 #include <algorithm>
 #include <cstdlib>
+
+#include "median_filter_internal.h"
+
 using namespace std;
 
 constexpr int Nx = 8;
 constexpr int Ny = 4;
 
-void median_filterv3(const float *input, float *output, int ny, int nx, int hy, int hx) {
+// Number of adjacent output pixels the fixed-size kernels process at once
+constexpr int Lanes = 8;
+
+// Median of the (shrunk) window around (y, x) using nth_element
+static inline float median_generic(const float *input, ptrdiff_t stride, float *pixels, int ny, int nx, int hy, int hx, int y, int x) {
+
+    int len = 0;
+    for(int i=max(y - hy, 0); i<min(y + hy + 1, ny); i++) {
+        for(int j=max(x - hx, 0); j<min(x + hx + 1, nx); j++) {
+            pixels[len++] = input[stride*i + j];
+        }
+    }
+
+    const int mid = len / 2;
 
-    int Sx = nx / Nx + 1;
-    int Sy = ny / Ny + 1;
-
-    // Split the image into blocks of size Sx x Sy
-    // and process each block in parallel
-    // yg -> grid index of the block in y
-    // xg -> grid index of the block in x
-	#pragma omp parallel for collapse(2) schedule(dynamic)
-    for(int yg=0; yg<ny; yg+=Sy) {
-        for(int xg=0; xg<nx; xg+=Sx) {
-
-            float *pixels = (float *)malloc((2 * hy + 1) * (2 * hx + 1) * sizeof(float));
-
-            for(int y=yg; y-yg<Sy && y<ny; y++) {
-                for(int x=xg; x-xg<Sx && x<nx; x++) {
-
-                    int len = 0;
-                    for(int i=max(y - hy, 0); i<min(y + hy + 1, ny); i++) {
-                        for(int j=max(x - hx, 0); j<min(x + hx + 1, nx); j++) {
-                            pixels[len++] = input[nx*i + j];
-                        }
-                    }
-        
-                    const int mid = len / 2;
-
-                    // Move the element in the middle as if the array was sorted
-                    nth_element(pixels, pixels + mid, pixels + len);
-
-                    if (len & 1) {
-                        // odd count and mid is the median
-                        output[nx* y + x] = pixels[mid];
-                    } else {
-                        // even count and need the two middle values
-                        // find the max in the lower half
-                        float hi = pixels[mid];
-                        float lo = pixels[mid - 1];
-                        for(float *p=pixels; p<pixels + mid - 1; p++) lo = max(lo, *p);
-                        output[nx* y + x] = 0.5f * (lo + hi);
-
-                    }
+    // Move the element in the middle as if the array was sorted
+    nth_element(pixels, pixels + mid, pixels + len);
+
+    if (len & 1) {
+        // odd count and mid is the median
+        return pixels[mid];
+    } else {
+        // even count and need the two middle values
+        // find the max in the lower half
+        float hi = pixels[mid];
+        float lo = pixels[mid - 1];
+        for(float *p=pixels; p<pixels + mid - 1; p++) lo = max(lo, *p);
+        return 0.5f * (lo + hi);
+    }
 
+}
+
+// Compare-exchange network that moves the median of N values to index N/2.
+// It is Batcher's merge-exchange sort with every exchange that cannot affect
+// the middle element pruned away, generated at compile time.
+template <int N>
+struct MedianNetwork {
+    static constexpr int MaxPairs = N * N;
+    int lo[MaxPairs] = {}, hi[MaxPairs] = {};
+    int count = 0;
+
+    constexpr MedianNetwork() {
+        int slo[MaxPairs] = {}, shi[MaxPairs] = {};
+        int n = 0;
+
+        int t = 0;
+        while ((1 << t) < N) t++;
+        for (int p = t > 0 ? 1 << (t - 1) : 0; p > 0; p >>= 1) {
+            int q = 1 << (t - 1), r = 0, d = p;
+            while (true) {
+                for (int i = 0; i + d < N; i++) {
+                    if ((i & p) == r) { slo[n] = i; shi[n] = i + d; n++; }
                 }
+                if (q == p) break;
+                d = q - p; q >>= 1; r = p;
             }
+        }
+
+        // Walk backwards keeping only exchanges that feed the median
+        bool needed[N] = {};
+        needed[N / 2] = true;
+        int keep[MaxPairs] = {};
+        for (int c = n - 1; c >= 0; c--) {
+            if (needed[slo[c]] || needed[shi[c]]) {
+                keep[c] = 1;
+                needed[slo[c]] = needed[shi[c]] = true;
+            }
+        }
+        for (int c = 0; c < n; c++) {
+            if (keep[c]) { lo[count] = slo[c]; hi[count] = shi[c]; count++; }
+        }
+    }
+};
+
+// Apply the selection network to L windows of N values at once; the medians
+// end up in w[N / 2]
+template <int N, int L>
+static inline void select_median(float (&w)[N][L]) {
+
+    static constexpr MedianNetwork<N> net{};
+
+    #pragma GCC unroll 128
+    for(int c=0; c<net.count; c++) {
+        float *a = w[net.lo[c]];
+        float *b = w[net.hi[c]];
+        for(int l=0; l<L; l++) {
+            float va = a[l], vb = b[l];
+            a[l] = min(va, vb);
+            b[l] = max(va, vb);
+        }
+    }
+
+}
+
+// Median of a full (2HY+1)x(2HX+1) window for L adjacent pixels starting at
+// (y, x), written to out[0, L). The window lives on the stack, the gather is
+// fully unrolled and the selection network is branch-free and applied to all
+// lanes at once.
+template <int HY, int HX, int L>
+static inline void median_fixed(const float *input, ptrdiff_t stride, float *out, int y, int x) {
+
+    constexpr int W = 2 * HX + 1;
+    constexpr int N = (2 * HY + 1) * W;
+
+    float w[N][L];
+
+    #pragma GCC unroll 16
+    for(int dy=0; dy<2*HY+1; dy++) {
+        const float *row = input + stride*(y - HY + dy) + (x - HX);
+        #pragma GCC unroll 16
+        for(int dx=0; dx<W; dx++) {
+            for(int l=0; l<L; l++) w[dy*W + dx][l] = row[dx + l];
+        }
+    }
+
+    select_median<N, L>(w);
+
+    for(int l=0; l<L; l++) out[l] = w[N / 2][l];
+
+}
+
+// Border pixel under a padding border mode: the window is completed through
+// the virtual padding and goes through the same network as the interior
+template <int HY, int HX>
+static float median_fixed_padded(const float *input, const MedianGeometry &g, int y, int x) {
+
+    constexpr int N = (2 * HY + 1) * (2 * HX + 1);
+
+    float pixels[N];
+    median_gather_padded(input, g, y, x, pixels);
 
-            free(pixels);
+    float w[N][1];
+    for(int i=0; i<N; i++) w[i][0] = pixels[i];
+    select_median<N, 1>(w);
+    return w[N / 2][0];
 
+}
+
+// Generic kernel size under a padding border: the window is always full and
+// odd, so one nth_element suffices
+static inline float median_generic_padded(const float *input, const MedianGeometry &g, float *pixels, int y, int x) {
+
+    const int len = (2 * g.hy + 1) * (2 * g.hx + 1);
+    median_gather_padded(input, g, y, x, pixels);
+    nth_element(pixels, pixels + len / 2, pixels + len);
+    return pixels[len / 2];
+
+}
+
+// Interior pixels [x0, x1) of row y, in groups of Lanes with a scalar tail;
+// out points at the output of (y, x0)
+template <int HY, int HX>
+static void row_fixed(const float *input, ptrdiff_t stride, float *out, int y, int x0, int x1) {
+
+    int x = x0;
+    for(; x + Lanes <= x1; x += Lanes) median_fixed<HY, HX, Lanes>(input, stride, out + (x - x0), y, x);
+    for(; x < x1; x++) median_fixed<HY, HX, 1>(input, stride, out + (x - x0), y, x);
+
+}
+
+typedef void (*FixedRowKernel)(const float *input, ptrdiff_t stride, float *out, int y, int x0, int x1);
+typedef float (*FixedPaddedKernel)(const float *input, const MedianGeometry &g, int y, int x);
+
+// Kernel sizes with a compile-time specialization; anything else takes the
+// generic nth_element path
+struct FixedKernel {
+    int hy, hx;
+    FixedRowKernel row;
+    FixedPaddedKernel padded;
+};
+
+static const FixedKernel fixed_kernels[] = {
+    {1, 1, row_fixed<1, 1>, median_fixed_padded<1, 1>},   // 3x3
+    {2, 2, row_fixed<2, 2>, median_fixed_padded<2, 2>},   // 5x5
+    {3, 3, row_fixed<3, 3>, median_fixed_padded<3, 3>},   // 7x7
+    {1, 2, row_fixed<1, 2>, median_fixed_padded<1, 2>},   // 3x5
+};
+
+static const FixedKernel *find_fixed_kernel(int hy, int hx) {
+    for(const auto &entry : fixed_kernels) {
+        if(entry.hy == hy && entry.hx == hx) return &entry;
+    }
+    return nullptr;
+}
+
+// Working memory for the generic path of one thread
+struct V3Scratch : MedianScratch {
+    vector<float> pixels;
+};
+
+// Split the ROI into an Ny x Nx grid of blocks of size Sy x Sx
+static vector<MedianTile> v3_tiles(const MedianGeometry &g, int) {
+
+    int Sx = (g.roi.x1 - g.roi.x0) / Nx + 1;
+    int Sy = (g.roi.y1 - g.roi.y0) / Ny + 1;
+
+    vector<MedianTile> tiles;
+    for(auto ys : median_split(g.roi.y0, g.roi.y1, Sy)) {
+        for(auto xs : median_split(g.roi.x0, g.roi.x1, Sx)) {
+            tiles.push_back({ys.first, ys.second, xs.first, xs.second});
         }
     }
+    return tiles;
+
+}
+
+static unique_ptr<MedianScratch> v3_scratch(const MedianGeometry &g, const vector<MedianTile> &) {
+
+    auto scratch = make_unique<V3Scratch>();
+    scratch->pixels.resize((2 * g.hy + 1) * (2 * g.hx + 1));
+    return scratch;
+
+}
+
+static void v3_run(MedianScratch *scratch, const float *input, float *output, const MedianGeometry &g, const MedianTile &t) {
+
+    const int ny = g.ny, nx = g.nx, hy = g.hy, hx = g.hx;
+    const ptrdiff_t stride = g.inStride;
+    float *pixels = static_cast<V3Scratch *>(scratch)->pixels.data();
+
+    const FixedKernel *fixed = find_fixed_kernel(hy, hx);
+    const bool padded = g.border != MedianBorder::Shrink;
+
+    // Pixels outside the fixed kernel's interior span
+    auto border = [&](int y, int x) {
+        bool inside = y - hy >= 0 && y + hy < ny && x - hx >= 0 && x + hx < nx;
+        if (!padded || inside) return median_generic(input, stride, pixels, ny, nx, hy, hx, y, x);
+        if (fixed) return fixed->padded(input, g, y, x);
+        return median_generic_padded(input, g, pixels, y, x);
+    };
+
+    for(int y=t.y0; y<t.y1; y++) {
+
+        // Columns whose window lies fully inside the image
+        int xi0 = t.x1, xi1 = t.x1;
+        if (fixed && y - hy >= 0 && y + hy < ny) {
+            xi0 = min(max(t.x0, hx), t.x1);
+            xi1 = max(min(t.x1, nx - hx), xi0);
+        }
+
+        float *out = median_output_at(output, g, y, t.x0);
+        for(int x=t.x0; x<xi0; x++) out[x - t.x0] = border(y, x);
+        if (xi0 < xi1) fixed->row(input, stride, out + (xi0 - t.x0), y, xi0, xi1);
+        for(int x=xi1; x<t.x1; x++) out[x - t.x0] = border(y, x);
+
+    }
+
+}
+
+const MedianTileEngine<float> median_tiles_v3 = {v3_tiles, v3_scratch, v3_run};
+
+// Split the image into blocks and process each block in parallel
+void median_filterv3(const float *input, float *output, int ny, int nx, int hy, int hx, const MedianLayout &layout) {
+
+    median_filter_tiled(median_tiles_v3, input, output, median_geometry(ny, nx, hy, hx, layout));
+
+}
+
+void median_filterv3(const float *input, float *output, int ny, int nx, int hy, int hx) {
+
+    median_filterv3(input, output, ny, nx, hy, hx, median_dense_layout(ny, nx));
 
-}
\ No newline at end of file
+}
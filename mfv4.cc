@@ -3,9 +3,10 @@
 #include <iostream>
 #include <x86intrin.h>
 #include <algorithm>
-#include <omp.h>
 #include <cmath>
 
+#include "median_filter_internal.h"
+
 struct Block {
 
     int nx, ny;
@@ -14,20 +15,58 @@ struct Block {
     int x0b, x1b, y0b, y1b;
     int x0i, y0i, x1i, y1i;
     int x0, y0, x1, y1;
-    int words, p;
-    int psum[2];
+    // A search position: words [0, p) of the buffer hold `below` set bits
+    struct Cursor {
+        int p;
+        int below;
+    };
+
+    int words, total;
+    Cursor cursor;              // for the median, or the lowest rank
+    std::vector<Cursor> extra;  // one per further rank
+    float fill;
     std::vector<std::pair<float, int>> sorted;
     std::vector<int> ranks;
     std::vector<uint64_t> buff;
+    std::vector<int> weight, wsum;  // weighted mode: per rank, per word
+
+    Block() = default;
+
+    // Rows of `in` (and `mask`) are `stride` elements apart. mask (optional)
+    // marks valid pixels with a non-zero entry; masked pixels never enter the
+    // rank buffer and empty windows produce `fill`. With a padding border the
+    // block extends past the image and its halo is read through the virtual
+    // padding (`constant` for MedianBorder::Constant).
+    Block(int ny, int nx, int hy, int hx, const float *in, ptrdiff_t stride, int x0i, int y0i, int x1i, int y1i,
+          const uint8_t *mask = nullptr, float fill = 0.0f,
+          MedianBorder border = MedianBorder::Shrink, float constant = 0.0f) {
+        init(ny, nx, hy, hx, in, stride, x0i, y0i, x1i, y1i, mask, fill, border, constant);
+    }
+
+    // (Re)initialize for a new block; the buffers keep their capacity so a
+    // Block reused across blocks does not allocate once it is large enough
+    void init(int ny, int nx, int hy, int hx, const float *in, ptrdiff_t stride, int x0i, int y0i, int x1i, int y1i,
+              const uint8_t *mask = nullptr, float fill = 0.0f,
+              MedianBorder border = MedianBorder::Shrink, float constant = 0.0f) {
 
-    Block(int ny, int nx, int hy, int hx, const float *in, int x0i, int y0i, int x1i, int y1i)
-    : nx(nx), ny(ny), hy(hy), hx(hx), x0i(x0i), y0i(y0i), x1i(x1i), y1i(y1i) {
+        this->ny = ny; this->nx = nx;
+        this->hy = hy; this->hx = hx;
+        this->x0i = x0i; this->y0i = y0i;
+        this->x1i = x1i; this->y1i = y1i;
+        this->fill = fill;
 
         // The boundaries of the block
-        x0b = std::max(x0i - hx, 0);
-        y0b = std::max(y0i - hy, 0);
-        x1b = std::min(x1i + hx, nx - 1);
-        y1b = std::min(y1i + hy, ny - 1);
+        if (border == MedianBorder::Shrink) {
+            x0b = std::max(x0i - hx, 0);
+            y0b = std::max(y0i - hy, 0);
+            x1b = std::min(x1i + hx, nx - 1);
+            y1b = std::min(y1i + hy, ny - 1);
+        } else {
+            x0b = x0i - hx;
+            y0b = y0i - hy;
+            x1b = x1i + hx;
+            y1b = y1i + hy;
+        }
 
         x0 = x0i - x0b;
         y0 = y0i - y0b;
@@ -38,11 +77,21 @@ struct Block {
         bx = (x1b - x0b + 1);
         by = (y1b - y0b + 1);
 
-        sorted.resize(bx * by);
+        sorted.clear();
         ranks.resize(bx * by);
 
-        for(int dy=0; dy<by; dy++) for(int dx=0; dx<bx; dx++) {
-            sorted[dy * bx + dx] = {in[(y0b + dy) * nx + (x0b + dx)], dy * bx + dx};
+        // Masked pixels get no rank and never enter the buffer
+        for(int dy=0; dy<by; dy++) {
+            int r = median_border_index(border, y0b + dy, ny);
+            for(int dx=0; dx<bx; dx++) {
+                int c = median_border_index(border, x0b + dx, nx);
+                bool inside = r >= 0 && c >= 0;
+                if (inside && mask && !mask[r * stride + c]) {
+                    ranks[dy * bx + dx] = -1;
+                    continue;
+                }
+                sorted.push_back({inside ? in[r * stride + c] : constant, dy * bx + dx});
+            }
         }
 
         std::sort(
@@ -52,14 +101,15 @@ struct Block {
             }
         );
     
-        for (int i=0; i<bx * by; i++) {
+        for (int i=0; i<(int)sorted.size(); i++) {
             ranks[sorted[i].second] = i;
         }
 
-        words = (bx * by + 63) / 64;
-		psum[0] = psum[1] = 0;
-		p = words / 2;
-        buff = std::vector<uint64_t>(words, 0);
+        words = ((int)sorted.size() + 63) / 64;
+		total = 0;
+		cursor = Cursor{words / 2, 0};
+		extra.clear();
+        buff.assign(words, 0);
 
     }
 
@@ -67,38 +117,88 @@ struct Block {
 	inline void add_rank(int ix, int jy) {
         if (ix < 0 || ix >= bx || jy < 0 || jy >= by) return;
         int rank = ranks[jy * bx + ix];
+        if (rank < 0) return;
 		int i = rank >> 6;
 		buff[i] ^= (uint64_t(1) << (rank & 63));
-		psum[i >= p] += 1;
+		total++;
+		cursor.below += i < cursor.p;
+		for (Cursor &c : extra) c.below += i < c.p;
 	}
 
 	inline void remove_rank(int ix, int jy) {
         if (ix < 0 || ix >= bx || jy < 0 || jy >= by) return;
         int rank = ranks[jy * bx + ix];
+        if (rank < 0) return;
 		int i = rank >> 6;
 		buff[i] ^= (uint64_t(1) << (rank & 63));
-		psum[i >= p] -= 1;
+		total--;
+		cursor.below -= i < cursor.p;
+		for (Cursor &c : extra) c.below -= i < c.p;
 
 	}
 
+    // Switch to weighted counts: a rank's bit is set while its weight is
+    // positive, and the cursors count weight, summed per buffer word. Call
+    // after init().
+    void use_weights() {
+        weight.assign(sorted.size(), 0);
+        wsum.assign(words, 0);
+    }
+
+    // Add `delta` to the weight of a pixel in local block coordinates
+    inline void change_weight(int ix, int jy, int delta) {
+        if (ix < 0 || ix >= bx || jy < 0 || jy >= by) return;
+        int rank = ranks[jy * bx + ix];
+        if (rank < 0) return;
+        int i = rank >> 6;
+        int w = weight[rank] += delta;
+        if (w) buff[i] |= uint64_t(1) << (rank & 63); else buff[i] &= ~(uint64_t(1) << (rank & 63));
+        wsum[i] += delta;
+        total += delta;
+        if (i < cursor.p) cursor.below += delta;
+        for (Cursor &c : extra) if (i < c.p) c.below += delta;
+    }
+
 	inline int pop(int idx) const {
 		return __builtin_popcountll(buff[idx]);
 	}
 
+    // Pixels, or their weight, in word idx
+    template <bool Weighted>
+    inline int count(int idx) const {
+        return Weighted ? wsum[idx] : pop(idx);
+    }
+
+    template <bool Weighted = false>
     inline int search(int target) {
+        return search<Weighted>(target, cursor);
+    }
+
+    template <bool Weighted = false>
+    inline int search(int target, Cursor &c) {
 
         // localize the target chunk in buffer
-		while (psum[0] > target) {
+		int &p = c.p;
+		while (c.below > target) {
 			p--;
-			psum[0] -= pop(p);
-			psum[1] += pop(p);
+			c.below -= count<Weighted>(p);
 		}
-		while (psum[0] + pop(p) <= target) {
-			psum[0] += pop(p);
-			psum[1] -= pop(p);
+		while (c.below + count<Weighted>(p) <= target) {
+			c.below += count<Weighted>(p);
 			p++;
 		}
-		int n = target - psum[0];
+		int n = target - c.below;
+
+        if (Weighted) {
+            // Walk the ranks present in the word until their weight passes n
+            uint64_t bits = buff[p];
+            while (true) {
+                int rank = (p << 6) | __builtin_ctzll(bits);
+                n -= weight[rank];
+                if (n < 0) return rank;
+                bits &= bits - 1;
+            }
+        }
 
 		// courtesy of:
 		// https://stackoverflow.com/questions/7669057/find-nth-set-bit-in-an-int
@@ -108,20 +208,91 @@ struct Block {
 
     }
 
+    // Pixel of rank `rank` in the current window, or `fill` if it is empty,
+    // found from cursor `c`
+    inline float get_rank(const MedianRank &rank, int full, Cursor &c) {
+        if(total == 0) return fill;
+        return sorted[search(median_rank_index(rank, total, full), c)].first;
+    }
+
+    // The median, of the pixels or (Weighted) of their weights
+    template <bool Weighted = false>
     inline float get_median() {
 
-        int sum = psum[0] + psum[1];
-        int i1 = search((sum - 1) / 2);
+        int sum = total;
+        if(sum == 0) return fill;
+        int i1 = search<Weighted>((sum - 1) / 2);
         if(sum % 2 == 1) {
             return sorted[i1].first;
         } else {
-            int i2 = search(sum / 2);
+            int i2 = search<Weighted>(sum / 2);
             return (sorted[i1].first + sorted[i2].first) / 2;
         }
 
 	}
 
-    inline void compute_median(float *out) {
+    // out points at the output of (y0i, x0i), rows outStride elements apart
+    inline void compute_median(float *out, ptrdiff_t outStride) {
+        compute([&](int y, int x) { out[y * outStride + x] = get_median(); });
+    }
+
+    // outs[k] receives ranks[k]; the window state is shared and only the
+    // searches are repeated. Each rank keeps its own cursor, which stays
+    // near its target from one window to the next.
+    inline void compute_ranks(float *const *outs, ptrdiff_t outStride, const MedianRank *ranks, int count) {
+        const int full = (2 * hy + 1) * (2 * hx + 1);
+        extra.assign(count - 1, cursor);
+        compute([&](int y, int x) {
+            outs[0][y * outStride + x] = get_rank(ranks[0], full, cursor);
+            for (int k = 1; k < count; k++) outs[k][y * outStride + x] = get_rank(ranks[k], full, extra[k - 1]);
+        });
+    }
+
+    // Snake for weights or footprints: every pixel enters with its weight
+    // in `weights`, and steps[0], [1] and [2] change the weights for a move
+    // right, down and up. Without Weighted the weights are 0 or 1 and the
+    // plain bit buffer is used. store(y, x) as in compute().
+    template <bool Weighted, typename Store>
+    inline void compute_steps(const int *weights, const std::vector<MedianWeightStep> *steps, Store store) {
+
+        auto change = [&](int ix, int jy, int delta) {
+            if(Weighted) change_weight(ix, jy, delta);
+            else if(delta > 0) add_rank(ix, jy);
+            else remove_rank(ix, jy);
+        };
+
+        for(int dy=-hy; dy<=hy; dy++) {
+            for(int dx=-hx; dx<=hx; dx++) {
+                int w = weights[(dy + hy) * (2 * hx + 1) + (dx + hx)];
+                if(w) change(x0 + dx, y0 + dy, w);
+            }
+        }
+
+        auto move = [&](int x, int y, const std::vector<MedianWeightStep> &step) {
+            for(const MedianWeightStep &s : step) change(x + s.dx, y + s.dy, s.delta);
+        };
+
+        // Down the first column, up the next, and so on
+        int x = x0, y = y0, dir = 1;
+        while(true) {
+            store(y - y0, x - x0);
+            if(dir > 0 ? y < y1 : y > y0) {
+                move(x, y, steps[dir > 0 ? 1 : 2]);
+                y += dir;
+            } else {
+                if(x == x1) break;
+                move(x, y, steps[0]);
+                x++;
+                dir = -dir;
+            }
+        }
+
+    }
+
+    // Snake through the block, calling store(y, x) for every window with
+    // its output coordinates relative to (y0i, x0i)
+    template <typename Store>
+    inline void compute(Store store) {
 
         for(int ix=x0-hx; ix<x0+hx; ix++) for(int jy=y0-hy; jy<=y0+hy; jy++) add_rank(ix, jy);
 
@@ -136,16 +307,16 @@ struct Block {
             int y = y0;
             while(y < y1) {
 
-                out[(x + x0b) + nx * (y + y0b)] = get_median();
+                store(y - y0, x - x0);
     
                 // remove the upper horizontal boundary and add lower
                 if(y - hy >= 0) for(int ix=-hx; ix<=hx; ix++) remove_rank(x + ix, y - hy);
                 y++;
-                if(y + hy < ny) for(int ix=-hx; ix<=hx; ix++) add_rank(x + ix, y + hy);
+                if(y + hy < by) for(int ix=-hx; ix<=hx; ix++) add_rank(x + ix, y + hy);
     
             }
     
-            out[(x + x0b) + nx * (y + y0b)] = get_median();
+            store(y - y0, x - x0);
     
             // Remove the left vertical boundary of the window
             for(int jy=y - hy; jy<=y + hy; jy++) remove_rank(x - hx, jy);
@@ -156,17 +327,17 @@ struct Block {
             y = y1;
             while(y > y0) {
     
-                out[(x + x0b) + nx * (y + y0b)] = get_median();
+                store(y - y0, x - x0);
     
                 // remove the lower horizontal boundary
-                if(y + hy < ny) for(int ix=-hx; ix<=hx; ix++) remove_rank(x + ix, y + hy);
+                if(y + hy < by) for(int ix=-hx; ix<=hx; ix++) remove_rank(x + ix, y + hy);
                 y--;
                 // add the upper horizontal boundary
                 if(y - hy >= 0) for(int ix=-hx; ix<=hx; ix++) add_rank(x + ix, y - hy);
     
             }
     
-            out[(x + x0b) + nx * (y + y0b)] = get_median();
+            store(y - y0, x - x0);
 
         }
 
@@ -174,11 +345,9 @@ struct Block {
 
 };
 
-void median_filterv4(const float *input, float *output, int ny, int nx, int hy, int hx) {
+// Pick the block size used to split the image across `num_threads` threads
+static void block_size(int ny, int nx, int num_threads, int &By, int &Bx) {
 
-    // Get number of OpenMP threads
-    int num_threads = omp_get_max_threads();
-    
     // Calculate optimal block sizes for load balancing
     // Target: 2-4 blocks per thread for good load distribution
     int target_blocks = std::max(num_threads * 3, 4);  // At least 4 blocks total
@@ -188,8 +357,8 @@ void median_filterv4(const float *input, float *output, int ny, int nx, int hy,
     int blocks_per_dim = std::max(1, (int)std::sqrt(target_blocks));
     
     // Calculate actual block sizes
-    int Bx = std::max(32, (nx + blocks_per_dim - 1) / blocks_per_dim);  // At least 32 pixels
-    int By = std::max(32, (ny + blocks_per_dim - 1) / blocks_per_dim);  // At least 32 pixels
+    Bx = std::max(32, (nx + blocks_per_dim - 1) / blocks_per_dim);  // At least 32 pixels
+    By = std::max(32, (ny + blocks_per_dim - 1) / blocks_per_dim);  // At least 32 pixels
     
     // For very small images, use the entire image as one block
     if (nx <= 64 && ny <= 64) {
@@ -202,21 +371,196 @@ void median_filterv4(const float *input, float *output, int ny, int nx, int hy,
     Bx = std::min(Bx, std::max(nx / 2, 64));
     By = std::min(By, std::max(ny / 2, 64));
 
-    #pragma omp parallel for collapse(2) schedule(dynamic)
-    for (int y0 = 0; y0 < ny; y0 += By) {
-        for (int x0 = 0; x0 < nx; x0 += Bx) {
+}
+
+struct V4Scratch : MedianScratch {
+    Block block;
+    std::vector<float *> outs;  // rank planes at the block origin
+};
 
-            int x1 = std::min(x0 + Bx - 1, nx - 1);
-            int y1 = std::min(y0 + By - 1, ny - 1);
+static std::vector<MedianTile> v4_tiles(const MedianGeometry &g, int threads) {
 
-            Block block = Block(
-                ny, nx, hy, hx, input,
-                x0, y0, x1, y1
-            );
-        
-            block.compute_median(output);
+    int By, Bx;
+    block_size(g.roi.y1 - g.roi.y0, g.roi.x1 - g.roi.x0, threads, By, Bx);
 
+    std::vector<MedianTile> tiles;
+    for (auto ys : median_split(g.roi.y0, g.roi.y1, By)) {
+        for (auto xs : median_split(g.roi.x0, g.roi.x1, Bx)) {
+            tiles.push_back({ys.first, ys.second, xs.first, xs.second});
         }
     }
+    return tiles;
+
+}
+
+// Reserve room for the largest block including its halo
+static std::unique_ptr<MedianScratch> v4_scratch(const MedianGeometry &g, const std::vector<MedianTile> &tiles) {
+
+    size_t largest = 0;
+    for (const MedianTile &t : tiles) {
+        size_t bx = (t.x1 - t.x0) + 2 * g.hx;
+        size_t by = (t.y1 - t.y0) + 2 * g.hy;
+        largest = std::max(largest, bx * by);
+    }
+
+    auto scratch = std::make_unique<V4Scratch>();
+    scratch->block.sorted.reserve(largest);
+    scratch->block.ranks.reserve(largest);
+    scratch->block.buff.reserve((largest + 63) / 64);
+    return scratch;
+
+}
+
+static void v4_run(MedianScratch *scratch, const float *input, float *output, const MedianGeometry &g, const MedianTile &t) {
+
+    Block &block = static_cast<V4Scratch *>(scratch)->block;
+    block.init(g.ny, g.nx, g.hy, g.hx, input, g.inStride, t.x0, t.y0, t.x1 - 1, t.y1 - 1,
+               nullptr, 0.0f, g.border, median_border_constant<float>(g));
+    block.compute_median(median_output_at(output, g, t.y0, t.x0), g.outStride);
+
+}
+
+const MedianTileEngine<float> median_tiles_v4 = {v4_tiles, v4_scratch, v4_run};
+
+void median_filterv4(const float *input, float *output, int ny, int nx, int hy, int hx, const MedianLayout &layout) {
+
+    median_filter_tiled(median_tiles_v4, input, output, median_geometry(ny, nx, hy, hx, layout));
+
+}
+
+void median_filterv4(const float *input, float *output, int ny, int nx, int hy, int hx) {
+
+    median_filterv4(input, output, ny, nx, hy, hx, median_dense_layout(ny, nx));
+
+}
+
+// Masked variant: mask[i] != 0 marks input[i] as valid. The median is taken
+// over the valid pixels of each window; windows with none are set to `fill`.
+// Under a padding border, padded pixels take the mask of their source pixel
+// and constant pixels are valid.
+void median_filterv4_masked(const float *input, const uint8_t *mask, float *output,
+                            int ny, int nx, int hy, int hx, float fill, const MedianLayout &layout) {
+
+    MedianGeometry g = median_geometry(ny, nx, hy, hx, layout);
+    median_filter_tiled(median_tiles_v4, g, [&](MedianScratch *scratch, const MedianTile &t) {
+        Block &block = static_cast<V4Scratch *>(scratch)->block;
+        block.init(ny, nx, hy, hx, input, g.inStride, t.x0, t.y0, t.x1 - 1, t.y1 - 1,
+                   mask, fill, g.border, median_border_constant<float>(g));
+        block.compute_median(median_output_at(output, g, t.y0, t.x0), g.outStride);
+    });
+
+}
+
+void median_filterv4_masked(const float *input, const uint8_t *mask, float *output,
+                            int ny, int nx, int hy, int hx, float fill) {
+
+    median_filterv4_masked(input, mask, output, ny, nx, hy, hx, fill, median_dense_layout(ny, nx));
+
+}
+
+// Rank filters: the same snake as the median, searching the bit buffer for
+// each requested rank instead of the middle one
+void median_filterv4_ranks(const float *input, float *const *outputs, int ny, int nx, int hy, int hx,
+                           const MedianRank *ranks, int count, const MedianLayout &layout) {
+
+    auto planes = median_sorted_ranks(ranks, outputs, count, hy, hx, "median_filterv4_ranks");
+    if (planes.empty()) return;
+    std::vector<MedianRank> sortedRanks;
+    for (const auto &plane : planes) sortedRanks.push_back(plane.first);
+
+    MedianGeometry g = median_geometry(ny, nx, hy, hx, layout);
+    median_filter_tiled(median_tiles_v4, g, [&](MedianScratch *scratch, const MedianTile &t) {
+        V4Scratch *s = static_cast<V4Scratch *>(scratch);
+        s->block.init(ny, nx, hy, hx, input, g.inStride, t.x0, t.y0, t.x1 - 1, t.y1 - 1,
+                      nullptr, 0.0f, g.border, median_border_constant<float>(g));
+
+        s->outs.clear();
+        for (const auto &plane : planes) s->outs.push_back(median_output_at(plane.second, g, t.y0, t.x0));
+        s->block.compute_ranks(s->outs.data(), g.outStride, sortedRanks.data(), (int)planes.size());
+    });
+
+}
+
+void median_filterv4_ranks(const float *input, float *const *outputs, int ny, int nx, int hy, int hx,
+                           const MedianRank *ranks, int count) {
+
+    median_filterv4_ranks(input, outputs, ny, nx, hy, hx, ranks, count, median_dense_layout(ny, nx));
+
+}
+
+void median_filterv4_rank(const float *input, float *output, int ny, int nx, int hy, int hx, MedianRank rank,
+                          const MedianLayout &layout) {
+
+    median_filterv4_ranks(input, &output, ny, nx, hy, hx, &rank, 1, layout);
+
+}
+
+void median_filterv4_rank(const float *input, float *output, int ny, int nx, int hy, int hx, MedianRank rank) {
+
+    median_filterv4_rank(input, output, ny, nx, hy, hx, rank, median_dense_layout(ny, nx));
+
+}
+
+// Weighted median: each pixel counts weights[(dy + hy) * (2hx + 1) + dx + hx]
+// times. The searches count weight instead of set bits, and a step only
+// updates the pixels whose weight changes.
+void median_filterv4_weighted(const float *input, float *output, int ny, int nx, int hy, int hx, const int *weights,
+                              const MedianLayout &layout) {
+
+    median_check_weights(weights, hy, hx, "median_filterv4_weighted");
+    const std::vector<MedianWeightStep> steps[3] = {
+        median_weight_steps(weights, hy, hx, 0, 1),
+        median_weight_steps(weights, hy, hx, 1, 0),
+        median_weight_steps(weights, hy, hx, -1, 0),
+    };
+
+    MedianGeometry g = median_geometry(ny, nx, hy, hx, layout);
+    median_filter_tiled(median_tiles_v4, g, [&](MedianScratch *scratch, const MedianTile &t) {
+        Block &block = static_cast<V4Scratch *>(scratch)->block;
+        block.init(ny, nx, hy, hx, input, g.inStride, t.x0, t.y0, t.x1 - 1, t.y1 - 1,
+                   nullptr, 0.0f, g.border, median_border_constant<float>(g));
+        block.use_weights();
+
+        float *out = median_output_at(output, g, t.y0, t.x0);
+        block.compute_steps<true>(weights, steps, [&](int y, int x) { out[y * g.outStride + x] = block.get_median<true>(); });
+    });
+
+}
+
+void median_filterv4_weighted(const float *input, float *output, int ny, int nx, int hy, int hx, const int *weights) {
+
+    median_filterv4_weighted(input, output, ny, nx, hy, hx, weights, median_dense_layout(ny, nx));
+
+}
+
+// Footprint median: the window holds the pixels where footprint is non-zero.
+// The snake adds and removes only the entering and leaving pixels of each
+// step, found once from the footprint.
+void median_filterv4_footprint(const float *input, float *output, int ny, int nx, int hy, int hx,
+                               const uint8_t *footprint, const MedianLayout &layout) {
+
+    const std::vector<int> weights = median_footprint_weights(footprint, hy, hx, "median_filterv4_footprint");
+    const std::vector<MedianWeightStep> steps[3] = {
+        median_weight_steps(weights.data(), hy, hx, 0, 1),
+        median_weight_steps(weights.data(), hy, hx, 1, 0),
+        median_weight_steps(weights.data(), hy, hx, -1, 0),
+    };
+
+    MedianGeometry g = median_geometry(ny, nx, hy, hx, layout);
+    median_filter_tiled(median_tiles_v4, g, [&](MedianScratch *scratch, const MedianTile &t) {
+        Block &block = static_cast<V4Scratch *>(scratch)->block;
+        block.init(ny, nx, hy, hx, input, g.inStride, t.x0, t.y0, t.x1 - 1, t.y1 - 1,
+                   nullptr, 0.0f, g.border, median_border_constant<float>(g));
+
+        float *out = median_output_at(output, g, t.y0, t.x0);
+        block.compute_steps<false>(weights.data(), steps, [&](int y, int x) { out[y * g.outStride + x] = block.get_median(); });
+    });
+
+}
+
+void median_filterv4_footprint(const float *input, float *output, int ny, int nx, int hy, int hx,
+                               const uint8_t *footprint) {
+
+    median_filterv4_footprint(input, output, ny, nx, hy, hx, footprint, median_dense_layout(ny, nx));
 
-}
\ No newline at end of file
+}
@@ -2,17 +2,22 @@
 #include <cstdint>
 #include <algorithm>
 #include <cstring>
+#include <cmath>
 
-#ifdef _OPENMP
-#include <omp.h>
-#else
-// Fallback for systems without OpenMP
-inline int omp_get_max_threads() { return 1; }
-#endif
+#include "median_filter_internal.h"
 
 // Histogram-based median filter optimized for uint8_t (0-255) values
 // Uses sliding window with incremental histogram updates for efficiency
 
+// Outputs of a multi-rank filter: outputs[k] receives ranks[k] (sorted by
+// rank) and points at the output of the block origin
+struct RankPlanes {
+    const MedianRank *ranks;
+    uint8_t *const *outputs;
+    int count;
+    int full;   // pixels in an unshrunk window
+};
+
 struct HistogramWindow {
     static constexpr int HIST_SIZE = 256;
     int histogram[HIST_SIZE];
@@ -35,6 +40,12 @@ struct HistogramWindow {
         windowSize--;
     }
     
+    // Change the count of a value by `weight`, which may be negative
+    inline void addWeighted(uint8_t value, int weight) {
+        histogram[value] += weight;
+        windowSize += weight;
+    }
+    
     // Find median from current histogram
     uint8_t getMedian() {
         if (windowSize == 0) return 0;
@@ -82,6 +93,28 @@ struct HistogramWindow {
         return 0;  // Should never reach here with valid input
     }
     
+    // Store the median at output[offset], or with `planes` each requested
+    // rank in its plane; empty windows store `fill`
+    inline void store(uint8_t *output, ptrdiff_t offset, const RankPlanes *planes, uint8_t fill = 0) {
+        if (!planes) {
+            output[offset] = windowSize ? getMedian() : fill;
+            return;
+        }
+        if (windowSize == 0) {
+            for (int k = 0; k < planes->count; k++) planes->outputs[k][offset] = fill;
+            return;
+        }
+        
+        // One cumulative scan serves all ranks, lowest first
+        int count = 0, i = 0;
+        for (int k = 0; k < planes->count; k++) {
+            int target = median_rank_index(planes->ranks[k], windowSize, planes->full);
+            if (target < count) count = i = 0;
+            while (count + histogram[i] <= target) count += histogram[i++];
+            planes->outputs[k][offset] = static_cast<uint8_t>(i);
+        }
+    }
+    
     // Clear the histogram
     void clear() {
         std::memset(histogram, 0, sizeof(histogram));
@@ -90,9 +123,12 @@ struct HistogramWindow {
 };
 
 // Process a single block of the image
-void processBlock(const uint8_t *input, uint8_t *output, 
+// Rows of input are inStride elements apart; output points at the output of
+// (y_start, x_start) with rows outStride elements apart. With `planes` each
+// window yields those order statistics instead of the median.
+void processBlock(const uint8_t *input, ptrdiff_t inStride, uint8_t *output, ptrdiff_t outStride,
                  int ny, int nx, int hy, int hx,
-                 int y_start, int y_end, int x_start, int x_end) {
+                 int y_start, int y_end, int x_start, int x_end, const RankPlanes *planes = nullptr) {
     
     HistogramWindow hist;
     
@@ -104,20 +140,20 @@ void processBlock(const uint8_t *input, uint8_t *output,
             // Build histogram for current window
             for (int dy = std::max(y - hy, 0); dy <= std::min(y + hy, ny - 1); dy++) {
                 for (int dx = std::max(x - hx, 0); dx <= std::min(x + hx, nx - 1); dx++) {
-                    hist.add(input[dy * nx + dx]);
+                    hist.add(input[dy * inStride + dx]);
                 }
             }
             
             // Compute median and store result
-            output[y * nx + x] = hist.getMedian();
+            hist.store(output, (y - y_start) * outStride + (x - x_start), planes);
         }
     }
 }
 
 // Optimized version using row-wise sliding window
-void processBlockOptimized(const uint8_t *input, uint8_t *output, 
+void processBlockOptimized(const uint8_t *input, ptrdiff_t inStride, uint8_t *output, ptrdiff_t outStride,
                           int ny, int nx, int hy, int hx,
-                          int y_start, int y_end, int x_start, int x_end) {
+                          int y_start, int y_end, int x_start, int x_end, const RankPlanes *planes = nullptr) {
     
     HistogramWindow hist;
     
@@ -130,12 +166,12 @@ void processBlockOptimized(const uint8_t *input, uint8_t *output,
         // Build initial histogram for first position in row
         for (int dy = std::max(y - hy, 0); dy <= std::min(y + hy, ny - 1); dy++) {
             for (int dx = std::max(x - hx, 0); dx <= std::min(x + hx, nx - 1); dx++) {
-                hist.add(input[dy * nx + dx]);
+                hist.add(input[dy * inStride + dx]);
             }
         }
         
         // Process first pixel
-        output[y * nx + x] = hist.getMedian();
+        hist.store(output, (y - y_start) * outStride + (x - x_start), planes);
         
         // Slide window horizontally for remaining pixels in row
         for (x = x_start + 1; x < x_end; x++) {
@@ -143,7 +179,7 @@ void processBlockOptimized(const uint8_t *input, uint8_t *output,
             int left_col = x - hx - 1;
             if (left_col >= 0) {
                 for (int dy = std::max(y - hy, 0); dy <= std::min(y + hy, ny - 1); dy++) {
-                    hist.remove(input[dy * nx + left_col]);
+                    hist.remove(input[dy * inStride + left_col]);
                 }
             }
             
@@ -151,49 +187,311 @@ void processBlockOptimized(const uint8_t *input, uint8_t *output,
             int right_col = x + hx;
             if (right_col < nx) {
                 for (int dy = std::max(y - hy, 0); dy <= std::min(y + hy, ny - 1); dy++) {
-                    hist.add(input[dy * nx + right_col]);
+                    hist.add(input[dy * inStride + right_col]);
                 }
             }
             
             // Compute median for current position
-            output[y * nx + x] = hist.getMedian();
+            hist.store(output, (y - y_start) * outStride + (x - x_start), planes);
         }
     }
 }
 
-void median_filterv5(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx) {
-    // For small images or large kernels, use simple approach
-    if (nx <= 64 || ny <= 64 || (2*hx+1) * (2*hy+1) > 128) {
-        processBlock(input, output, ny, nx, hy, hx, 0, ny, 0, nx);
-        return;
+// Sliding window under a padding border mode: rows and columns outside the
+// image are mapped through the virtual padding (or take `constant`), so every
+// window is full and no edge clamping is needed. The optional mask follows
+// the same mapping; constant pixels are always valid. `rows` has room for
+// 2*hy + 1 source row indices. `planes` as in processBlock.
+void processBlockPadded(const uint8_t *input, const uint8_t *mask, ptrdiff_t inStride,
+                        uint8_t *output, ptrdiff_t outStride,
+                        int ny, int nx, int hy, int hx,
+                        int y_start, int y_end, int x_start, int x_end,
+                        MedianBorder border, uint8_t constant, uint8_t fill, int *rows,
+                        const RankPlanes *planes = nullptr) {
+    
+    HistogramWindow hist;
+    
+    // Add (+1) or remove (-1) the window column at virtual x
+    auto column = [&](int x, int sign) {
+        int c = median_border_index(border, x, nx);
+        for (int dy = 0; dy < 2 * hy + 1; dy++) {
+            int r = rows[dy];
+            if (r < 0 || c < 0) {
+                if (sign > 0) hist.add(constant); else hist.remove(constant);
+            } else if (!mask || mask[r * inStride + c]) {
+                uint8_t v = input[r * inStride + c];
+                if (sign > 0) hist.add(v); else hist.remove(v);
+            }
+        }
+    };
+    
+    for (int y = y_start; y < y_end; y++) {
+        hist.clear();
+        for (int dy = -hy; dy <= hy; dy++) rows[dy + hy] = median_border_index(border, y + dy, ny);
+        
+        for (int x = x_start - hx; x <= x_start + hx; x++) column(x, 1);
+        hist.store(output, (y - y_start) * outStride, planes, fill);
+        
+        for (int x = x_start + 1; x < x_end; x++) {
+            column(x - hx - 1, -1);
+            column(x + hx, 1);
+            hist.store(output, (y - y_start) * outStride + (x - x_start), planes, fill);
+        }
     }
+}
+
+// Weighted sliding window: each pixel enters the histogram `weight` times,
+// and a step right applies only the weight changes in `steps` (the entering
+// and leaving pixels plus those whose weight differs from their left
+// neighbour's). Rows and columns outside the image follow `border`, and
+// windows without any weight store 0.
+void processBlockWeighted(const uint8_t *input, ptrdiff_t inStride, uint8_t *output, ptrdiff_t outStride,
+                          int ny, int nx, int hy, int hx,
+                          int y_start, int y_end, int x_start, int x_end, const int *weights,
+                          const std::vector<MedianWeightStep> &steps, MedianBorder border, uint8_t constant) {
     
-    // Get number of OpenMP threads
-    int num_threads = omp_get_max_threads();
+    HistogramWindow hist;
+    
+    // Add `weight` copies of virtual pixel (y, x)
+    auto pixel = [&](int y, int x, int weight) {
+        int r = median_border_index(border, y, ny), c = median_border_index(border, x, nx);
+        if (r >= 0 && c >= 0) {
+            hist.addWeighted(input[r * inStride + c], weight);
+        } else if (border != MedianBorder::Shrink) {
+            hist.addWeighted(constant, weight);
+        }
+    };
+    
+    for (int y = y_start; y < y_end; y++) {
+        hist.clear();
+        for (int dy = -hy; dy <= hy; dy++) {
+            for (int dx = -hx; dx <= hx; dx++) {
+                int w = weights[(dy + hy) * (2 * hx + 1) + (dx + hx)];
+                if (w) pixel(y + dy, x_start + dx, w);
+            }
+        }
+        hist.store(output, (y - y_start) * outStride, nullptr);
+        
+        for (int x = x_start + 1; x < x_end; x++) {
+            for (const MedianWeightStep &s : steps) pixel(y + s.dy, x - 1 + s.dx, s.delta);
+            hist.store(output, (y - y_start) * outStride + (x - x_start), nullptr);
+        }
+    }
+}
+
+// For small images or large kernels, use simple approach
+static bool useSimple(const MedianGeometry &g) {
+    int h = g.roi.y1 - g.roi.y0, w = g.roi.x1 - g.roi.x0;
+    return w <= 64 || h <= 64 || (2*g.hx+1) * (2*g.hy+1) > 128;
+}
+
+// Block layout shared by the plain and masked filters
+static std::vector<MedianTile> v5_blocks(const MedianGeometry &g, int num_threads) {
     
     // Calculate optimal block sizes for load balancing
     int target_blocks = std::max(num_threads * 2, 4);
     int blocks_per_dim = std::max(1, (int)std::sqrt(target_blocks));
     
     // Calculate actual block sizes (prefer larger blocks for better sliding window efficiency)
-    int By = std::max(64, (ny + blocks_per_dim - 1) / blocks_per_dim);
-    int Bx = std::max(64, (nx + blocks_per_dim - 1) / blocks_per_dim);
-    
-    // Process image in parallel blocks
-#ifdef _OPENMP
-    #pragma omp parallel for collapse(2) schedule(dynamic)
-#endif
-    for (int by = 0; by < ny; by += By) {
-        for (int bx = 0; bx < nx; bx += Bx) {
-            int y_end = std::min(by + By, ny);
-            int x_end = std::min(bx + Bx, nx);
+    int By = std::max(64, (g.roi.y1 - g.roi.y0 + blocks_per_dim - 1) / blocks_per_dim);
+    int Bx = std::max(64, (g.roi.x1 - g.roi.x0 + blocks_per_dim - 1) / blocks_per_dim);
+    
+    std::vector<MedianTile> tiles;
+    for (auto ys : median_split(g.roi.y0, g.roi.y1, By)) {
+        for (auto xs : median_split(g.roi.x0, g.roi.x1, Bx)) {
+            tiles.push_back({ys.first, ys.second, xs.first, xs.second});
+        }
+    }
+    return tiles;
+}
+
+static std::vector<MedianTile> v5_tiles(const MedianGeometry &g, int num_threads) {
+    if (useSimple(g)) return {g.roi};
+    return v5_blocks(g, num_threads);
+}
+
+// The histogram lives on the stack; padding borders need the row map
+struct V5Scratch : MedianScratch {
+    std::vector<int> rows;
+    std::vector<uint8_t *> outs;    // rank planes at the block origin
+};
+
+static std::unique_ptr<MedianScratch> v5_scratch(const MedianGeometry &g, const std::vector<MedianTile> &) {
+    auto scratch = std::make_unique<V5Scratch>();
+    if (g.border != MedianBorder::Shrink) scratch->rows.resize(2 * g.hy + 1);
+    return scratch;
+}
+
+static void v5_run(MedianScratch *scratch, const uint8_t *input, uint8_t *output, const MedianGeometry &g, const MedianTile &t) {
+    uint8_t *out = median_output_at(output, g, t.y0, t.x0);
+    if (g.border != MedianBorder::Shrink) {
+        processBlockPadded(input, nullptr, g.inStride, out, g.outStride, g.ny, g.nx, g.hy, g.hx,
+                           t.y0, t.y1, t.x0, t.x1, g.border, median_border_constant<uint8_t>(g), 0,
+                           static_cast<V5Scratch *>(scratch)->rows.data());
+    // Use optimized sliding window for larger blocks
+    } else if (!useSimple(g) && (t.x1 - t.x0) >= 32) {
+        processBlockOptimized(input, g.inStride, out, g.outStride, g.ny, g.nx, g.hy, g.hx, t.y0, t.y1, t.x0, t.x1);
+    } else {
+        processBlock(input, g.inStride, out, g.outStride, g.ny, g.nx, g.hy, g.hx, t.y0, t.y1, t.x0, t.x1);
+    }
+}
+
+const MedianTileEngine<uint8_t> median_tiles_v5 = {v5_tiles, v5_scratch, v5_run};
+
+void median_filterv5(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx, const MedianLayout &layout) {
+    median_filter_tiled(median_tiles_v5, input, output, median_geometry(ny, nx, hy, hx, layout));
+}
+
+void median_filterv5(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx) {
+    median_filterv5(input, output, ny, nx, hy, hx, median_dense_layout(ny, nx));
+}
+
+// Mask-aware sliding window: pixels whose mask entry is zero never enter the
+// histogram, so the median is taken over the valid neighbours only. A window
+// without any valid pixel produces `fill`.
+void processBlockMasked(const uint8_t *input, const uint8_t *mask, ptrdiff_t inStride,
+                        uint8_t *output, ptrdiff_t outStride, int ny, int nx, int hy, int hx,
+                        int y_start, int y_end, int x_start, int x_end, uint8_t fill) {
+    
+    HistogramWindow hist;
+    
+    for (int y = y_start; y < y_end; y++) {
+        hist.clear();
+        
+        int y_lo = std::max(y - hy, 0);
+        int y_hi = std::min(y + hy, ny - 1);
+        
+        // Build initial histogram for first position in row
+        for (int dy = y_lo; dy <= y_hi; dy++) {
+            for (int dx = std::max(x_start - hx, 0); dx <= std::min(x_start + hx, nx - 1); dx++) {
+                if (mask[dy * inStride + dx]) hist.add(input[dy * inStride + dx]);
+            }
+        }
+        
+        output[(y - y_start) * outStride] = hist.windowSize ? hist.getMedian() : fill;
+        
+        for (int x = x_start + 1; x < x_end; x++) {
+            // Remove left column of previous window
+            int left_col = x - hx - 1;
+            if (left_col >= 0) {
+                for (int dy = y_lo; dy <= y_hi; dy++) {
+                    if (mask[dy * inStride + left_col]) hist.remove(input[dy * inStride + left_col]);
+                }
+            }
             
-            // Use optimized sliding window for larger blocks
-            if ((x_end - bx) >= 32) {
-                processBlockOptimized(input, output, ny, nx, hy, hx, by, y_end, bx, x_end);
-            } else {
-                processBlock(input, output, ny, nx, hy, hx, by, y_end, bx, x_end);
+            // Add right column of new window
+            int right_col = x + hx;
+            if (right_col < nx) {
+                for (int dy = y_lo; dy <= y_hi; dy++) {
+                    if (mask[dy * inStride + right_col]) hist.add(input[dy * inStride + right_col]);
+                }
             }
+            
+            output[(y - y_start) * outStride + (x - x_start)] = hist.windowSize ? hist.getMedian() : fill;
         }
     }
-}
\ No newline at end of file
+}
+
+// Masked median filter: mask[i] != 0 marks input[i] as valid. Invalid pixels
+// are skipped during add/remove, and fully masked windows are set to `fill`.
+void median_filterv5_masked(const uint8_t *input, const uint8_t *mask, uint8_t *output,
+                            int ny, int nx, int hy, int hx, uint8_t fill, const MedianLayout &layout) {
+    
+    // Masked windows always slide, so small images and large kernels are
+    // split into blocks too; the tile body is this function's
+    static const MedianTileEngine<uint8_t> masked = {v5_blocks, v5_scratch, nullptr};
+    
+    MedianGeometry g = median_geometry(ny, nx, hy, hx, layout);
+    median_filter_tiled(masked, g, [&](MedianScratch *scratch, const MedianTile &t) {
+        uint8_t *out = median_output_at(output, g, t.y0, t.x0);
+        if (g.border != MedianBorder::Shrink) {
+            processBlockPadded(input, mask, g.inStride, out, g.outStride, ny, nx, hy, hx,
+                               t.y0, t.y1, t.x0, t.x1, g.border, median_border_constant<uint8_t>(g), fill,
+                               static_cast<V5Scratch *>(scratch)->rows.data());
+        } else {
+            processBlockMasked(input, mask, g.inStride, out, g.outStride,
+                               ny, nx, hy, hx, t.y0, t.y1, t.x0, t.x1, fill);
+        }
+    });
+}
+
+void median_filterv5_masked(const uint8_t *input, const uint8_t *mask, uint8_t *output,
+                            int ny, int nx, int hy, int hx, uint8_t fill) {
+    median_filterv5_masked(input, mask, output, ny, nx, hy, hx, fill, median_dense_layout(ny, nx));
+}
+
+// Rank filters: the v5 sliding windows with the cumulative scan stopping at
+// each requested rank instead of the middle one
+void median_filterv5_ranks(const uint8_t *input, uint8_t *const *outputs, int ny, int nx, int hy, int hx,
+                           const MedianRank *ranks, int count, const MedianLayout &layout) {
+    
+    auto sorted = median_sorted_ranks(ranks, outputs, count, hy, hx, "median_filterv5_ranks");
+    if (sorted.empty()) return;
+    std::vector<MedianRank> sortedRanks;
+    for (const auto &plane : sorted) sortedRanks.push_back(plane.first);
+    
+    MedianGeometry g = median_geometry(ny, nx, hy, hx, layout);
+    median_filter_tiled(median_tiles_v5, g, [&](MedianScratch *scratch, const MedianTile &t) {
+        V5Scratch *s = static_cast<V5Scratch *>(scratch);
+        std::vector<uint8_t *> &outs = s->outs;
+        outs.clear();
+        for (const auto &plane : sorted) outs.push_back(median_output_at(plane.second, g, t.y0, t.x0));
+        RankPlanes planes = {sortedRanks.data(), outs.data(), (int)outs.size(), (2 * hy + 1) * (2 * hx + 1)};
+        
+        if (g.border != MedianBorder::Shrink) {
+            processBlockPadded(input, nullptr, g.inStride, outs[0], g.outStride, ny, nx, hy, hx,
+                               t.y0, t.y1, t.x0, t.x1, g.border, median_border_constant<uint8_t>(g), 0,
+                               s->rows.data(), &planes);
+        } else if (!useSimple(g) && (t.x1 - t.x0) >= 32) {
+            processBlockOptimized(input, g.inStride, outs[0], g.outStride, ny, nx, hy, hx,
+                                  t.y0, t.y1, t.x0, t.x1, &planes);
+        } else {
+            processBlock(input, g.inStride, outs[0], g.outStride, ny, nx, hy, hx, t.y0, t.y1, t.x0, t.x1, &planes);
+        }
+    });
+}
+
+void median_filterv5_ranks(const uint8_t *input, uint8_t *const *outputs, int ny, int nx, int hy, int hx,
+                           const MedianRank *ranks, int count) {
+    median_filterv5_ranks(input, outputs, ny, nx, hy, hx, ranks, count, median_dense_layout(ny, nx));
+}
+
+void median_filterv5_rank(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx, MedianRank rank,
+                          const MedianLayout &layout) {
+    median_filterv5_ranks(input, &output, ny, nx, hy, hx, &rank, 1, layout);
+}
+
+void median_filterv5_rank(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx, MedianRank rank) {
+    median_filterv5_rank(input, output, ny, nx, hy, hx, rank, median_dense_layout(ny, nx));
+}
+
+// Weighted median: weighted histogram increments over the v5 blocks
+void median_filterv5_weighted(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx, const int *weights,
+                              const MedianLayout &layout) {
+    
+    median_check_weights(weights, hy, hx, "median_filterv5_weighted");
+    const std::vector<MedianWeightStep> steps = median_weight_steps(weights, hy, hx, 0, 1);
+    
+    MedianGeometry g = median_geometry(ny, nx, hy, hx, layout);
+    median_filter_tiled(median_tiles_v5, g, [&](MedianScratch *, const MedianTile &t) {
+        processBlockWeighted(input, g.inStride, median_output_at(output, g, t.y0, t.x0), g.outStride, ny, nx, hy, hx,
+                             t.y0, t.y1, t.x0, t.x1, weights, steps, g.border, median_border_constant<uint8_t>(g));
+    });
+}
+
+void median_filterv5_weighted(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx, const int *weights) {
+    median_filterv5_weighted(input, output, ny, nx, hy, hx, weights, median_dense_layout(ny, nx));
+}
+
+// Footprint median: a weighted window with weights 0 and 1, so each step
+// adds and removes only the pixels crossing the footprint boundary
+void median_filterv5_footprint(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx,
+                               const uint8_t *footprint, const MedianLayout &layout) {
+    const std::vector<int> weights = median_footprint_weights(footprint, hy, hx, "median_filterv5_footprint");
+    median_filterv5_weighted(input, output, ny, nx, hy, hx, weights.data(), layout);
+}
+
+void median_filterv5_footprint(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx,
+                               const uint8_t *footprint) {
+    median_filterv5_footprint(input, output, ny, nx, hy, hx, footprint, median_dense_layout(ny, nx));
+}
@@ -0,0 +1,477 @@
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <atomic>
+#include <memory>
+
+#include "median_filter_internal.h"
+
+// Histogram-based median filter for 16-bit keys (uint16, fp16 and bf16 images)
+// Every input value is mapped to an order-preserving uint16 key, so the same
+// sliding two-level histogram serves all three types without widening.
+
+// Two-level histogram: 256 coarse bins, each covering 256 fine bins
+struct Histogram16 {
+    static constexpr int COARSE = 256;
+    static constexpr int FINE = 65536;
+    int coarse[COARSE];
+    std::vector<int> fine;
+    int windowSize;
+
+    Histogram16() : fine(FINE, 0), windowSize(0) {
+        std::memset(coarse, 0, sizeof(coarse));
+    }
+
+    inline void add(uint16_t key) {
+        coarse[key >> 8]++;
+        fine[key]++;
+        windowSize++;
+    }
+
+    inline void remove(uint16_t key) {
+        coarse[key >> 8]--;
+        fine[key]--;
+        windowSize--;
+    }
+
+    // Key of the element with 0-indexed rank `target`
+    int kth(int target) const {
+        int count = 0;
+        int c = 0;
+        while (count + coarse[c] <= target) count += coarse[c++];
+        int k = c << 8;
+        while (count + fine[k] <= target) count += fine[k++];
+        return k;
+    }
+};
+
+// IEEE binary16 <-> float conversion (round to nearest even)
+static inline float half_to_float(uint16_t h) {
+    uint32_t sign = uint32_t(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1F;
+    uint32_t mant = h & 0x3FF;
+    uint32_t bits;
+    if (exp == 0x1F) {
+        bits = sign | 0x7F800000 | (mant << 13);
+    } else if (exp != 0) {
+        bits = sign | ((exp + 112) << 23) | (mant << 13);
+    } else if (mant == 0) {
+        bits = sign;
+    } else {
+        // Subnormal half: normalize into a float
+        int e = -1;
+        do { mant <<= 1; e++; } while (!(mant & 0x400));
+        bits = sign | (uint32_t(112 - e) << 23) | ((mant & 0x3FF) << 13);
+    }
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static inline uint16_t float_to_half(float f) {
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    uint16_t sign = (bits >> 16) & 0x8000;
+    int32_t exp = int32_t((bits >> 23) & 0xFF) - 127 + 15;
+    uint32_t mant = bits & 0x7FFFFF;
+
+    if (((bits >> 23) & 0xFF) == 0xFF) {
+        return sign | 0x7C00 | (mant ? 0x200 : 0);
+    }
+    if (exp >= 0x1F) return sign | 0x7C00;
+    if (exp <= 0) {
+        // Result is subnormal (or zero) in half precision
+        if (exp < -10) return sign;
+        mant |= 0x800000;
+        int shift = 14 - exp;
+        uint32_t half_mant = mant >> shift;
+        uint32_t rem = mant & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rem > halfway || (rem == halfway && (half_mant & 1))) half_mant++;
+        return sign | half_mant;
+    }
+    uint32_t half = (uint32_t(exp) << 10) | (mant >> 13);
+    uint32_t rem = mant & 0x1FFF;
+    if (rem > 0x1000 || (rem == 0x1000 && (half & 1))) half++;  // may carry into the exponent
+    return sign | half;
+}
+
+// bfloat16 is the upper half of a float
+static inline float bf16_to_float(uint16_t h) {
+    uint32_t bits = uint32_t(h) << 16;
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static inline uint16_t float_to_bf16(float f) {
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    if ((bits & 0x7F800000) == 0x7F800000 && (bits & 0x7FFFFF)) {
+        return (bits >> 16) | 0x40;  // keep NaNs quiet
+    }
+    bits += 0x7FFF + ((bits >> 16) & 1);
+    return bits >> 16;
+}
+
+// Sign-magnitude floats become order-preserving unsigned keys by flipping
+// every bit of negatives and only the sign bit of positives
+static inline uint16_t float_bits_to_key(uint16_t b) {
+    return (b & 0x8000) ? uint16_t(~b) : uint16_t(b | 0x8000);
+}
+
+static inline uint16_t key_to_float_bits(uint16_t k) {
+    return (k & 0x8000) ? uint16_t(k & 0x7FFF) : uint16_t(~k);
+}
+
+// Codecs map input values to keys and middle keys back to output values;
+// encode() gives the element for a constant border value
+struct Uint16Codec {
+    inline uint16_t encode(double v) const { return uint16_t(std::min(std::max(std::round(v), 0.0), 65535.0)); }
+    inline uint16_t key(uint16_t v) const { return v; }
+    inline uint16_t value(int k) const { return uint16_t(k); }
+    inline uint16_t value(int k1, int k2) const { return uint16_t((k1 + k2 + 1) / 2); }
+};
+
+struct HalfCodec {
+    inline uint16_t encode(double v) const { return float_to_half(float(v)); }
+    inline uint16_t key(uint16_t v) const { return float_bits_to_key(v); }
+    inline uint16_t value(int k) const { return key_to_float_bits(uint16_t(k)); }
+    inline uint16_t value(int k1, int k2) const {
+        double a = half_to_float(key_to_float_bits(uint16_t(k1)));
+        double b = half_to_float(key_to_float_bits(uint16_t(k2)));
+        return float_to_half(float(0.5 * (a + b)));
+    }
+};
+
+struct BFloat16Codec {
+    inline uint16_t encode(double v) const { return float_to_bf16(float(v)); }
+    inline uint16_t key(uint16_t v) const { return float_bits_to_key(v); }
+    inline uint16_t value(int k) const { return key_to_float_bits(uint16_t(k)); }
+    inline uint16_t value(int k1, int k2) const {
+        double a = bf16_to_float(key_to_float_bits(uint16_t(k1)));
+        double b = bf16_to_float(key_to_float_bits(uint16_t(k2)));
+        return float_to_bf16(float(0.5 * (a + b)));
+    }
+};
+
+// Uniform quantizer for the approximate float mode: key k covers
+// [lo + k * width, lo + (k + 1) * width) and decodes to the bin centre.
+// Every key an output is decoded from gets marked in `used`.
+struct QuantizedCodec {
+    double lo, width, inv_width;
+    int maxKey;
+    std::atomic<uint8_t> *used;
+
+    inline float encode(double v) const { return float(v); }
+    inline uint16_t key(float v) const {
+        double q = std::floor((double(v) - lo) * inv_width);
+        if (!(q >= 0)) return 0;  // also catches NaN
+        return uint16_t(std::min(q, double(maxKey)));
+    }
+    inline double centre(int k) const { return lo + (k + 0.5) * width; }
+    inline float value(int k) const {
+        mark(k);
+        return float(centre(k));
+    }
+    inline float value(int k1, int k2) const {
+        mark(k1);
+        mark(k2);
+        return float(lo + (0.5 * (k1 + k2) + 0.5) * width);
+    }
+    // Read first, so that threads stop writing a key once it is marked
+    inline void mark(int k) const {
+        if (!used[k].load(std::memory_order_relaxed)) used[k].store(1, std::memory_order_relaxed);
+    }
+};
+
+template <typename Out, typename Codec>
+static inline Out histMedian(const Histogram16 &hist, const Codec &codec) {
+    int n = hist.windowSize;
+    if (n % 2 == 1) return codec.value(hist.kth(n / 2));
+    return codec.value(hist.kth(n / 2 - 1), hist.kth(n / 2));
+}
+
+// Row-wise sliding window over one block; the histogram is emptied again at
+// the end of every row so it never has to be cleared. Rows of input are
+// inStride elements apart; output points at the output of (y_start, x_start).
+template <typename In, typename Out, typename Codec>
+static void processBlock16(const In *input, ptrdiff_t inStride, Out *output, ptrdiff_t outStride,
+                           int ny, int nx, int hy, int hx,
+                           int y_start, int y_end, int x_start, int x_end,
+                           Histogram16 &hist, const Codec &codec) {
+
+    for (int y = y_start; y < y_end; y++) {
+        int y_lo = std::max(y - hy, 0);
+        int y_hi = std::min(y + hy, ny - 1);
+
+        // Build initial histogram for first position in row
+        for (int dy = y_lo; dy <= y_hi; dy++) {
+            for (int dx = std::max(x_start - hx, 0); dx <= std::min(x_start + hx, nx - 1); dx++) {
+                hist.add(codec.key(input[dy * inStride + dx]));
+            }
+        }
+
+        output[(y - y_start) * outStride] = histMedian<Out>(hist, codec);
+
+        for (int x = x_start + 1; x < x_end; x++) {
+            // Remove left column of previous window
+            int left_col = x - hx - 1;
+            if (left_col >= 0) {
+                for (int dy = y_lo; dy <= y_hi; dy++) hist.remove(codec.key(input[dy * inStride + left_col]));
+            }
+
+            // Add right column of new window
+            int right_col = x + hx;
+            if (right_col < nx) {
+                for (int dy = y_lo; dy <= y_hi; dy++) hist.add(codec.key(input[dy * inStride + right_col]));
+            }
+
+            output[(y - y_start) * outStride + (x - x_start)] = histMedian<Out>(hist, codec);
+        }
+
+        // Drain the last window of the row
+        for (int dx = std::max(x_end - 1 - hx, 0); dx <= std::min(x_end - 1 + hx, nx - 1); dx++) {
+            for (int dy = y_lo; dy <= y_hi; dy++) hist.remove(codec.key(input[dy * inStride + dx]));
+        }
+    }
+}
+
+// Sliding window under a padding border mode: every window is full and rows
+// and columns outside the image go through the virtual padding. `rows` has
+// room for 2*hy + 1 source row indices.
+template <typename In, typename Out, typename Codec>
+static void processBlockPadded16(const In *input, ptrdiff_t inStride, Out *output, ptrdiff_t outStride,
+                                 int ny, int nx, int hy, int hx,
+                                 int y_start, int y_end, int x_start, int x_end,
+                                 MedianBorder border, uint16_t constantKey,
+                                 Histogram16 &hist, const Codec &codec, int *rows) {
+
+    // Add (+1) or remove (-1) the window column at virtual x
+    auto column = [&](int x, int sign) {
+        int c = median_border_index(border, x, nx);
+        for (int dy = 0; dy < 2 * hy + 1; dy++) {
+            int r = rows[dy];
+            uint16_t k = (r < 0 || c < 0) ? constantKey : codec.key(input[r * inStride + c]);
+            if (sign > 0) hist.add(k); else hist.remove(k);
+        }
+    };
+
+    for (int y = y_start; y < y_end; y++) {
+        for (int dy = -hy; dy <= hy; dy++) rows[dy + hy] = median_border_index(border, y + dy, ny);
+
+        for (int x = x_start - hx; x <= x_start + hx; x++) column(x, 1);
+        output[(y - y_start) * outStride] = histMedian<Out>(hist, codec);
+
+        for (int x = x_start + 1; x < x_end; x++) {
+            column(x - hx - 1, -1);
+            column(x + hx, 1);
+            output[(y - y_start) * outStride + (x - x_start)] = histMedian<Out>(hist, codec);
+        }
+
+        // Drain the last window of the row
+        for (int x = x_end - 1 - hx; x <= x_end - 1 + hx; x++) column(x, -1);
+    }
+}
+
+// Horizontal bands keep the sliding rows long
+static std::vector<MedianTile> v6_tiles(const MedianGeometry &g, int num_threads) {
+
+    int target_blocks = std::max(num_threads * 2, 1);
+    int By = std::max(16, (g.roi.y1 - g.roi.y0 + target_blocks - 1) / target_blocks);
+
+    std::vector<MedianTile> tiles;
+    for (auto ys : median_split(g.roi.y0, g.roi.y1, By)) tiles.push_back({ys.first, ys.second, g.roi.x0, g.roi.x1});
+    return tiles;
+}
+
+// The fine histogram level is 256KB, so it is allocated once per thread
+struct V6Scratch : MedianScratch {
+    Histogram16 hist;
+    std::vector<int> rows;   // row map of padding borders
+};
+
+static std::unique_ptr<MedianScratch> v6_scratch(const MedianGeometry &g, const std::vector<MedianTile> &) {
+    auto scratch = std::make_unique<V6Scratch>();
+    scratch->rows.resize(2 * g.hy + 1);
+    return scratch;
+}
+
+template <typename In, typename Out, typename Codec>
+static void v6_run_codec(MedianScratch *scratch, const In *input, Out *output,
+                         const MedianGeometry &g, const MedianTile &t, const Codec &codec) {
+    V6Scratch *s = static_cast<V6Scratch *>(scratch);
+    Out *out = median_output_at(output, g, t.y0, t.x0);
+    if (g.border != MedianBorder::Shrink) {
+        processBlockPadded16(input, g.inStride, out, g.outStride, g.ny, g.nx, g.hy, g.hx,
+                             t.y0, t.y1, t.x0, t.x1, g.border, codec.key(codec.encode(g.borderValue)),
+                             s->hist, codec, s->rows.data());
+    } else {
+        processBlock16(input, g.inStride, out, g.outStride, g.ny, g.nx, g.hy, g.hx,
+                       t.y0, t.y1, t.x0, t.x1, s->hist, codec);
+    }
+}
+
+static void v6_run(MedianScratch *scratch, const uint16_t *input, uint16_t *output,
+                   const MedianGeometry &g, const MedianTile &t) {
+    v6_run_codec(scratch, input, output, g, t, Uint16Codec());
+}
+
+const MedianTileEngine<uint16_t> median_tiles_v6 = {v6_tiles, v6_scratch, v6_run};
+
+template <typename In, typename Out, typename Codec>
+static void median_filter16(const In *input, Out *output, const MedianGeometry &g, const Codec &codec) {
+
+    median_filter_tiled(median_tiles_v6, g, [&](MedianScratch *scratch, const MedianTile &t) {
+        v6_run_codec(scratch, input, output, g, t, codec);
+    });
+}
+
+// Median filter for uint16_t images (0-65535 values)
+void median_filterv6(const uint16_t *input, uint16_t *output, int ny, int nx, int hy, int hx, const MedianLayout &layout) {
+    median_filter16(input, output, median_geometry(ny, nx, hy, hx, layout), Uint16Codec());
+}
+
+void median_filterv6(const uint16_t *input, uint16_t *output, int ny, int nx, int hy, int hx) {
+    median_filterv6(input, output, ny, nx, hy, hx, median_dense_layout(ny, nx));
+}
+
+// Median filter for IEEE half precision images stored as raw uint16_t bit patterns.
+// Odd windows return an input value bit-exactly; even windows return the
+// average of the two middle values rounded to nearest even.
+void median_filterv6_fp16(const uint16_t *input, uint16_t *output, int ny, int nx, int hy, int hx, const MedianLayout &layout) {
+    median_filter16(input, output, median_geometry(ny, nx, hy, hx, layout), HalfCodec());
+}
+
+void median_filterv6_fp16(const uint16_t *input, uint16_t *output, int ny, int nx, int hy, int hx) {
+    median_filterv6_fp16(input, output, ny, nx, hy, hx, median_dense_layout(ny, nx));
+}
+
+// Median filter for bfloat16 images stored as raw uint16_t bit patterns
+void median_filterv6_bf16(const uint16_t *input, uint16_t *output, int ny, int nx, int hy, int hx, const MedianLayout &layout) {
+    median_filter16(input, output, median_geometry(ny, nx, hy, hx, layout), BFloat16Codec());
+}
+
+void median_filterv6_bf16(const uint16_t *input, uint16_t *output, int ny, int nx, int hy, int hx) {
+    median_filterv6_bf16(input, output, ny, nx, hy, hx, median_dense_layout(ny, nx));
+}
+
+// Approximate float median: the dynamic range of the pixels the ROI's windows
+// can reach is quantized into just
+// enough bins (at most 65536) that every output is within `tolerance` of the
+// exact median, and the 16-bit histogram engine runs on the bin indices.
+// The median of a window lies in the bin the output decodes from (for even
+// windows, the two bins averaged), so an output is off by at most the
+// distance from that bin's centre to its farthest input value; the largest
+// such distance over the bins the outputs came from, plus float rounding,
+// is returned (<= tolerance). If the tolerance cannot be met
+// with 65536 bins the exact filter runs instead and 0 is returned.
+float median_filterv6_approx(const float *input, float *output, int ny, int nx, int hy, int hx, float tolerance,
+                             const MedianLayout &layout) {
+
+    MedianGeometry g = median_geometry(ny, nx, hy, hx, layout);
+
+    // Per-thread range of the ROI and its halo, reduced afterwards. Wrapped
+    // and reflected windows can reach anywhere in the image.
+    int y0 = std::max(g.roi.y0 - hy, 0), y1 = std::min(g.roi.y1 + hy, ny);
+    int x0 = std::max(g.roi.x0 - hx, 0), x1 = std::min(g.roi.x1 + hx, nx);
+    if (g.border == MedianBorder::Wrap || g.border == MedianBorder::Reflect) {
+        y0 = 0; y1 = ny; x0 = 0; x1 = nx;
+    }
+    int threads = median_threads(g);
+    std::vector<float> thread_lo(threads, std::numeric_limits<float>::infinity());
+    std::vector<float> thread_hi(threads, -std::numeric_limits<float>::infinity());
+
+    median_parallel_for(std::max(y1 - y0, 0), g, [&](int i, int thread) {
+        const float *row = input + (y0 + i) * g.inStride;
+        float l = thread_lo[thread], h = thread_hi[thread];
+        for (int x = x0; x < x1; x++) {
+            l = std::min(l, row[x]);
+            h = std::max(h, row[x]);
+        }
+        thread_lo[thread] = l;
+        thread_hi[thread] = h;
+    });
+
+    float lo = *std::min_element(thread_lo.begin(), thread_lo.end());
+    float hi = *std::max_element(thread_hi.begin(), thread_hi.end());
+
+    // Windows past the image border may also hold the constant
+    if (g.border == MedianBorder::Constant) {
+        lo = std::min(lo, float(g.borderValue));
+        hi = std::max(hi, float(g.borderValue));
+    }
+
+    if (!(lo <= hi)) {
+        // Empty image or no finite ordering (all NaN): nothing to quantize
+        median_filterv3(input, output, ny, nx, hy, hx, layout);
+        return 0.0f;
+    }
+
+    // Outputs are bin centres rounded to float, and even windows compare
+    // against a float average, so one ulp of the largest magnitude is
+    // reserved for rounding
+    float big = std::max(std::fabs(lo), std::fabs(hi));
+    double slack = std::nextafter(big, std::numeric_limits<float>::infinity()) - big;
+    double half_width = double(tolerance) - slack;
+    double range = double(hi) - double(lo);
+    double bins = range > 0 ? std::ceil(range / (2.0 * half_width)) : 1.0;
+
+    if (!(half_width > 0) || !(bins <= Histogram16::FINE)) {
+        median_filterv3(input, output, ny, nx, hy, hx, layout);
+        return 0.0f;
+    }
+
+    QuantizedCodec codec;
+    codec.lo = lo;
+    codec.width = range > 0 ? range / bins : 0.0;
+    codec.inv_width = range > 0 ? bins / range : 0.0;
+    codec.maxKey = int(bins) - 1;
+
+    const int keys = codec.maxKey + 1;
+    std::unique_ptr<std::atomic<uint8_t>[]> used(new std::atomic<uint8_t>[keys]);
+    for (int k = 0; k < keys; k++) used[k] = 0;
+    codec.used = used.get();
+
+    median_filter16(input, output, g, codec);
+
+    // Value range of every bin, per thread as above
+    std::vector<std::vector<float>> thread_bin_lo(threads), thread_bin_hi(threads);
+    median_parallel_for(std::max(y1 - y0, 0), g, [&](int i, int thread) {
+        std::vector<float> &bin_lo = thread_bin_lo[thread], &bin_hi = thread_bin_hi[thread];
+        if (bin_lo.empty()) {
+            bin_lo.assign(keys, std::numeric_limits<float>::infinity());
+            bin_hi.assign(keys, -std::numeric_limits<float>::infinity());
+        }
+        const float *row = input + (y0 + i) * g.inStride;
+        for (int x = x0; x < x1; x++) {
+            int k = codec.key(row[x]);
+            bin_lo[k] = std::min(bin_lo[k], row[x]);
+            bin_hi[k] = std::max(bin_hi[k], row[x]);
+        }
+    });
+
+    double error = 0.0;
+    auto reach = [&](int k, float l, float h) {
+        if (used[k] && l <= h) error = std::max(error, std::max(codec.centre(k) - l, h - codec.centre(k)));
+    };
+    for (int t = 0; t < threads; t++) {
+        for (int k = 0; k < (int)thread_bin_lo[t].size(); k++) reach(k, thread_bin_lo[t][k], thread_bin_hi[t][k]);
+    }
+    if (g.border == MedianBorder::Constant) {
+        float c = float(g.borderValue);
+        reach(codec.key(c), c, c);
+    }
+
+    // Round up so the bound still holds in float
+    double bound = std::min(error + slack, double(tolerance));
+    float result = float(bound);
+    return result < bound ? std::nextafter(result, std::numeric_limits<float>::infinity()) : result;
+}
+
+float median_filterv6_approx(const float *input, float *output, int ny, int nx, int hy, int hx, float tolerance) {
+    return median_filterv6_approx(input, output, ny, nx, hy, hx, tolerance, median_dense_layout(ny, nx));
+}
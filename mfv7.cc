@@ -0,0 +1,390 @@
+#include "median_filter_internal.h"
+
+#include <stdexcept>
+
+// 1D median filter for signals and 1 x N / N x 1 kernels (float, uint8, uint16)
+//
+// Every line (a row for hy == 0, a column for hx == 0, or a whole signal) is
+// cut into segments that are filtered in parallel, each starting its window
+// from its own halo. A window slides by replacing its leaving sample with its
+// entering one: for float and uint16 a double heap (max-heap of the lower
+// half, min-heap of the upper half, every sample locatable by its ring slot)
+// does this in O(log w); for uint8 a histogram with a coarse cursor does it
+// in O(1) plus a scan of at most 16 bins. (A uint16 histogram has 256-bin
+// scans, slower than the heaps at every window size.) Columns are gathered a
+// block at a time into transposed line buffers, so both directions slide
+// over contiguous memory.
+
+namespace {
+
+// Double heap over the ring slots of a window of up to `capacity` samples
+template <typename T>
+struct HeapWindow {
+    std::vector<T> value;           // by slot
+    std::vector<int> lo, hi;        // slots; lo is a max-heap, hi a min-heap
+    std::vector<int> index;         // by slot: position in lo (>= 0) or hi (~position)
+    int nlo = 0, nhi = 0;
+
+    void begin(int capacity) {
+        value.resize(capacity);
+        lo.resize(capacity);
+        hi.resize(capacity);
+        index.resize(capacity);
+        nlo = nhi = 0;
+    }
+
+    // Heap h (lo: max-heap, hi: min-heap) orders a above b
+    static bool above(bool isLo, T a, T b) { return isLo ? a > b : a < b; }
+
+    void place(bool isLo, int i, int slot) {
+        (isLo ? lo : hi)[i] = slot;
+        index[slot] = isLo ? i : ~i;
+    }
+
+    void siftUp(bool isLo, int i) {
+        std::vector<int> &heap = isLo ? lo : hi;
+        const int slot = heap[i];
+        while (i > 0) {
+            int parent = (i - 1) / 2;
+            if (!above(isLo, value[slot], value[heap[parent]])) break;
+            place(isLo, i, heap[parent]);
+            i = parent;
+        }
+        place(isLo, i, slot);
+    }
+
+    void siftDown(bool isLo, int i) {
+        std::vector<int> &heap = isLo ? lo : hi;
+        const int n = isLo ? nlo : nhi;
+        const int slot = heap[i];
+        while (true) {
+            int child = 2 * i + 1;
+            if (child >= n) break;
+            if (child + 1 < n && above(isLo, value[heap[child + 1]], value[heap[child]])) child++;
+            if (!above(isLo, value[heap[child]], value[slot])) break;
+            place(isLo, i, heap[child]);
+            i = child;
+        }
+        place(isLo, i, slot);
+    }
+
+    void push(bool isLo, int slot) {
+        int i = isLo ? nlo++ : nhi++;
+        place(isLo, i, slot);
+        siftUp(isLo, i);
+    }
+
+    int pop(bool isLo) {
+        std::vector<int> &heap = isLo ? lo : hi;
+        const int top = heap[0];
+        const int n = isLo ? --nlo : --nhi;
+        if (n > 0) {
+            place(isLo, 0, heap[n]);
+            siftDown(isLo, 0);
+        }
+        return top;
+    }
+
+    // Keep nlo == nhi or nlo == nhi + 1
+    void balance() {
+        if (nlo > nhi + 1) push(false, pop(true));
+        else if (nhi > nlo) push(true, pop(false));
+    }
+
+    // After one sample changed, the halves can only be out of order at the tops
+    void order() {
+        if (nlo == 0 || nhi == 0 || value[lo[0]] <= value[hi[0]]) return;
+        const int a = lo[0], b = hi[0];
+        place(true, 0, b);
+        place(false, 0, a);
+        siftDown(true, 0);
+        siftDown(false, 0);
+    }
+
+    void insert(int slot, T v) {
+        value[slot] = v;
+        push(nlo == 0 || v <= value[lo[0]], slot);
+        balance();
+    }
+
+    void erase(int slot, T) {
+        const bool isLo = index[slot] >= 0;
+        std::vector<int> &heap = isLo ? lo : hi;
+        const int i = isLo ? index[slot] : ~index[slot];
+        const int n = isLo ? --nlo : --nhi;
+        if (i < n) {
+            // The last sample fills the hole and moves whichever way it must
+            const int moved = heap[n];
+            place(isLo, i, moved);
+            siftUp(isLo, i);
+            siftDown(isLo, isLo ? index[moved] : ~index[moved]);
+        }
+        balance();
+    }
+
+    void replace(int slot, T, T v) {
+        const bool isLo = index[slot] >= 0;
+        const int i = isLo ? index[slot] : ~index[slot];
+        value[slot] = v;
+        siftUp(isLo, i);
+        const int j = isLo ? index[slot] : ~index[slot];
+        siftDown(isLo, j);
+        order();
+    }
+
+    T median() const {
+        const T a = value[lo[0]], b = nlo > nhi ? a : value[hi[0]];
+        return std::is_floating_point<T>::value ? T((a + b) / 2) : T((int(a) + int(b) + 1) / 2);
+    }
+};
+
+// uint8 histogram with a cursor over 16 coarse bins of 16 values: `below`
+// samples lie in coarse bins [0, cursor)
+struct HistogramWindow1D {
+    static constexpr int SHIFT = 4;
+    int fine[256] = {};
+    int coarse[16] = {};
+    int total = 0, cursor = 0, below = 0;
+
+    void begin(int) {
+        // Left empty by the previous segment's final removals
+    }
+
+    void insert(int, uint8_t v) {
+        fine[v]++;
+        coarse[v >> SHIFT]++;
+        below += (v >> SHIFT) < cursor;
+        total++;
+    }
+
+    void erase(int, uint8_t v) {
+        fine[v]--;
+        coarse[v >> SHIFT]--;
+        below -= (v >> SHIFT) < cursor;
+        total--;
+    }
+
+    void replace(int slot, uint8_t old, uint8_t v) {
+        erase(slot, old);
+        insert(slot, v);
+    }
+
+    int kth(int target) {
+        while (below > target) below -= coarse[--cursor];
+        while (below + coarse[cursor] <= target) below += coarse[cursor++];
+        int count = below, k = cursor << SHIFT;
+        while (count + fine[k] <= target) count += fine[k++];
+        return k;
+    }
+
+    uint8_t median() {
+        const int a = kth((total - 1) / 2);
+        if (total % 2 == 1) return uint8_t(a);
+        return uint8_t((a + kth(total / 2) + 1) / 2);
+    }
+};
+
+template <typename T>
+struct LineWindow {
+    typedef HeapWindow<T> type;
+};
+
+template <>
+struct LineWindow<uint8_t> {
+    typedef HistogramWindow1D type;
+};
+
+// Median of positions [a, b) of a line whose samples [p0, p1) are in
+// `line` (line[0] is position p0), into out[0, b - a); windows are
+// [i - h, i + h] clipped to [p0, p1)
+template <typename T, typename Window>
+void slide(const T *line, ptrdiff_t p0, ptrdiff_t p1, ptrdiff_t a, ptrdiff_t b, int h, T *out, Window &window) {
+    const int w = 2 * h + 1;
+    auto slot = [&](ptrdiff_t pos) { return int((pos - p0) % w); };
+    auto at = [&](ptrdiff_t pos) { return line[pos - p0]; };
+
+    window.begin(w);
+    const ptrdiff_t first = std::max(a - h, p0);
+    for (ptrdiff_t pos = first; pos <= std::min(a + h, p1 - 1); pos++) window.insert(slot(pos), at(pos));
+
+    for (ptrdiff_t i = a; i < b; i++) {
+        out[i - a] = window.median();
+        if (i + 1 == b) break;
+
+        // The leaving and entering samples are w apart and share a slot
+        const ptrdiff_t leave = i - h, enter = i + h + 1;
+        if (leave >= p0 && enter < p1) window.replace(slot(leave), at(leave), at(enter));
+        else if (leave >= p0) window.erase(slot(leave), at(leave));
+        else if (enter < p1) window.insert(slot(enter), at(enter));
+    }
+
+    // Leave the window empty for the next segment
+    for (ptrdiff_t pos = std::max(b - 1 - h, p0); pos <= std::min(b - 1 + h, p1 - 1); pos++) {
+        window.erase(slot(pos), at(pos));
+    }
+}
+
+// Samples a segment needs: [p0, p1) of positions [a, b) on an axis of n,
+// clipped to the axis for Shrink and padded otherwise
+inline void segment_halo(MedianBorder border, ptrdiff_t a, ptrdiff_t b, int h, ptrdiff_t n, ptrdiff_t &p0,
+                         ptrdiff_t &p1) {
+    p0 = a - h;
+    p1 = b + h;
+    if (border == MedianBorder::Shrink) {
+        p0 = std::max<ptrdiff_t>(p0, 0);
+        p1 = std::min(p1, n);
+    }
+}
+
+// Outputs per segment: long enough to amortize the warm-up of the window
+inline ptrdiff_t segment_length(int h, ptrdiff_t minimum) {
+    return std::max<ptrdiff_t>(minimum, ptrdiff_t(16) * (2 * h + 1));
+}
+
+struct Segment {
+    int line;               // row (hy == 0) or first column of a block (hx == 0)
+    ptrdiff_t a, b;         // outputs along the line
+};
+
+constexpr int COLUMNS = 32;     // columns gathered per block for hx == 0
+
+template <typename T>
+struct LineScratch {
+    typename LineWindow<T>::type window;
+    std::vector<T> line, out;
+};
+
+// 1 x (2hx+1) windows: rows are filtered in place, padded rows are copied
+template <typename T>
+void filter_rows(const T *input, T *output, const MedianGeometry &g) {
+    const int h = g.hx;
+    const T constant = median_border_constant<T>(g);
+    std::vector<Segment> segments;
+    for (int y = g.roi.y0; y < g.roi.y1; y++) {
+        for (auto s : median_split(g.roi.x0, g.roi.x1, int(segment_length(h, 4096)))) segments.push_back({y, s.first, s.second});
+    }
+
+    std::vector<std::unique_ptr<LineScratch<T>>> scratch(median_threads(g));
+    median_parallel_for((int)segments.size(), g, [&](int index, int thread) {
+        if (!scratch[thread]) scratch[thread] = std::make_unique<LineScratch<T>>();
+        LineScratch<T> &s = *scratch[thread];
+        const Segment &seg = segments[index];
+        const T *row = input + ptrdiff_t(seg.line) * g.inStride;
+
+        ptrdiff_t p0, p1;
+        segment_halo(g.border, seg.a, seg.b, h, g.nx, p0, p1);
+        const T *line = row + p0;
+        if (p0 < 0 || p1 > g.nx) {
+            s.line.resize(p1 - p0);
+            for (ptrdiff_t p = p0; p < p1; p++) {
+                int c = median_border_index(g.border, int(p), g.nx);
+                s.line[p - p0] = c < 0 ? constant : row[c];
+            }
+            line = s.line.data();
+        }
+        slide(line, p0, p1, seg.a, seg.b, h, median_output_at(output, g, seg.line, int(seg.a)), s.window);
+    });
+}
+
+// (2hy+1) x 1 windows: blocks of columns are transposed into line buffers
+template <typename T>
+void filter_columns(const T *input, T *output, const MedianGeometry &g) {
+    const int h = g.hy;
+    const T constant = median_border_constant<T>(g);
+    std::vector<Segment> segments;
+    for (auto c : median_split(g.roi.x0, g.roi.x1, COLUMNS)) {
+        for (auto s : median_split(g.roi.y0, g.roi.y1, int(segment_length(h, 1024)))) segments.push_back({c.first, s.first, s.second});
+    }
+
+    std::vector<std::unique_ptr<LineScratch<T>>> scratch(median_threads(g));
+    median_parallel_for((int)segments.size(), g, [&](int index, int thread) {
+        if (!scratch[thread]) scratch[thread] = std::make_unique<LineScratch<T>>();
+        LineScratch<T> &s = *scratch[thread];
+        const Segment &seg = segments[index];
+        const int x0 = seg.line, columns = std::min(COLUMNS, g.roi.x1 - x0);
+
+        ptrdiff_t p0, p1;
+        segment_halo(g.border, seg.a, seg.b, h, g.ny, p0, p1);
+        const ptrdiff_t length = p1 - p0, outputs = seg.b - seg.a;
+        s.line.resize(size_t(columns) * length);
+        s.out.resize(size_t(columns) * outputs);
+
+        for (ptrdiff_t p = p0; p < p1; p++) {
+            int r = median_border_index(g.border, int(p), g.ny);
+            const T *row = input + ptrdiff_t(r) * g.inStride + x0;
+            for (int c = 0; c < columns; c++) s.line[c * length + (p - p0)] = r < 0 ? constant : row[c];
+        }
+        for (int c = 0; c < columns; c++) {
+            slide(&s.line[c * length], p0, p1, seg.a, seg.b, h, &s.out[c * outputs], s.window);
+        }
+        for (ptrdiff_t i = 0; i < outputs; i++) {
+            T *out = median_output_at(output, g, int(seg.a + i), x0);
+            for (int c = 0; c < columns; c++) out[c] = s.out[c * outputs + i];
+        }
+    });
+}
+
+template <typename T>
+void filter_line_kernel(const T *input, T *output, int ny, int nx, int hy, int hx, const MedianLayout &layout) {
+    if (hy != 0 && hx != 0) throw std::invalid_argument("median_filterv7: kernel must be 1 x N or N x 1");
+
+    const MedianGeometry g = median_geometry(ny, nx, hy, hx, layout);
+    if (hy == 0) filter_rows(input, output, g);
+    else filter_columns(input, output, g);
+}
+
+template <typename T>
+void filter_signal(const T *input, T *output, size_t n, int h, int budget, const MedianCpuSet &cpus) {
+    if (h < 0) throw std::invalid_argument("median_filter1d: invalid kernel size");
+
+    const ptrdiff_t length = segment_length(h, ptrdiff_t(1) << 16);
+    const ptrdiff_t count = (ptrdiff_t(n) + length - 1) / length;
+    const int threads = median_threads(budget, cpus);
+    std::vector<std::unique_ptr<typename LineWindow<T>::type>> windows(threads);
+
+    median_parallel_for(int(count), threads, cpus, [&](int index, int thread) {
+        if (!windows[thread]) windows[thread] = std::make_unique<typename LineWindow<T>::type>();
+        const ptrdiff_t a = index * length, b = std::min(a + length, ptrdiff_t(n));
+        ptrdiff_t p0, p1;
+        segment_halo(MedianBorder::Shrink, a, b, h, ptrdiff_t(n), p0, p1);
+        slide(input + p0, p0, p1, a, b, h, output + a, *windows[thread]);
+    });
+}
+
+} // namespace
+
+void median_filterv7(const float *input, float *output, int ny, int nx, int hy, int hx, const MedianLayout &layout) {
+    filter_line_kernel(input, output, ny, nx, hy, hx, layout);
+}
+
+void median_filterv7(const float *input, float *output, int ny, int nx, int hy, int hx) {
+    median_filterv7(input, output, ny, nx, hy, hx, median_dense_layout(ny, nx));
+}
+
+void median_filterv7(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx, const MedianLayout &layout) {
+    filter_line_kernel(input, output, ny, nx, hy, hx, layout);
+}
+
+void median_filterv7(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx) {
+    median_filterv7(input, output, ny, nx, hy, hx, median_dense_layout(ny, nx));
+}
+
+void median_filterv7(const uint16_t *input, uint16_t *output, int ny, int nx, int hy, int hx, const MedianLayout &layout) {
+    filter_line_kernel(input, output, ny, nx, hy, hx, layout);
+}
+
+void median_filterv7(const uint16_t *input, uint16_t *output, int ny, int nx, int hy, int hx) {
+    median_filterv7(input, output, ny, nx, hy, hx, median_dense_layout(ny, nx));
+}
+
+void median_filter1d(const float *input, float *output, size_t n, int h, int threads, const MedianCpuSet &cpus) {
+    filter_signal(input, output, n, h, threads, cpus);
+}
+
+void median_filter1d(const uint8_t *input, uint8_t *output, size_t n, int h, int threads, const MedianCpuSet &cpus) {
+    filter_signal(input, output, n, h, threads, cpus);
+}
+
+void median_filter1d(const uint16_t *input, uint16_t *output, size_t n, int h, int threads, const MedianCpuSet &cpus) {
+    filter_signal(input, output, n, h, threads, cpus);
+}
@@ -5,25 +5,38 @@ import numpy as np
 
 # Read the CSV data
 df = pd.read_csv('timing_results.csv')
+runs = 5
 
 # Create the plot
 plt.figure(figsize=(12, 8))
 
+# Plot the first image size, pattern and thread count of the sweep
+first = df.iloc[0]
+df = df[(df['Height'] == first['Height']) & (df['Width'] == first['Width']) &
+        (df['Pattern'] == first['Pattern']) & (df['Threads'] == first['Threads'])]
+
+# One x position per kernel (KernelY x KernelX), ordered by window area, so
+# non-square kernels and transposed pairs stay apart
+kernels = sorted(set(zip(df['KernelY'], df['KernelX'])), key=lambda k: (k[0] * k[1], k))
+position = {k: i for i, k in enumerate(kernels)}
+df = df.assign(Kernel=[position[k] for k in zip(df['KernelY'], df['KernelX'])]).sort_values('Kernel')
+
 # Get unique versions and assign colors
-versions = df['Version'].unique()
+versions = df[['Version', 'DType']].drop_duplicates().values.tolist()
 colors = plt.cm.Set1(np.linspace(0, 1, len(versions)))
 
-for i, version in enumerate(versions):
-    version_data = df[df['Version'] == version]
+for i, (version, dtype) in enumerate(versions):
+    version_data = df[(df['Version'] == version) & (df['DType'] == dtype)]
     
-    plt.errorbar(version_data['KernelSize'], version_data['MeanTime'], 
+    plt.errorbar(version_data['Kernel'], version_data['MeanTime'], 
                 yerr=version_data['StdTime'],
-                label=version, marker='o', capsize=5, 
+                label=version + ' (' + dtype + ')', marker='o', capsize=5, 
                 color=colors[i], linewidth=2, markersize=6)
 
-plt.xlabel('Kernel Size (pixels)', fontsize=12, fontweight='bold')
+plt.xticks(range(len(kernels)), ['%dx%d' % k for k in kernels])
+plt.xlabel('Kernel (height x width)', fontsize=12, fontweight='bold')
 plt.ylabel('Average Runtime (ms)', fontsize=12, fontweight='bold')
-plt.title('Median Filter Performance Comparison\n500x500 Image, 5 Runs Average', 
+plt.title('Median Filter Performance Comparison\n%dx%d Image, %d Runs Average' % (first['Height'], first['Width'], runs), 
           fontsize=14, fontweight='bold')
 plt.legend(fontsize=11, loc='upper left')
 plt.grid(True, alpha=0.3)
@@ -5,38 +5,43 @@
 #include <random>
 #include <iomanip>
 #include <fstream>
+#include <sstream>
 #include <cmath>
 #include <algorithm>
+#include <cstring>
+#include <cctype>
+#include <cstdlib>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
 
-// Function pointer types for different data types
-typedef void (*MedianFilterFuncFloat)(const float *input, float *output, int ny, int nx, int hy, int hx);
-typedef void (*MedianFilterFuncUint8)(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx);
+#include "median_filter.h"
 
-// Include all the median filter versions
-extern void median_filterv1(const float *input, float *output, int ny, int nx, int hy, int hx);
-extern void median_filterv2(const float *input, float *output, int ny, int nx, int hy, int hx);
-extern void median_filterv3(const float *input, float *output, int ny, int nx, int hy, int hx);
-
-// v4 is only available on x86_64 architectures
-#ifdef HAVE_MFV4
-extern void median_filterv4(const float *input, float *output, int ny, int nx, int hy, int hx);
-#endif
-
-// v5+ use uint8_t
-extern void median_filterv5(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx);
-
-// OpenCV implementations (if available)
-#ifdef HAVE_OPENCV
-extern void median_filter_opencv_float(const float *input, float *output, int ny, int nx, int hy, int hx);
-extern void median_filter_opencv_uint8(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx);
-#endif
+// Function pointer types for different data types. Versions are timed through
+// their layout overloads so that each call can be given a thread budget.
+typedef void (*MedianFilterFuncFloat)(const float *input, float *output, int ny, int nx, int hy, int hx,
+                                      const MedianLayout &layout);
+typedef void (*MedianFilterFuncUint8)(const uint8_t *input, uint8_t *output, int ny, int nx, int hy, int hx,
+                                      const MedianLayout &layout);
+typedef void (*MedianFilterFuncUint16)(const uint16_t *input, uint16_t *output, int ny, int nx, int hy, int hx,
+                                       const MedianLayout &layout);
 
 // Enum for data types
 enum class DataType {
     FLOAT,
-    UINT8
+    UINT8,
+    UINT16
 };
 
+const char* dataTypeName(DataType dataType) {
+    switch (dataType) {
+        case DataType::FLOAT: return "float";
+        case DataType::UINT8: return "uint8";
+        case DataType::UINT16: return "uint16";
+    }
+    return "?";
+}
+
 // Structure to hold version information
 struct FilterVersion {
     std::string name;
@@ -44,27 +49,59 @@ struct FilterVersion {
     union {
         MedianFilterFuncFloat floatFunc;
         MedianFilterFuncUint8 uint8Func;
+        MedianFilterFuncUint16 uint16Func;
     } func;
     std::string description;
 };
 
+// What to time: every combination of the lists below is one configuration
+struct TimingOptions {
+    std::vector<std::pair<int, int>> sizes = {{500, 500}};     // ny, nx
+    std::vector<std::pair<int, int>> kernels;                  // hy, hx; default 3x3 to 21x21
+    std::vector<DataType> dataTypes = {DataType::FLOAT, DataType::UINT8, DataType::UINT16};
+    std::vector<std::string> patterns = {"random"};
+    std::vector<std::string> versions;                         // empty: all registered versions
+    std::vector<int> threads = {0};                            // MedianLayout::threads; 0: library default
+    int runs = 5;
+    int warmup = 1;
+    std::string csvFile = "timing_results.csv";
+    std::string jsonFile;                                      // empty: no JSON output
+
+    TimingOptions() {
+        for(int h = 1; h <= 10; h++) kernels.push_back({h, h});
+    }
+};
+
+const char* const kPatterns[] = {"random", "gradient", "checkerboard", "noise_spikes", "constant"};
+
 // Structure to hold timing results
 struct TimingResult {
     std::string version;
-    int kernelSize;
+    DataType dataType;
+    std::string pattern;
+    int ny, nx;
+    int hy, hx;
+    int threads;
+    int runs;
     double meanTime;
     double stdTime;
     double minTime;
     double maxTime;
+    double medianTime;
 };
 
+template <typename T> void dispatcherVersion(const T *input, T *output, int ny, int nx, int hy, int hx,
+                                             const MedianLayout &layout) {
+    median_filter(input, output, ny, nx, hy, hx, layout);
+}
+
 class MedianFilterTimer {
 private:
     std::vector<FilterVersion> versions_;
     std::mt19937 rng_;
     
 public:
-    MedianFilterTimer() : rng_(42) {  // Fixed seed for reproducibility
+    MedianFilterTimer() {
         // Register all versions
         registerFloatVersion("v1", median_filterv1, "Basic implementation with full sorting");
         registerFloatVersion("v2", median_filterv2, "Uses nth_element optimization");
@@ -77,6 +114,17 @@ public:
 
         // v5+ use uint8_t
         registerUint8Version("v5", median_filterv5, "Histogram-based median for 8-bit images");
+        registerUint16Version("v6", median_filterv6, "Two-level histogram median for 16-bit images");
+        
+        // v7 only runs 1D kernels; 2D kernels are skipped
+        registerFloatVersion("v7", median_filterv7, "Sliding double heap for 1D kernels");
+        registerUint8Version("v7", median_filterv7, "Sliding histogram for 1D kernels");
+        registerUint16Version("v7", median_filterv7, "Sliding double heap for 1D kernels");
+        
+        // The dispatcher, as applications call it
+        registerFloatVersion("auto", dispatcherVersion<float>, "Engine picked by the cost model");
+        registerUint8Version("auto", dispatcherVersion<uint8_t>, "Engine picked by the cost model");
+        registerUint16Version("auto", dispatcherVersion<uint16_t>, "Engine picked by the cost model");
         
         // OpenCV implementations (if available)
 #ifdef HAVE_OPENCV
@@ -103,70 +151,122 @@ public:
         versions_.push_back(version);
     }
     
-    // Generate random test image (float version)
-    std::vector<float> generateTestImageFloat(int ny, int nx) {
-        std::vector<float> image(ny * nx);
-        std::uniform_real_distribution<float> dist(0.0f, 255.0f);
+    void registerUint16Version(const std::string& name, MedianFilterFuncUint16 func, const std::string& description) {
+        FilterVersion version;
+        version.name = name;
+        version.dataType = DataType::UINT16;
+        version.func.uint16Func = func;
+        version.description = description;
+        versions_.push_back(version);
+    }
+    
+    const std::vector<FilterVersion>& versions() const { return versions_; }
+    
+    // Seed the generator from the image size and pattern, so every version
+    // is timed on the same input and each data type's image derives from
+    // the same random stream
+    void seedTestImage(int ny, int nx, const std::string& pattern) {
+        std::vector<unsigned> keys = {42u, unsigned(ny), unsigned(nx)};
+        for(char c : pattern) keys.push_back(static_cast<unsigned char>(c));
+        std::seed_seq seed(keys.begin(), keys.end());
+        rng_.seed(seed);
+    }
+    
+    // Generate test image with different patterns (float version)
+    std::vector<float> generateTestImageFloat(int ny, int nx, const std::string& pattern) {
+        std::vector<float> image(size_t(ny) * nx);
         
-        for(int i = 0; i < ny * nx; i++) {
-            image[i] = dist(rng_);
+        if (pattern == "random") {
+            std::uniform_real_distribution<float> dist(0.0f, 255.0f);
+            for(auto& v : image) v = dist(rng_);
+        }
+        else if (pattern == "gradient") {
+            for(int y = 0; y < ny; y++) {
+                for(int x = 0; x < nx; x++) {
+                    image[size_t(y) * nx + x] = (float)(x + y) * 255.0f / std::max(nx + ny - 2, 1);
+                }
+            }
+        }
+        else if (pattern == "checkerboard") {
+            for(int y = 0; y < ny; y++) {
+                for(int x = 0; x < nx; x++) {
+                    image[size_t(y) * nx + x] = ((x + y) % 2 == 0) ? 0.0f : 255.0f;
+                }
+            }
+        }
+        else if (pattern == "noise_spikes") {
+            std::uniform_real_distribution<float> base_dist(100.0f, 150.0f);
+            std::uniform_real_distribution<float> prob_dist(0.0f, 1.0f);
+            for(auto& v : image) {
+                if (prob_dist(rng_) < 0.1f) {  // 10% spikes
+                    v = (prob_dist(rng_) < 0.5f) ? 0.0f : 255.0f;
+                } else {
+                    v = base_dist(rng_);
+                }
+            }
+        }
+        else if (pattern == "constant") {
+            std::fill(image.begin(), image.end(), 128.0f);
         }
         
         return image;
     }
     
-    // Generate random test image (uint8 version)
-    std::vector<uint8_t> generateTestImageUint8(int ny, int nx) {
-        std::vector<uint8_t> image(ny * nx);
-        std::uniform_int_distribution<int> dist(0, 255);
+    // Generate test image with different patterns (uint8 version)
+    std::vector<uint8_t> generateTestImageUint8(int ny, int nx, const std::string& pattern) {
+        std::vector<uint8_t> image(size_t(ny) * nx);
         
-        for(int i = 0; i < ny * nx; i++) {
-            image[i] = static_cast<uint8_t>(dist(rng_));
+        if (pattern == "random") {
+            std::uniform_int_distribution<int> dist(0, 255);
+            for(auto& v : image) v = static_cast<uint8_t>(dist(rng_));
+        } else {
+            // The float patterns, rounded down
+            auto base = generateTestImageFloat(ny, nx, pattern);
+            for(size_t i = 0; i < image.size(); i++) image[i] = static_cast<uint8_t>(base[i]);
         }
         
         return image;
     }
     
-    // Time a single run of a filter
-    double timeFilter(const FilterVersion& version, int ny, int nx, int hy, int hx, int runs = 5) {
-        std::vector<double> times;
+    // Generate test image with different patterns (uint16 version). The 8-bit
+    // patterns are stretched to the full range; random uses every 16-bit value.
+    std::vector<uint16_t> generateTestImageUint16(int ny, int nx, const std::string& pattern) {
+        std::vector<uint16_t> image(size_t(ny) * nx);
         
-        for(int run = 0; run < runs; run++) {
-            if (version.dataType == DataType::FLOAT) {
-                auto input = generateTestImageFloat(ny, nx);
-                std::vector<float> output(ny * nx);
-                
-                auto start = std::chrono::high_resolution_clock::now();
-                version.func.floatFunc(input.data(), output.data(), ny, nx, hy, hx);
-                auto end = std::chrono::high_resolution_clock::now();
-                
-                auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-                times.push_back(duration.count() / 1000.0);  // Convert to milliseconds
-                
-            } else if (version.dataType == DataType::UINT8) {
-                auto input = generateTestImageUint8(ny, nx);
-                std::vector<uint8_t> output(ny * nx);
-                
-                auto start = std::chrono::high_resolution_clock::now();
-                version.func.uint8Func(input.data(), output.data(), ny, nx, hy, hx);
-                auto end = std::chrono::high_resolution_clock::now();
-                
-                auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-                times.push_back(duration.count() / 1000.0);  // Convert to milliseconds
-            }
+        if (pattern == "random") {
+            std::uniform_int_distribution<int> dist(0, 65535);
+            for(auto& v : image) v = static_cast<uint16_t>(dist(rng_));
+        } else {
+            auto base = generateTestImageUint8(ny, nx, pattern);
+            for(size_t i = 0; i < image.size(); i++) image[i] = static_cast<uint16_t>(base[i] * 257);
         }
         
-        // Return median time to reduce noise
-        std::sort(times.begin(), times.end());
-        return times[times.size() / 2];
+        return image;
     }
     
-    // Calculate statistics for timing results
-    TimingResult calculateStats(const std::string& versionName, int kernelSize, const std::vector<double>& times) {
-        TimingResult result;
-        result.version = versionName;
-        result.kernelSize = kernelSize;
+    // Time `warmup` untimed and `runs` timed calls of a filter on one input,
+    // in milliseconds. Throws std::invalid_argument if the version cannot
+    // run the kernel.
+    template <typename T, typename Func>
+    std::vector<double> timeCalls(Func func, const std::vector<T>& input, int ny, int nx, int hy, int hx,
+                                  const MedianLayout& layout, int warmup, int runs) {
+        std::vector<T> output(input.size());
+        for(int run = 0; run < warmup; run++) {
+            func(input.data(), output.data(), ny, nx, hy, hx, layout);
+        }
         
+        std::vector<double> times;
+        for(int run = 0; run < runs; run++) {
+            auto start = std::chrono::high_resolution_clock::now();
+            func(input.data(), output.data(), ny, nx, hy, hx, layout);
+            auto end = std::chrono::high_resolution_clock::now();
+            times.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+        }
+        return times;
+    }
+    
+    // Calculate statistics for timing results
+    void calculateStats(TimingResult& result, const std::vector<double>& times) {
         // Calculate mean
         double sum = 0.0;
         for(double time : times) {
@@ -181,68 +281,106 @@ public:
         }
         result.stdTime = std::sqrt(variance / times.size());
         
-        // Min and max
-        result.minTime = *std::min_element(times.begin(), times.end());
-        result.maxTime = *std::max_element(times.begin(), times.end());
-        
-        return result;
+        // Min, max and median
+        std::vector<double> sorted = times;
+        std::sort(sorted.begin(), sorted.end());
+        result.minTime = sorted.front();
+        result.maxTime = sorted.back();
+        result.medianTime = sorted[sorted.size() / 2];
     }
     
-    // Run timing benchmark
-    std::vector<TimingResult> runTimingBenchmark(int ny = 500, int nx = 500, int runs = 5) {
+    // Run timing benchmark over every configuration of the options
+    std::vector<TimingResult> runTimingBenchmark(const TimingOptions& options) {
         std::vector<TimingResult> results;
         
-        // Test different kernel sizes (hy, hx pairs)
-        std::vector<std::pair<int, int>> kernelSizes = {
-            {1, 1},   // 3x3
-            {2, 2},   // 5x5
-            {3, 3},   // 7x7
-            {4, 4},   // 9x9
-            {5, 5},   // 11x11
-            {6, 6},   // 13x13
-            {7, 7},   // 15x15
-            {8, 8},   // 17x17
-            {9, 9},   // 19x19
-            {10, 10}  // 21x21
-        };
+        std::vector<const FilterVersion*> selected;
+        for(const auto& version : versions_) {
+            bool wanted = options.versions.empty() ||
+                std::find(options.versions.begin(), options.versions.end(), version.name) != options.versions.end();
+            bool typed = std::find(options.dataTypes.begin(), options.dataTypes.end(), version.dataType) != options.dataTypes.end();
+            if (wanted && typed) selected.push_back(&version);
+        }
         
         std::cout << "Running timing benchmark..." << std::endl;
-        std::cout << "Image size: " << ny << " x " << nx << std::endl;
-        std::cout << "Runs per configuration: " << runs << std::endl;
+        std::cout << "Image sizes:";
+        for(const auto& size : options.sizes) std::cout << " " << size.first << "x" << size.second;
+        std::cout << std::endl;
+        std::cout << "Runs per configuration: " << options.runs << " (" << options.warmup << " warm-up)" << std::endl;
         std::cout << std::endl;
         
         // Progress tracking
-        int totalTests = versions_.size() * kernelSizes.size();
-        int currentTest = 0;
+        size_t totalTests = selected.size() * options.sizes.size() * options.patterns.size() *
+                            options.threads.size() * options.kernels.size();
+        size_t currentTest = 0;
         
-        for(const auto& version : versions_) {
-            std::cout << "Testing " << version.name << " (" << version.description << ")" << std::endl;
+        for(const FilterVersion* version : selected) {
+            std::cout << "Testing " << version->name << " " << dataTypeName(version->dataType)
+                      << " (" << version->description << ")" << std::endl;
             
-            for(const auto& kernel : kernelSizes) {
-                int hy = kernel.first;
-                int hx = kernel.second;
-                int kernelSize = 2 * hy + 1;  // Full kernel size for display
-                
-                currentTest++;
-                std::cout << "  Kernel " << kernelSize << "x" << kernelSize 
-                         << " (" << currentTest << "/" << totalTests << ")... " << std::flush;
-                
-                std::vector<double> times;
-                
-                // Warm-up run (not counted)
-                timeFilter(version, ny, nx, hy, hx, 1);
-                
-                // Actual timing runs
-                for(int run = 0; run < runs; run++) {
-                    double time = timeFilter(version, ny, nx, hy, hx, 1);
-                    times.push_back(time);
+            for(const auto& size : options.sizes) {
+                for(const auto& pattern : options.patterns) {
+                    const int ny = size.first, nx = size.second;
+                    std::vector<float> inputFloat;
+                    std::vector<uint8_t> inputUint8;
+                    std::vector<uint16_t> inputUint16;
+                    seedTestImage(ny, nx, pattern);
+                    switch (version->dataType) {
+                        case DataType::FLOAT: inputFloat = generateTestImageFloat(ny, nx, pattern); break;
+                        case DataType::UINT8: inputUint8 = generateTestImageUint8(ny, nx, pattern); break;
+                        case DataType::UINT16: inputUint16 = generateTestImageUint16(ny, nx, pattern); break;
+                    }
+                    
+                    for(int threads : options.threads) {
+                        MedianLayout layout = median_dense_layout(ny, nx);
+                        layout.threads = threads;
+                        
+                        for(const auto& kernel : options.kernels) {
+                            const int hy = kernel.first, hx = kernel.second;
+                            currentTest++;
+                            std::cout << "  " << ny << "x" << nx << " " << pattern
+                                      << " threads " << (threads > 0 ? std::to_string(threads) : std::string("default"))
+                                      << " kernel " << (2 * hy + 1) << "x" << (2 * hx + 1)
+                                      << " (" << currentTest << "/" << totalTests << ")... " << std::flush;
+                            
+                            std::vector<double> times;
+                            try {
+                                switch (version->dataType) {
+                                    case DataType::FLOAT:
+                                        times = timeCalls(version->func.floatFunc, inputFloat, ny, nx, hy, hx, layout,
+                                                          options.warmup, options.runs);
+                                        break;
+                                    case DataType::UINT8:
+                                        times = timeCalls(version->func.uint8Func, inputUint8, ny, nx, hy, hx, layout,
+                                                          options.warmup, options.runs);
+                                        break;
+                                    case DataType::UINT16:
+                                        times = timeCalls(version->func.uint16Func, inputUint16, ny, nx, hy, hx, layout,
+                                                          options.warmup, options.runs);
+                                        break;
+                                }
+                            } catch (const std::invalid_argument& e) {
+                                std::cout << "skipped (" << e.what() << ")" << std::endl;
+                                continue;
+                            }
+                            
+                            TimingResult result;
+                            result.version = version->name;
+                            result.dataType = version->dataType;
+                            result.pattern = pattern;
+                            result.ny = ny;
+                            result.nx = nx;
+                            result.hy = hy;
+                            result.hx = hx;
+                            result.threads = threads;
+                            result.runs = options.runs;
+                            calculateStats(result, times);
+                            results.push_back(result);
+                            
+                            std::cout << std::fixed << std::setprecision(2)
+                                      << result.meanTime << "ms ±" << result.stdTime << "ms" << std::endl;
+                        }
+                    }
                 }
-                
-                TimingResult result = calculateStats(version.name, kernelSize, times);
-                results.push_back(result);
-                
-                std::cout << std::fixed << std::setprecision(2) 
-                         << result.meanTime << "ms ±" << result.stdTime << "ms" << std::endl;
             }
             std::cout << std::endl;
         }
@@ -260,49 +398,109 @@ public:
         }
         
         // CSV header
-        file << "Version,KernelSize,MeanTime,StdTime,MinTime,MaxTime" << std::endl;
+        file << "Version,DType,Pattern,Height,Width,KernelY,KernelX,Threads,"
+                "MeanTime,StdTime,MinTime,MaxTime,MedianTime" << std::endl;
         
         // Data rows
         for(const auto& result : results) {
             file << result.version << ","
-                 << result.kernelSize << ","
+                 << dataTypeName(result.dataType) << ","
+                 << result.pattern << ","
+                 << result.ny << "," << result.nx << ","
+                 << (2 * result.hy + 1) << "," << (2 * result.hx + 1) << ","
+                 << result.threads << ","
                  << std::fixed << std::setprecision(6) << result.meanTime << ","
                  << result.stdTime << ","
                  << result.minTime << ","
-                 << result.maxTime << std::endl;
+                 << result.maxTime << ","
+                 << result.medianTime << std::endl;
+        }
+        
+        file.close();
+        std::cout << "Results saved to " << filename << std::endl;
+    }
+    
+    // Save results as JSON: the run's settings, then one record per configuration.
+    // Names are registry and pattern identifiers and need no escaping.
+    void saveResultsToJSON(const std::vector<TimingResult>& results, const TimingOptions& options,
+                           const std::string& filename) {
+        std::ofstream file(filename);
+        
+        if (!file.is_open()) {
+            std::cerr << "Error: Could not open file " << filename << " for writing" << std::endl;
+            return;
         }
         
+        file << "{" << std::endl;
+        file << "  \"runs\": " << options.runs << "," << std::endl;
+        file << "  \"warmup\": " << options.warmup << "," << std::endl;
+        const char* poolThreads = std::getenv("MEDIAN_NUM_THREADS");
+        file << "  \"hardware_threads\": " << std::thread::hardware_concurrency() << "," << std::endl;
+        file << "  \"median_num_threads\": " << (poolThreads ? std::atoi(poolThreads) : 0) << "," << std::endl;
+        file << "  \"results\": [";
+        
+        for(size_t i = 0; i < results.size(); i++) {
+            const TimingResult& result = results[i];
+            double pixels = double(result.ny) * result.nx;
+            file << (i ? "," : "") << std::endl
+                 << "    {\"version\": \"" << result.version << "\""
+                 << ", \"dtype\": \"" << dataTypeName(result.dataType) << "\""
+                 << ", \"pattern\": \"" << result.pattern << "\""
+                 << ", \"ny\": " << result.ny << ", \"nx\": " << result.nx
+                 << ", \"hy\": " << result.hy << ", \"hx\": " << result.hx
+                 << ", \"threads\": " << result.threads
+                 << ", \"runs\": " << result.runs
+                 << std::fixed << std::setprecision(6)
+                 << ", \"mean_ms\": " << result.meanTime
+                 << ", \"std_ms\": " << result.stdTime
+                 << ", \"min_ms\": " << result.minTime
+                 << ", \"max_ms\": " << result.maxTime
+                 << ", \"median_ms\": " << result.medianTime
+                 << std::setprecision(3)
+                 << ", \"ns_per_pixel\": " << result.medianTime * 1e6 / pixels
+                 << "}";
+        }
+        
+        file << std::endl << "  ]" << std::endl << "}" << std::endl;
         file.close();
         std::cout << "Results saved to " << filename << std::endl;
     }
     
     // Print summary table
     void printSummary(const std::vector<TimingResult>& results) {
-        std::cout << "\n" << std::string(80, '=') << std::endl;
+        std::cout << "\n" << std::string(114, '=') << std::endl;
         std::cout << "TIMING BENCHMARK SUMMARY" << std::endl;
-        std::cout << std::string(80, '=') << std::endl;
+        std::cout << std::string(114, '=') << std::endl;
         
-        std::cout << std::setw(10) << "Version" 
-                 << std::setw(12) << "Kernel Size"
-                 << std::setw(15) << "Mean (ms)"
-                 << std::setw(15) << "Std Dev (ms)"
-                 << std::setw(15) << "Min (ms)"
-                 << std::setw(15) << "Max (ms)" << std::endl;
-        std::cout << std::string(80, '-') << std::endl;
+        std::cout << std::setw(8) << "Version" 
+                 << std::setw(8) << "Type"
+                 << std::setw(14) << "Pattern"
+                 << std::setw(12) << "Image"
+                 << std::setw(9) << "Kernel"
+                 << std::setw(9) << "Threads"
+                 << std::setw(14) << "Mean (ms)"
+                 << std::setw(14) << "Std Dev (ms)"
+                 << std::setw(13) << "Min (ms)"
+                 << std::setw(13) << "Max (ms)" << std::endl;
+        std::cout << std::string(114, '-') << std::endl;
         
         for(const auto& result : results) {
-            std::cout << std::setw(10) << result.version
-                     << std::setw(12) << (std::to_string(result.kernelSize) + "x" + std::to_string(result.kernelSize))
-                     << std::setw(15) << std::fixed << std::setprecision(2) << result.meanTime
-                     << std::setw(15) << result.stdTime
-                     << std::setw(15) << result.minTime
-                     << std::setw(15) << result.maxTime << std::endl;
+            std::cout << std::setw(8) << result.version
+                     << std::setw(8) << dataTypeName(result.dataType)
+                     << std::setw(14) << result.pattern
+                     << std::setw(12) << (std::to_string(result.ny) + "x" + std::to_string(result.nx))
+                     << std::setw(9) << (std::to_string(2 * result.hy + 1) + "x" + std::to_string(2 * result.hx + 1))
+                     << std::setw(9) << (result.threads > 0 ? std::to_string(result.threads) : std::string("-"))
+                     << std::setw(14) << std::fixed << std::setprecision(2) << result.meanTime
+                     << std::setw(14) << result.stdTime
+                     << std::setw(13) << result.minTime
+                     << std::setw(13) << result.maxTime << std::endl;
         }
     }
 };
 
 // Generate Python plotting script
-void generatePlotScript(const std::string& csvFile) {
+void generatePlotScript(const std::string& csvFile, int runs) {
     std::ofstream script("plot_timing.py");
     
     if (!script.is_open()) {
@@ -317,25 +515,38 @@ import numpy as np
 
 # Read the CSV data
 df = pd.read_csv(')" << csvFile << R"(')
+runs = )" << runs << R"(
 
 # Create the plot
 plt.figure(figsize=(12, 8))
 
+# Plot the first image size, pattern and thread count of the sweep
+first = df.iloc[0]
+df = df[(df['Height'] == first['Height']) & (df['Width'] == first['Width']) &
+        (df['Pattern'] == first['Pattern']) & (df['Threads'] == first['Threads'])]
+
+# One x position per kernel (KernelY x KernelX), ordered by window area, so
+# non-square kernels and transposed pairs stay apart
+kernels = sorted(set(zip(df['KernelY'], df['KernelX'])), key=lambda k: (k[0] * k[1], k))
+position = {k: i for i, k in enumerate(kernels)}
+df = df.assign(Kernel=[position[k] for k in zip(df['KernelY'], df['KernelX'])]).sort_values('Kernel')
+
 # Get unique versions and assign colors
-versions = df['Version'].unique()
+versions = df[['Version', 'DType']].drop_duplicates().values.tolist()
 colors = plt.cm.Set1(np.linspace(0, 1, len(versions)))
 
-for i, version in enumerate(versions):
-    version_data = df[df['Version'] == version]
+for i, (version, dtype) in enumerate(versions):
+    version_data = df[(df['Version'] == version) & (df['DType'] == dtype)]
     
-    plt.errorbar(version_data['KernelSize'], version_data['MeanTime'], 
+    plt.errorbar(version_data['Kernel'], version_data['MeanTime'], 
                 yerr=version_data['StdTime'],
-                label=version, marker='o', capsize=5, 
+                label=version + ' (' + dtype + ')', marker='o', capsize=5, 
                 color=colors[i], linewidth=2, markersize=6)
 
-plt.xlabel('Kernel Size (pixels)', fontsize=12, fontweight='bold')
+plt.xticks(range(len(kernels)), ['%dx%d' % k for k in kernels])
+plt.xlabel('Kernel (height x width)', fontsize=12, fontweight='bold')
 plt.ylabel('Average Runtime (ms)', fontsize=12, fontweight='bold')
-plt.title('Median Filter Performance Comparison\n500x500 Image, 5 Runs Average', 
+plt.title('Median Filter Performance Comparison\n%dx%d Image, %d Runs Average' % (first['Height'], first['Width'], runs), 
           fontsize=14, fontweight='bold')
 plt.legend(fontsize=11, loc='upper left')
 plt.grid(True, alpha=0.3)
@@ -358,23 +569,249 @@ plt.show()
     std::cout << "Python plotting script generated: plot_timing.py" << std::endl;
 }
 
-int main() {
-    std::cout << "Median Filter Timing Benchmark" << std::endl;
-    std::cout << "==============================" << std::endl;
+// Median run time in ns per pixel of one dispatcher engine
+template <typename T>
+double timeEngine(MedianEngine engine, int ny, int nx, int hy, int hx, int runs, std::mt19937& rng) {
+    std::vector<T> input(ny * nx), output(ny * nx);
+    std::uniform_int_distribution<int> dist(0, std::is_same<T, uint16_t>::value ? 65535 : 255);
+    for(auto& v : input) v = static_cast<T>(dist(rng));
+    
+    median_filter(input.data(), output.data(), ny, nx, hy, hx, engine);  // warm-up
+    
+    std::vector<double> times;
+    for(int run = 0; run < runs; run++) {
+        auto start = std::chrono::high_resolution_clock::now();
+        median_filter(input.data(), output.data(), ny, nx, hy, hx, engine);
+        auto end = std::chrono::high_resolution_clock::now();
+        times.push_back(std::chrono::duration<double, std::nano>(end - start).count() / (double(ny) * nx));
+    }
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+// Measure the dispatcher's crossover table on this machine. Writes the CSV
+// read by median_filter_load_table() and regenerates median_dispatch.inc,
+// the default table compiled into the library.
+void calibrateDispatcher(const std::string& csvFile, const std::string& incFile) {
+    std::mt19937 rng(42);
+    std::ofstream csv(csvFile), inc(incFile);
+    
+    if (!csv.is_open() || !inc.is_open()) {
+        std::cerr << "Error: Could not open " << csvFile << " or " << incFile << " for writing" << std::endl;
+        return;
+    }
+    
+    csv << "dtype,engine,pixels,window,ns_per_pixel" << std::endl;
+    inc << "// Generated by ./timing --calibrate" << std::endl;
+    
+    const int sides[] = {64, 256, 1024};
+    const int halves[] = {1, 2, 3, 5, 8};
+    
+    for(MedianDType dtype : {MedianDType::Float, MedianDType::Uint8, MedianDType::Uint16}) {
+        for(MedianEngine engine : median_filter_engines(dtype)) {
+            for(int side : sides) {
+                for(int h : halves) {
+                    int runs = side >= 1024 ? 3 : 5;
+                    double ns = 0.0;
+                    switch (dtype) {
+                        case MedianDType::Float: ns = timeEngine<float>(engine, side, side, h, h, runs, rng); break;
+                        case MedianDType::Uint8: ns = timeEngine<uint8_t>(engine, side, side, h, h, runs, rng); break;
+                        case MedianDType::Uint16: ns = timeEngine<uint16_t>(engine, side, side, h, h, runs, rng); break;
+                    }
+                    
+                    int window = (2 * h + 1) * (2 * h + 1);
+                    std::cout << "  " << median_dtype_name(dtype) << " " << median_engine_name(engine)
+                             << " " << side << "x" << side << " kernel " << (2 * h + 1) << "x" << (2 * h + 1)
+                             << ": " << std::fixed << std::setprecision(2) << ns << " ns/pixel" << std::endl;
+                    
+                    csv << median_dtype_name(dtype) << "," << median_engine_name(engine) << ","
+                        << side * side << "," << window << "," << std::fixed << std::setprecision(2) << ns << std::endl;
+                    
+                    std::string engineName = median_engine_name(engine);
+                    engineName[0] = static_cast<char>(std::toupper(engineName[0]));
+                    std::string dtypeName = median_dtype_name(dtype);
+                    dtypeName[0] = static_cast<char>(std::toupper(dtypeName[0]));
+                    inc << "{MedianDType::" << dtypeName << ", MedianEngine::" << engineName << ", "
+                        << side * side << ", " << window << ", " << std::fixed << std::setprecision(2) << ns << "}," << std::endl;
+                }
+            }
+        }
+    }
+    
+    std::cout << "Crossover table saved to " << csvFile << " and " << incFile << std::endl;
+}
+
+
+void printUsage(const char* program) {
+    std::cout << "Usage: " << program << " [options]\n"
+              << "       " << program << " --calibrate [file.csv]\n"
+              << "\n"
+              << "Options (lists are comma-separated; every combination is timed):\n"
+              << "  --sizes LIST      image sizes, ROWSxCOLS or N for NxN (default 500x500)\n"
+              << "  --kernels LIST    kernel sizes, HxW or K for KxK, odd (default 3,5,...,21)\n"
+              << "  --dtypes LIST     float, uint8, uint16 (default all)\n"
+              << "  --patterns LIST   random, gradient, checkerboard, noise_spikes, constant (default random)\n"
+              << "  --versions LIST   registered versions to time, see --list (default all)\n"
+              << "  --threads LIST    worker threads per call, 0 for the library default (default 0)\n"
+              << "  --runs N          timed runs per configuration (default 5)\n"
+              << "  --warmup N        untimed runs before them (default 1)\n"
+              << "  --csv FILE        CSV output (default timing_results.csv), 'none' to skip\n"
+              << "  --json FILE       JSON output for scripts (default none)\n"
+              << "  --list            list the registered versions and exit\n"
+              << "  --help            show this message" << std::endl;
+}
+
+std::vector<std::string> splitList(const std::string& list) {
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (!item.empty()) items.push_back(item);
+    }
+    if (items.empty()) throw std::invalid_argument("empty list");
+    return items;
+}
+
+int parseCount(const std::string& text, int minimum, const std::string& what) {
+    size_t used = 0;
+    int value = 0;
+    try {
+        value = std::stoi(text, &used);
+    } catch (const std::exception&) {
+        used = 0;
+    }
+    if (used == 0 || used != text.size() || value < minimum) {
+        throw std::invalid_argument("invalid " + what + " '" + text + "'");
+    }
+    return value;
+}
+
+// "AxB" or "A" (for AxA)
+std::pair<int, int> parseShape(const std::string& text, const std::string& what) {
+    size_t x = text.find('x');
+    if (x == std::string::npos) {
+        int n = parseCount(text, 1, what);
+        return {n, n};
+    }
+    return {parseCount(text.substr(0, x), 1, what), parseCount(text.substr(x + 1), 1, what)};
+}
+
+// Parse the timing options; throws std::invalid_argument on a bad argument
+TimingOptions parseOptions(int argc, char** argv, const MedianFilterTimer& timer) {
+    TimingOptions options;
+    
+    for(int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) throw std::invalid_argument("unknown option or missing value: " + arg);
+        std::string value = argv[++i];
+        
+        if (arg == "--sizes") {
+            options.sizes.clear();
+            for(const auto& item : splitList(value)) options.sizes.push_back(parseShape(item, "image size"));
+        } else if (arg == "--kernels") {
+            options.kernels.clear();
+            for(const auto& item : splitList(value)) {
+                auto kernel = parseShape(item, "kernel size");
+                if (kernel.first % 2 == 0 || kernel.second % 2 == 0) {
+                    throw std::invalid_argument("kernel sizes must be odd: '" + item + "'");
+                }
+                options.kernels.push_back({kernel.first / 2, kernel.second / 2});
+            }
+        } else if (arg == "--dtypes") {
+            options.dataTypes.clear();
+            for(const auto& item : splitList(value)) {
+                if (item == "float") options.dataTypes.push_back(DataType::FLOAT);
+                else if (item == "uint8") options.dataTypes.push_back(DataType::UINT8);
+                else if (item == "uint16") options.dataTypes.push_back(DataType::UINT16);
+                else throw std::invalid_argument("unknown dtype '" + item + "'");
+            }
+        } else if (arg == "--patterns") {
+            options.patterns = splitList(value);
+            for(const auto& item : options.patterns) {
+                if (std::find(std::begin(kPatterns), std::end(kPatterns), item) == std::end(kPatterns)) {
+                    throw std::invalid_argument("unknown pattern '" + item + "'");
+                }
+            }
+        } else if (arg == "--versions") {
+            options.versions = splitList(value);
+            for(const auto& item : options.versions) {
+                auto named = [&](const FilterVersion& version) { return version.name == item; };
+                if (std::none_of(timer.versions().begin(), timer.versions().end(), named)) {
+                    throw std::invalid_argument("unknown version '" + item + "' (see --list)");
+                }
+            }
+        } else if (arg == "--threads") {
+            options.threads.clear();
+            for(const auto& item : splitList(value)) options.threads.push_back(parseCount(item, 0, "thread count"));
+        } else if (arg == "--runs") {
+            options.runs = parseCount(value, 1, "run count");
+        } else if (arg == "--warmup") {
+            options.warmup = parseCount(value, 0, "warm-up count");
+        } else if (arg == "--csv") {
+            options.csvFile = value == "none" ? "" : value;
+        } else if (arg == "--json") {
+            options.jsonFile = value;
+        } else {
+            throw std::invalid_argument("unknown option: " + arg);
+        }
+    }
+    
+    return options;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && std::strcmp(argv[1], "--calibrate") == 0) {
+        std::cout << "Calibrating dispatcher cost model..." << std::endl;
+        calibrateDispatcher(argc > 2 ? argv[2] : "median_dispatch.csv", "median_dispatch.inc");
+        return 0;
+    }
     
     MedianFilterTimer timer;
     
+    for(int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--help") == 0 || std::strcmp(argv[i], "-h") == 0) {
+            printUsage(argv[0]);
+            return 0;
+        }
+        if (std::strcmp(argv[i], "--list") == 0) {
+            for(const auto& version : timer.versions()) {
+                std::cout << std::left << std::setw(8) << version.name << std::setw(8) << dataTypeName(version.dataType)
+                          << version.description << std::endl;
+            }
+            return 0;
+        }
+    }
+    
+    TimingOptions options;
+    try {
+        options = parseOptions(argc, argv, timer);
+    } catch (const std::invalid_argument& e) {
+        std::cerr << "Error: " << e.what() << std::endl << std::endl;
+        printUsage(argv[0]);
+        return 1;
+    }
+    
+    std::cout << "Median Filter Timing Benchmark" << std::endl;
+    std::cout << "==============================" << std::endl;
+    
     // Run timing benchmark
-    auto results = timer.runTimingBenchmark(500, 500, 5);
+    auto results = timer.runTimingBenchmark(options);
     
     // Save results
-    timer.saveResultsToCSV(results, "timing_results.csv");
+    if (!options.jsonFile.empty()) {
+        timer.saveResultsToJSON(results, options, options.jsonFile);
+    }
+    if (!options.csvFile.empty()) {
+        timer.saveResultsToCSV(results, options.csvFile);
+    }
     
     // Print summary
     timer.printSummary(results);
     
+    if (options.csvFile.empty() || results.empty()) return 0;
+    
     // Generate plotting script
-    generatePlotScript("timing_results.csv");
+    generatePlotScript(options.csvFile, options.runs);
     
     std::cout << "\nTo generate the plot, run:" << std::endl;
     std::cout << "python3 plot_timing.py" << std::endl;